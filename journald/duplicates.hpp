@@ -0,0 +1,113 @@
+#ifndef __JOURNALD_DUPLICATES_HPP__
+#define __JOURNALD_DUPLICATES_HPP__
+
+#include <stdint.h>
+
+#include <string>
+
+#include <stout/duration.hpp>
+#include <stout/none.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// Collapses the consecutive duplicate lines of a stream, for the
+// `--duplicate_window` of both companions. The first occurrence of a
+// line is written, and the duplicates that follow it within the window
+// are only counted, then written as a single
+// "Last message repeated N times" entry.
+//
+// NOTE: This is header-only and does not use libprocess, so that the
+// minimal companion can use it. The times are given by the caller, as
+// durations since any fixed point in time.
+class Duplicates
+{
+public:
+  explicit Duplicates(const Duration& _window)
+    : window(_window),
+      repeated(0) {}
+
+  // Returns whether `line`, seen at `now`, repeats the last line within
+  // the window, in which case it is only counted. Otherwise `line`
+  // becomes the last line, and the summary of the duplicates of the
+  // previous one, if any, is set in `summary`, to be written first.
+  // The lines are compared by their length first, which tells most of
+  // the lines that differ apart without reading them.
+  bool duplicate(
+      const std::string& line,
+      const Duration& now,
+      Option<std::string>* summary)
+  {
+    if (last.isSome() &&
+        line.size() == last->size() &&
+        now - lastTime < window &&
+        line == last.get()) {
+      repeated++;
+      return true;
+    }
+
+    *summary = summarize();
+
+    last = line;
+    lastTime = now;
+
+    return false;
+  }
+
+  // Returns the number of duplicates of the last line counted so far.
+  uint64_t count() const { return repeated; }
+
+  // Returns when the window of the last line expires, if any of its
+  // duplicates were counted.
+  Option<Duration> expiry() const
+  {
+    if (repeated == 0) {
+      return None();
+    }
+
+    return lastTime + window;
+  }
+
+  // Returns the summary of the duplicates of the last line, if any, as
+  // its window expired. The next occurrence of the line is written.
+  Option<std::string> expire()
+  {
+    last = None();
+    return summarize();
+  }
+
+  // Returns the summary of the duplicates of the last line, if any, and
+  // starts counting them from zero.
+  Option<std::string> summarize()
+  {
+    if (repeated == 0) {
+      return None();
+    }
+
+    const std::string summary =
+      "Last message repeated " + stringify(repeated) + " times";
+
+    repeated = 0;
+
+    return summary;
+  }
+
+private:
+  Duration window;
+
+  // The last line written, along with the time it was written at, and
+  // the number of its duplicates counted since.
+  Option<std::string> last;
+  Duration lastTime;
+  uint64_t repeated;
+};
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_DUPLICATES_HPP__
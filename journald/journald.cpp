@@ -5,19 +5,25 @@
 
 #include <systemd/sd-journal.h>
 
+#include <process/clock.hpp>
+#include <process/delay.hpp>
 #include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/io.hpp>
 #include <process/process.hpp>
+#include <process/time.hpp>
 
 #include <stout/error.hpp>
 #include <stout/exit.hpp>
+#include <stout/foreach.hpp>
 #include <stout/nothing.hpp>
+#include <stout/stringify.hpp>
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
 #include <stout/os/pagesize.hpp>
 
+#include "duplicates.hpp"
 #include "journald.hpp"
 
 
@@ -29,8 +35,13 @@ class JournaldLoggerProcess : public Process<JournaldLoggerProcess>
 {
 public:
   JournaldLoggerProcess(const Flags& _flags)
-    : flags(_flags)
+    : flags(_flags),
+      sequence(0)
   {
+    if (flags.duplicate_window.isSome()) {
+      duplicates = Duplicates(flags.duplicate_window.get());
+    }
+
     // Prepare a buffer for reading from the `incoming` pipe.
     length = os::pagesize();
     buffer = new char[length];
@@ -96,6 +107,7 @@ public:
         // This indicates that the container (whose logs are being
         // piped to this process) has exited.
         if (readSize <= 0) {
+          summarize();
           promise.set(Nothing());
           return Nothing();
         }
@@ -128,18 +140,81 @@ public:
         continue;
       }
 
-      const std::string entry = "MESSAGE=" + line;
-
-      entries[num_entries - 1].iov_len = entry.length();
-      entries[num_entries - 1].iov_base = const_cast<char*>(entry.c_str());
+      if (duplicates.isSome() && duplicate(line)) {
+        continue;
+      }
 
-      sd_journal_sendv(entries, num_entries);
+      send(line);
     }
 
     // Even if the write fails, we ignore the error.
     return Nothing();
   }
 
+  // Returns whether the line repeats the previous one within the
+  // `--duplicate_window`, in which case it is only counted.
+  bool duplicate(const std::string& line)
+  {
+    const Duration now = Clock::now().duration();
+
+    Option<std::string> summary;
+    if (duplicates->duplicate(line, now, &summary)) {
+      // Once the first duplicate is counted, the summary is written
+      // when the window expires, in case no other line comes.
+      if (duplicates->count() == 1) {
+        delay(
+            duplicates->expiry().get() - now,
+            self(),
+            &JournaldLoggerProcess::expire,
+            sequence);
+      }
+
+      return true;
+    }
+
+    if (summary.isSome()) {
+      send(summary.get());
+    }
+
+    sequence++;
+
+    return false;
+  }
+
+  // Writes the summary of the duplicates of the line whose window
+  // expired, unless another line came since.
+  void expire(uint64_t _sequence)
+  {
+    if (_sequence == sequence) {
+      Option<std::string> summary = duplicates->expire();
+      if (summary.isSome()) {
+        send(summary.get());
+      }
+    }
+  }
+
+  // Writes the number of duplicates of the last line, if any.
+  void summarize()
+  {
+    if (duplicates.isSome()) {
+      Option<std::string> summary = duplicates->summarize();
+      if (summary.isSome()) {
+        send(summary.get());
+      }
+    }
+  }
+
+  // Writes a line to journald, along with the labels.
+  void send(const std::string& line)
+  {
+    const std::string entry = "MESSAGE=" + line;
+
+    entries[num_entries - 1].iov_len = entry.length();
+    entries[num_entries - 1].iov_base = const_cast<char*>(entry.c_str());
+
+    sd_journal_sendv(entries, num_entries);
+  }
+
 private:
   Flags flags;
 
@@ -154,6 +229,12 @@ private:
   int num_entries;
   struct iovec* entries;
 
+  // The duplicates of the last line written to journald, if they are
+  // collapsed. The sequence identifies the line, for its window to
+  // expire.
+  Option<Duplicates> duplicates;
+  uint64_t sequence;
+
   // Used to capture when the logging has completed because the
   // underlying process/input has terminated.
   Promise<Nothing> promise;
@@ -7,6 +7,7 @@
 
 #include <mesos/mesos.hpp>
 
+#include <stout/duration.hpp>
 #include <stout/error.hpp>
 #include <stout/flags.hpp>
 #include <stout/json.hpp>
@@ -20,6 +21,10 @@ namespace logger {
 
 const std::string NAME = "mesos-journald-logger";
 
+// Name of the minimal build of the companion, which has the same flags
+// but does not link libmesos. See `minimal.cpp`.
+const std::string MINIMAL_NAME = "mesos-journald-logger-minimal";
+
 struct Flags : public virtual flags::FlagsBase
 {
   Flags()
@@ -65,10 +70,20 @@ struct Flags : public virtual flags::FlagsBase
           parsed_labels = _labels.get();
           return None();
         });
+
+    add(&duplicate_window,
+        "duplicate_window",
+        "Window within which consecutive duplicate lines are collapsed.\n"
+        "The first occurrence of a line is written to journald, and the\n"
+        "duplicates that follow it within the window are counted and\n"
+        "written as a single 'Last message repeated N times' entry.\n"
+        "Duplicates are not collapsed if not set.\n");
   }
 
   Option<std::string> labels;
 
+  Option<Duration> duplicate_window;
+
   // Values populated during validation.
   Labels parsed_labels;
 };
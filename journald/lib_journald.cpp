@@ -1,6 +1,13 @@
 #include <map>
 #include <string>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <systemd/sd-journal.h>
+
 #include <mesos/mesos.hpp>
 
 #include <mesos/module/container_logger.hpp>
@@ -9,6 +16,7 @@
 
 #include <process/dispatch.hpp>
 #include <process/future.hpp>
+#include <process/owned.hpp>
 #include <process/process.hpp>
 #include <process/subprocess.hpp>
 
@@ -18,9 +26,10 @@
 #include <stout/path.hpp>
 #include <stout/stringify.hpp>
 
+#include <stout/os/close.hpp>
 #include <stout/os/environment.hpp>
-#include <stout/os/fcntl.hpp>
 #include <stout/os/killtree.hpp>
+#include <stout/os/strerror.hpp>
 
 #include "journald.hpp"
 #include "lib_journald.hpp"
@@ -68,6 +77,9 @@ public:
     // same environment used to launch the agent (also uses libmesos).
     // The libprocess port is explicitly removed because this
     // will conflict with the already-running agent.
+    //
+    // NOTE: The minimal companion does not link libmesos, the
+    // environment is passed on all the same.
     std::map<std::string, std::string> environment = os::environment();
     environment.erase("LIBPROCESS_PORT");
     environment.erase("LIBPROCESS_ADVERTISE_PORT");
@@ -141,14 +153,23 @@ public:
         executorInfo.executor_id().value());
     labels.add_labels()->CopyFrom(label);
 
+    if (flags.direct_stream) {
+      return stream(label.value());
+    }
+
     // NOTE: We manually construct a pipe here instead of using
     // `Subprocess::PIPE` so that the ownership of the FDs is properly
     // represented.  The `Subprocess` spawned below owns the read-end
     // of the pipe and will be solely responsible for closing that end.
     // The ownership of the write-end will be passed to the caller
     // of this function.
+    //
+    // NOTE: Both ends are created with `O_CLOEXEC`, rather than set
+    // with `cloexec` afterwards, so that a companion forked by another
+    // preparer in between does not inherit them. The read-end is still
+    // handed to the companion, as `dup2` clears the flag on its stdin.
     int pipefd[2];
-    if (::pipe(pipefd) == -1) {
+    if (::pipe2(pipefd, O_CLOEXEC) == -1) {
       return Failure(ErrnoError("Failed to create pipe").message);
     }
 
@@ -156,22 +177,13 @@ public:
     outfds.read = pipefd[0];
     outfds.write = pipefd[1];
 
-    // NOTE: We need to `cloexec` this FD so that it will be closed when
-    // the child subprocess is spawned and so that the FD will not be
-    // inherited by the second child for stderr.
-    Try<Nothing> cloexec = os::cloexec(outfds.write.get());
-    if (cloexec.isError()) {
-      os::close(outfds.read);
-      os::close(outfds.write.get());
-      return Failure("Failed to cloexec: " + cloexec.error());
-    }
-
     label.set_key("STREAM");
     label.set_value("STDOUT");
     labels.add_labels()->CopyFrom(label);
 
     mesos::journald::logger::Flags outFlags;
     outFlags.labels = stringify(JSON::protobuf(labels));
+    outFlags.duplicate_window = flags.duplicate_window;
 
     // If we are on systemd, then extend the life of the process as we
     // do with the executor. Any grandchildren's lives will also be
@@ -182,10 +194,14 @@ public:
           &systemd::mesos::extendLifetime));
     }
 
+    const std::string companion = flags.minimal_companion
+      ? mesos::journald::logger::MINIMAL_NAME
+      : mesos::journald::logger::NAME;
+
     // Spawn a process to handle stdout.
     Try<Subprocess> outProcess = subprocess(
-        path::join(flags.companion_dir, mesos::journald::logger::NAME),
-        {mesos::journald::logger::NAME},
+        path::join(flags.companion_dir, companion),
+        {companion},
         Subprocess::FD(outfds.read, Subprocess::IO::OWNED),
         Subprocess::PATH("/dev/null"),
         Subprocess::FD(STDERR_FILENO),
@@ -201,8 +217,8 @@ public:
     }
 
     // NOTE: We manually construct a pipe here to properly express
-    // ownership of the FDs.  See the NOTE above.
-    if (::pipe(pipefd) == -1) {
+    // ownership of the FDs.  See the NOTEs above.
+    if (::pipe2(pipefd, O_CLOEXEC) == -1) {
       os::close(outfds.write.get());
       os::killtree(outProcess.get().pid(), SIGKILL);
       return Failure(ErrnoError("Failed to create pipe").message);
@@ -212,17 +228,6 @@ public:
     errfds.read = pipefd[0];
     errfds.write = pipefd[1];
 
-    // NOTE: We need to `cloexec` this FD so that it will be closed when
-    // the child subprocess is spawned.
-    cloexec = os::cloexec(errfds.write.get());
-    if (cloexec.isError()) {
-      os::close(outfds.write.get());
-      os::close(errfds.read);
-      os::close(errfds.write.get());
-      os::killtree(outProcess.get().pid(), SIGKILL);
-      return Failure("Failed to cloexec: " + cloexec.error());
-    }
-
     labels.mutable_labels()->DeleteSubrange(labels.labels().size() - 1, 1);
     label.set_key("STREAM");
     label.set_value("STDERR");
@@ -230,11 +235,12 @@ public:
 
     mesos::journald::logger::Flags errFlags;
     errFlags.labels = stringify(JSON::protobuf(labels));
+    errFlags.duplicate_window = flags.duplicate_window;
 
     // Spawn a process to handle stderr.
     Try<Subprocess> errProcess = subprocess(
-        path::join(flags.companion_dir, mesos::journald::logger::NAME),
-        {mesos::journald::logger::NAME},
+        path::join(flags.companion_dir, companion),
+        {companion},
         Subprocess::FD(errfds.read, Subprocess::IO::OWNED),
         Subprocess::PATH("/dev/null"),
         Subprocess::FD(STDERR_FILENO),
@@ -259,23 +265,86 @@ public:
   }
 
 protected:
+  // Connects the stdout and stderr of the container to journald
+  // directly, with a stream socket each. Journald tags the lines of
+  // the stream with the identifier and the priority given in the
+  // header of the stream, which is all the stream protocol carries.
+  Future<SubprocessInfo> stream(const std::string& identifier)
+  {
+    Try<int> outfd = connect(identifier, LOG_INFO);
+    if (outfd.isError()) {
+      return Failure(outfd.error());
+    }
+
+    Try<int> errfd = connect(identifier, LOG_ERR);
+    if (errfd.isError()) {
+      os::close(outfd.get());
+      return Failure(errfd.error());
+    }
+
+    // NOTE: The ownership of these FDs is given to the caller of this function.
+    ContainerLogger::SubprocessInfo info;
+    info.out = SubprocessInfo::IO::FD(outfd.get());
+    info.err = SubprocessInfo::IO::FD(errfd.get());
+    return info;
+  }
+
+  // Opens a stream socket of journald, explaining the errors that
+  // come from journald not accepting the stream.
+  static Try<int> connect(const std::string& identifier, int priority)
+  {
+    int fd = sd_journal_stream_fd(identifier.c_str(), priority, 0);
+    if (fd >= 0) {
+      return fd;
+    }
+
+    const std::string error =
+      "Failed to connect to the stream socket of journald: " +
+      os::strerror(-fd);
+
+    switch (-fd) {
+      case ENOENT:
+      case ECONNREFUSED:
+        return Error(
+            error + " (is systemd-journald listening on"
+            " '/run/systemd/journal/stdout'?)");
+      case EPIPE:
+      case ECONNRESET:
+        // Journald closes the streams it accepts beyond its limit,
+        // `STDOUT_STREAMS_MAX`, right away.
+        return Error(
+            error + " (journald might hold as many streams as it"
+            " accepts, 4096 by default)");
+      default:
+        return Error(error);
+    }
+  }
+
   Flags flags;
 };
 
 
 JournaldContainerLogger::JournaldContainerLogger(const Flags& _flags)
   : flags(_flags),
-    process(new JournaldContainerLoggerProcess(flags))
+    next(0)
 {
-  // Spawn and pass validated parameters to the process.
-  spawn(process.get());
+  // Spawn and pass validated parameters to the processes.
+  for (size_t i = 0; i < flags.preparers; i++) {
+    processes.emplace_back(new JournaldContainerLoggerProcess(flags));
+    spawn(processes.back().get());
+  }
 }
 
 
 JournaldContainerLogger::~JournaldContainerLogger()
 {
-  terminate(process.get());
-  wait(process.get());
+  foreach (const Owned<JournaldContainerLoggerProcess>& process, processes) {
+    terminate(process.get());
+  }
+
+  foreach (const Owned<JournaldContainerLoggerProcess>& process, processes) {
+    wait(process.get());
+  }
 }
 
 
@@ -288,8 +357,12 @@ Future<SubprocessInfo> JournaldContainerLogger::prepare(
     const ExecutorInfo& executorInfo,
     const std::string& sandboxDirectory)
 {
+  // The processes are independent, so the containers are simply handed
+  // out to them in turn.
+  const size_t index = next++ % processes.size();
+
   return dispatch(
-      process.get(),
+      processes[index].get(),
       &JournaldContainerLoggerProcess::prepare,
       executorInfo,
       sandboxDirectory);
@@ -328,5 +401,17 @@ com_mesosphere_mesos_JournaldLogger(
         LOG(WARNING) << warning.message;
       }
 
+      if (flags.minimal_companion) {
+        const std::string executablePath = path::join(
+            flags.companion_dir,
+            mesos::journald::logger::MINIMAL_NAME);
+
+        if (!os::exists(executablePath)) {
+          LOG(ERROR) << "Failed to parse parameters: Cannot find: "
+                     << executablePath;
+          return nullptr;
+        }
+      }
+
       return new mesos::journald::JournaldContainerLogger(flags);
     });
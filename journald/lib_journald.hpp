@@ -3,8 +3,12 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <vector>
+
 #include <mesos/slave/container_logger.hpp>
 
+#include <stout/duration.hpp>
 #include <stout/flags.hpp>
 #include <stout/option.hpp>
 
@@ -54,11 +58,66 @@ struct Flags : public virtual flags::FlagsBase
 
           return None();
         });
+
+    add(&preparers,
+        "preparers",
+        "Number of actors preparing the companion processes of the\n"
+        "containers.  The containers are handed out to them in turn, so\n"
+        "that the pipes, the forks and the serialization of the labels\n"
+        "of a burst of containers run concurrently.\n"
+        "Defaults to 1.  Must be at least 1.",
+        1u,
+        [](const size_t& value) -> Option<Error> {
+          if (value < 1u) {
+            return Error("Expected --preparers of at least 1");
+          }
+
+          return None();
+        });
+
+    add(&direct_stream,
+        "direct_stream",
+        "Whether to hand the containers a stream socket of journald,\n"
+        "as `sd_journal_stream_fd` does, instead of spawning companion\n"
+        "processes.  The stream protocol of journald carries no custom\n"
+        "fields, so only the 'SYSLOG_IDENTIFIER' and the priority (info\n"
+        "for stdout, error for stderr) are attached to the logs, and\n"
+        "journald attributes them ('_PID', '_COMM', '_SYSTEMD_UNIT') to\n"
+        "the agent, which opened the streams.  Journald accepts at most\n"
+        "4096 streams ('STDOUT_STREAMS_MAX') across all the processes of\n"
+        "the host, and each container takes two, so this stops at about\n"
+        "2000 containers per host.\n"
+        "Defaults to false.",
+        false);
+
+    add(&minimal_companion,
+        "minimal_companion",
+        "Whether to spawn the minimal build of the companion binary,\n"
+        "'" + mesos::journald::logger::MINIMAL_NAME + "', which does not\n"
+        "link libmesos nor start libprocess.  It needs to be located in\n"
+        "the '--companion_dir' as well.  Defaults to false.",
+        false);
+
+    add(&duplicate_window,
+        "duplicate_window",
+        "Window within which the companion processes collapse consecutive\n"
+        "duplicate lines of a container into a single entry counting\n"
+        "them.  See the '--duplicate_window' flag of the '" +
+        mesos::journald::logger::NAME + "'\n"
+        "binary.  Duplicates are not collapsed if not set.");
   }
 
   std::string companion_dir;
 
   size_t libprocess_num_worker_threads;
+
+  size_t preparers;
+
+  bool direct_stream;
+
+  bool minimal_companion;
+
+  Option<Duration> duplicate_window;
 };
 
 
@@ -93,7 +152,10 @@ public:
 
 protected:
   Flags flags;
-  process::Owned<JournaldContainerLoggerProcess> process;
+
+  // The actors preparing the containers, in turn.
+  std::vector<process::Owned<JournaldContainerLoggerProcess>> processes;
+  std::atomic<size_t> next;
 };
 
 } // namespace journald {
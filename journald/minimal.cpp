@@ -0,0 +1,325 @@
+// Minimal companion of the journald ContainerLogger module. It has the
+// same contract as `mesos-journald-logger` (the `--labels` and the
+// `--duplicate_window` flags, the logs on STDIN) but does not link
+// libmesos nor start libprocess: a single thread blocks in `poll` on
+// STDIN and writes each line to journald with `sd_journal_sendv`.
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/uio.h> // For `struct iovec`.
+
+#include <systemd/sd-journal.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stout/duration.hpp>
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/json.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/strings.hpp>
+#include <stout/try.hpp>
+
+#include "duplicates.hpp"
+
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using mesos::journald::logger::Duplicates;
+
+const string NAME = "mesos-journald-logger-minimal";
+
+// Size of the reads from STDIN, and the longest line written as a
+// single entry. Longer lines are split into several entries.
+constexpr size_t BUFFER_SIZE = 4096;
+
+
+struct Options
+{
+  // The labels, as `KEY=value` journald fields.
+  vector<string> fields;
+
+  Option<Duration> duplicateWindow;
+
+  bool help;
+};
+
+
+// Parses the `--labels` flag, the jsonified `Labels` protobuf, into
+// journald fields. The keys are converted to uppercase.
+static Try<vector<string>> parseLabels(const string& value)
+{
+  Try<JSON::Object> json = JSON::parse<JSON::Object>(value);
+  if (json.isError()) {
+    return Error("Failed to parse --labels as JSON: " + json.error());
+  }
+
+  vector<string> fields;
+
+  Result<JSON::Array> labels = json->find<JSON::Array>("labels");
+  if (labels.isError()) {
+    return Error("Failed to parse --labels: " + labels.error());
+  }
+
+  if (labels.isNone()) {
+    return fields;
+  }
+
+  foreach (const JSON::Value& label, labels->values) {
+    if (!label.is<JSON::Object>()) {
+      return Error("Failed to parse --labels: a label is not an object");
+    }
+
+    const JSON::Object& object = label.as<JSON::Object>();
+
+    Result<JSON::String> key = object.find<JSON::String>("key");
+    Result<JSON::String> _value = object.find<JSON::String>("value");
+
+    if (!key.isSome()) {
+      return Error("Failed to parse --labels: a label has no key");
+    }
+
+    fields.push_back(
+        strings::upper(key->value) + "=" +
+        (_value.isSome() ? _value->value : ""));
+  }
+
+  return fields;
+}
+
+
+// Parses the flags the way stout does for `mesos-journald-logger`, as
+// `--<name>=<value>`. The module passes all the flags of the companion,
+// `--help=false` included, and the flags this build does not know are
+// ignored rather than failing the container.
+static Try<Options> parse(int argc, char** argv)
+{
+  Options options;
+  options.help = false;
+
+  for (int i = 1; i < argc; i++) {
+    const string argument = argv[i];
+
+    if (strings::startsWith(argument, "--labels=")) {
+      Try<vector<string>> fields =
+        parseLabels(argument.substr(string("--labels=").size()));
+
+      if (fields.isError()) {
+        return Error(fields.error());
+      }
+
+      options.fields = fields.get();
+    } else if (strings::startsWith(argument, "--duplicate_window=")) {
+      Try<Duration> window =
+        Duration::parse(argument.substr(string("--duplicate_window=").size()));
+
+      if (window.isError()) {
+        return Error(
+            "Failed to parse --duplicate_window: " + window.error());
+      }
+
+      options.duplicateWindow = window.get();
+    } else if (argument == "--help" || argument == "--help=true") {
+      options.help = true;
+    } else if (argument == "--no-help" || argument == "--help=false") {
+      options.help = false;
+    } else {
+      cerr << "Ignoring unknown flag '" << argument << "'" << endl;
+    }
+  }
+
+  return options;
+}
+
+
+static Duration now()
+{
+  struct timespec time;
+  ::clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return Seconds(time.tv_sec) + Nanoseconds(time.tv_nsec);
+}
+
+
+// Writes the lines to journald along with the labels, collapsing the
+// consecutive duplicates within the `--duplicate_window` the same way
+// `mesos-journald-logger` does.
+class Writer
+{
+public:
+  Writer(const Options& _options)
+    : options(_options),
+      entries(options.fields.size() + 1)
+  {
+    for (size_t i = 0; i < options.fields.size(); i++) {
+      entries[i].iov_base = const_cast<char*>(options.fields[i].c_str());
+      entries[i].iov_len = options.fields[i].length();
+    }
+
+    if (options.duplicateWindow.isSome()) {
+      duplicates = Duplicates(options.duplicateWindow.get());
+    }
+  }
+
+  void write(const string& line)
+  {
+    if (line.empty()) {
+      return;
+    }
+
+    if (duplicates.isSome()) {
+      Option<string> summary;
+      if (duplicates->duplicate(line, now(), &summary)) {
+        return;
+      }
+
+      if (summary.isSome()) {
+        send(summary.get());
+      }
+    }
+
+    send(line);
+  }
+
+  // Returns how long `poll` can wait before the window of the counted
+  // duplicates expires, or -1 if there are none.
+  int timeout()
+  {
+    if (duplicates.isNone() || duplicates->expiry().isNone()) {
+      return -1;
+    }
+
+    const Duration left = duplicates->expiry().get() - now();
+
+    return left > Duration::zero() ? (int) left.ms() + 1 : 0;
+  }
+
+  // Writes the summary of the duplicates of the last line if its
+  // window expired, or unconditionally if `force`.
+  void expire(bool force)
+  {
+    if (duplicates.isNone() || duplicates->expiry().isNone()) {
+      return;
+    }
+
+    if (force || now() >= duplicates->expiry().get()) {
+      Option<string> summary = duplicates->expire();
+      if (summary.isSome()) {
+        send(summary.get());
+      }
+    }
+  }
+
+private:
+  void send(const string& line)
+  {
+    const string entry = "MESSAGE=" + line;
+
+    entries.back().iov_base = const_cast<char*>(entry.c_str());
+    entries.back().iov_len = entry.length();
+
+    // Even if the write fails, we ignore the error.
+    sd_journal_sendv(entries.data(), entries.size());
+  }
+
+  const Options options;
+
+  // Used as arguments for `sd_journal_sendv`, the labels followed by
+  // the message.
+  vector<struct iovec> entries;
+
+  Option<Duplicates> duplicates;
+};
+
+
+int main(int argc, char** argv)
+{
+  const string usage =
+    "Usage: " + NAME + " [--labels=<json>] [--duplicate_window=<duration>]";
+
+  Try<Options> options = parse(argc, argv);
+  if (options.isError()) {
+    cerr << usage << endl << options.error() << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (options->help) {
+    cout << usage << endl;
+    return EXIT_SUCCESS;
+  }
+
+  Writer writer(options.get());
+
+  char buffer[BUFFER_SIZE];
+
+  // The end of the last read that is not a full line yet.
+  string pending;
+
+  while (true) {
+    struct pollfd fd;
+    fd.fd = STDIN_FILENO;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int ready = ::poll(&fd, 1, writer.timeout());
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      cerr << "Failed to poll STDIN: " << ::strerror(errno) << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (ready == 0) {
+      writer.expire(false);
+      continue;
+    }
+
+    ssize_t length = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+
+      cerr << "Failed to read STDIN: " << ::strerror(errno) << endl;
+      return EXIT_FAILURE;
+    }
+
+    // EOF indicates that the container (whose logs are being piped to
+    // this process) has exited.
+    if (length == 0) {
+      writer.write(pending);
+      writer.expire(true);
+
+      return EXIT_SUCCESS;
+    }
+
+    pending.append(buffer, length);
+
+    size_t start = 0;
+    size_t end;
+    while ((end = pending.find('\n', start)) != string::npos) {
+      writer.write(pending.substr(start, end - start));
+      start = end + 1;
+    }
+
+    pending.erase(0, start);
+
+    if (pending.size() >= BUFFER_SIZE) {
+      writer.write(pending);
+      pending.clear();
+    }
+  }
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <list>
 #include <sstream>
 #include <set>
@@ -7,27 +8,35 @@
 #include <stout/check.hpp>
 #include <stout/duration.hpp>
 #include <stout/foreach.hpp>
+#include <stout/hashset.hpp>
 #include <stout/ip.hpp>
 #include <stout/json.hpp>
 #include <stout/jsonify.hpp>
+#include <stout/mac.hpp>
 #include <stout/os.hpp>
 #include <stout/os/exists.hpp>
 #include <stout/os/write.hpp>
 #include <stout/protobuf.hpp>
+#include <stout/strings.hpp>
 #include <stout/try.hpp>
 
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
 #include <process/delay.hpp>
+#include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/help.hpp>
 #include <process/http.hpp>
 #include <process/io.hpp>
+#include <process/metrics/gauge.hpp>
+#include <process/metrics/metrics.hpp>
 #include <process/owned.hpp>
 #include <process/pid.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
 #include <process/subprocess.hpp>
+#include <process/time.hpp>
 
 #include <mesos/http.hpp>
 #include <mesos/master/detector.hpp>
@@ -36,8 +45,11 @@
 #include <mesos/module/anonymous.hpp>
 
 #include "constants.hpp"
+#include "ipam.hpp"
 #include "messages.hpp"
+#include "netlink.hpp"
 #include "overlay.hpp"
+#include "prober.hpp"
 
 #include "common/shell.hpp"
 
@@ -56,7 +68,9 @@ using net::IP;
 using net::IPNetwork;
 
 using process::delay;
+using process::dispatch;
 
+using process::Clock;
 using process::DESCRIPTION;
 using process::Future;
 using process::Failure;
@@ -64,9 +78,11 @@ using process::HELP;
 using process::Owned;
 using process::Promise;
 using process::Subprocess;
+using process::Time;
 using process::TLDR;
 using process::UPID;
 using process::USAGE;
+using process::metrics::Gauge;
 
 using mesos::Parameters;
 
@@ -79,13 +95,20 @@ using mesos::modules::Module;
 using mesos::modules::overlay::AgentOverlayInfo;
 using mesos::modules::overlay::AgentInfo;
 using mesos::modules::overlay::BridgeInfo;
+using mesos::modules::overlay::CountersInfo;
+using mesos::modules::overlay::GeneveInfo;
 using mesos::modules::overlay::MESOS_MASTER;
 using mesos::modules::overlay::MESOS_ZK;
+using mesos::modules::overlay::TrafficInfo;
+using mesos::modules::overlay::VxLANInfo;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::BandwidthLimit;
+using mesos::modules::overlay::internal::ProbeConfig;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RequestSubnetMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 
 namespace mesos {
@@ -96,6 +119,85 @@ namespace agent {
 constexpr Duration REGISTRATION_RETRY_INTERVAL_MAX = Minutes(10);
 constexpr Duration INITIAL_BACKOFF_PERIOD = Seconds(5);
 
+// Directory where the `host-local` IPAM plugin keeps its leases.
+constexpr char CNI_HOST_LOCAL_DIR[] = "/var/lib/cni/networks";
+
+// CNI plugin attaching the containers to the Mesos bridge with batched
+// netlink requests, built along with the module.
+constexpr char CNI_OVERLAY_PLUGIN[] = "mesos-overlay-cni";
+
+// Interval at which the leases of the Mesos networks are checked, and
+// the percentage of their addresses that can be leased before a
+// secondary subnet is requested.
+constexpr Duration SUBNET_CHECK_INTERVAL = Seconds(30);
+constexpr size_t SUBNET_USAGE_THRESHOLD = 90;
+
+// Interval at which the bandwidth limits of the overlays are applied
+// to their links, which the agent does not create itself, and their
+// traffic is sampled.
+constexpr Duration SHAPING_INTERVAL = Seconds(10);
+
+// Interval at which the counters of the bridges of the overlays are
+// sampled.
+constexpr Duration COUNTERS_INTERVAL = Seconds(10);
+
+// Interval at which the state of the Master, which holds all the
+// Agents, is fetched. It is fetched once for the direct routes, the
+// Geneve tunnels, the neighbours of the VTEP and the peers of the
+// prober, which are synchronized with it.
+constexpr Duration AGENTS_INTERVAL = Minutes(1);
+
+// Interval at which the peers probed are sampled from the state of the
+// Master.
+constexpr Duration PROBE_PEERS_INTERVAL = Minutes(5);
+
+// Routing table of the direct routes, and priority of the rules that
+// look the overlays up in it before the main table, where the routes
+// through the VTEP are.
+constexpr uint32_t HOST_GW_TABLE = 1024;
+constexpr uint32_t HOST_GW_RULE_PRIORITY = 32000;
+
+// Routing table of the tunnels to the other Agents, and priority of
+// the rules that look the overlays and the VTEPs up in it, after the
+// direct routes.
+constexpr uint32_t GENEVE_TABLE = 1025;
+constexpr uint32_t GENEVE_RULE_PRIORITY = 32001;
+
+// The classes of the overlays on a VTEP have a filter for each one of
+// their subnets, whose handle holds 4 bits of the index of the subnet
+// and 8 bits of the class.
+constexpr int MAX_SHAPED_OVERLAYS = 255;
+constexpr size_t MAX_SHAPED_SUBNETS = 16;
+
+
+// Matches of the single iptables rule masquerading the traffic from the
+// overlay subnets, see `AgentConfig::IPSET`.
+static string IPSET_MASQUERADE_MATCH()
+{
+  return "-m set ! --match-set " + string(IPSET_OVERLAY) + " src"
+         " -m set --match-set " + string(IPSET_OVERLAY) + " dst";
+}
+
+
+// Parses a MAC in the `xx:xx:xx:xx:xx:xx` format the Master hands the
+// VTEP MACs out in.
+static Try<net::MAC> parseMAC(const string& _mac)
+{
+  vector<string> tokens = strings::split(_mac, ":");
+  if (tokens.size() != 6) {
+    return Error("Invalid MAC address: " + _mac);
+  }
+
+  uint8_t mac[6];
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (sscanf(tokens[i].c_str(), "%hhx", &mac[i]) != 1) {
+      return Error("Invalid MAC address: " + _mac);
+    }
+  }
+
+  return net::MAC(mac);
+}
+
 
 static string OVERLAY_HELP()
 {
@@ -107,239 +209,1794 @@ static string OVERLAY_HELP()
 }
 
 
-class ManagerProcess : public ProtobufProcess<ManagerProcess>
-{
-public:
-  static Try<Owned<ManagerProcess>> createManagerProcess(
-      const string& cniDir,
-      const AgentNetworkConfig& networkConfig,
-      const uint32_t maxConfigAttempts,
-      Owned<MasterDetector>& detector)
-  {
-    // It is imperative that MASQUERADE rules are not enforced on
-    // overlay traffic. To ensure that overlay traffic is not NATed,
-    // the Agent module disables masquerade on Docker and Mesos
-    // network, and installs MASQUERADE rules during initialization.
-    // The MASQUERADE rule works as follows:
-    // * The Agent creates an 'ipset' which will hold all the overlay
-    // subnets that are configured on the agent.
-    // * The Agent inserts an 'iptables' rule that uses the 'ipset' to
-    // ensure that traffic destined to any of the overlay subnet is
-    // not masqueraded.
-    //
-    // NOTE: We need to serialize the execution of the 'ipset' command
-    // to ensure that the MASQUERADE rules have been installed
-    // correctly before allowing the creation of the
-    // `ManagerProcess`.
-    //
-    // NOTE: We should set up the `ipset` only if `mesos_bridge` or
-    // `docker_bridge` have been enabled in the `AgentNetworkConfig`.
-    if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
-      Try<string> ipsetCommand = strings::format(
-          "ipset create -exist %s hash:net counters && "
-          "ipset add -exist %s 0.0.0.0/1 && "
-          "ipset add -exist %s 128.0.0.0/1 && "
-          "ipset add -exist %s 127.0.0.0/1",
-          IPSET_OVERLAY,
-          IPSET_OVERLAY,
-          IPSET_OVERLAY,
-          IPSET_OVERLAY);
+class ManagerProcess : public ProtobufProcess<ManagerProcess>
+{
+public:
+  static Try<Owned<ManagerProcess>> createManagerProcess(
+      const string& cniDir,
+      const AgentNetworkConfig& networkConfig,
+      const uint32_t maxConfigAttempts,
+      const uint32_t maxSubnets,
+      const Option<string>& ipamDir,
+      const bool overlayCni,
+      const bool conntrackBypass,
+      const AgentConfig::Masquerade masquerade,
+      const Option<ProbeConfig>& probe,
+      Owned<MasterDetector>& detector)
+  {
+    // The overlay CNI plugin leases the addresses of the containers
+    // from the IPAM service of the agent.
+    if (overlayCni && ipamDir.isNone()) {
+      return Error("The overlay CNI plugin needs an IPAM directory");
+    }
+
+    if (conntrackBypass &&
+        !networkConfig.mesos_bridge() && !networkConfig.docker_bridge()) {
+      return Error("The conntrack bypass needs the Mesos or Docker bridge");
+    }
+
+    if (networkConfig.bandwidth_limits_size() > MAX_SHAPED_OVERLAYS) {
+      return Error(
+          "Bandwidth limits are supported on up to " +
+          stringify(MAX_SHAPED_OVERLAYS) + " overlays");
+    }
+
+    hashset<string> limited;
+    foreach (const BandwidthLimit& limit, networkConfig.bandwidth_limits()) {
+      if (limited.contains(limit.overlay())) {
+        return Error(
+            "Overlay '" + limit.overlay() + "' has more than one bandwidth "
+            "limit");
+      }
+
+      limited.insert(limit.overlay());
+
+      if ((limit.has_container_egress_mbps() ||
+           limit.has_container_ingress_mbps()) && !overlayCni) {
+        return Error(
+            "The bandwidth limits of the containers are only applied by the "
+            "overlay CNI plugin");
+      }
+    }
+
+    // It is imperative that MASQUERADE rules are not enforced on
+    // overlay traffic. To ensure that overlay traffic is not NATed,
+    // the Agent module disables masquerade on Docker and Mesos
+    // network, and installs MASQUERADE rules during initialization.
+    // The MASQUERADE rule works as follows:
+    // * The Agent creates an 'ipset' which will hold all the overlay
+    // subnets that are configured on the agent.
+    // * The Agent inserts an 'iptables' rule that uses the 'ipset' to
+    // ensure that traffic destined to any of the overlay subnet is
+    // not masqueraded.
+    //
+    // NOTE: We need to serialize the execution of the 'ipset' command
+    // to ensure that the MASQUERADE rules have been installed
+    // correctly before allowing the creation of the
+    // `ManagerProcess`.
+    //
+    // NOTE: We should set up the `ipset` only if `mesos_bridge` or
+    // `docker_bridge` have been enabled in the `AgentNetworkConfig`.
+    if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
+      Try<string> ipsetCommand = strings::format(
+          "ipset create -exist %s hash:net counters && "
+          "ipset add -exist %s 0.0.0.0/1 && "
+          "ipset add -exist %s 128.0.0.0/1 && "
+          "ipset add -exist %s 127.0.0.0/1",
+          IPSET_OVERLAY,
+          IPSET_OVERLAY,
+          IPSET_OVERLAY,
+          IPSET_OVERLAY);
+
+      if (ipsetCommand.isError()) {
+        return Error(
+            "Unable to create `ipset` command: " + ipsetCommand.error());
+      }
+
+      // With the conntrack bypass, the packets between two overlay
+      // subnets are not tracked in the raw table, unless they are for
+      // the agent itself, and are accepted as they are forwarded. Both
+      // their addresses are `nomatch` entries of `IPSET_OVERLAY`.
+      if (conntrackBypass) {
+        Try<string> match = strings::format(
+            "-m addrtype ! --dst-type LOCAL"
+            " -m set ! --match-set %s src -m set ! --match-set %s dst",
+            IPSET_OVERLAY,
+            IPSET_OVERLAY);
+
+        if (match.isError()) {
+          return Error(
+              "Unable to create conntrack bypass command: " + match.error());
+        }
+
+        Try<string> bypassCommand = strings::format(
+            " && (iptables -t raw -C PREROUTING %s -j CT --notrack ||"
+            " iptables -t raw -I PREROUTING %s -j CT --notrack)"
+            " && (iptables -C FORWARD %s -m conntrack --ctstate UNTRACKED"
+            " -j ACCEPT || iptables -I FORWARD %s -m conntrack"
+            " --ctstate UNTRACKED -j ACCEPT)",
+            match.get(),
+            match.get(),
+            match.get(),
+            match.get());
+
+        if (bypassCommand.isError()) {
+          return Error(
+              "Unable to create conntrack bypass command: " +
+              bypassCommand.error());
+        }
+
+        ipsetCommand = ipsetCommand.get() + bypassCommand.get();
+      }
+
+      // A single rule masquerades the traffic from any overlay subnet
+      // to anything but the overlay subnets. Both lookups are done in
+      // the `ipset`, which holds the overlay subnets as `nomatch`
+      // entries.
+      if (masquerade == AgentConfig::IPSET) {
+        Try<string> masqueradeCommand = strings::format(
+            " && (iptables -t nat -C POSTROUTING %s -j MASQUERADE ||"
+            " iptables -t nat -A POSTROUTING %s -j MASQUERADE)",
+            IPSET_MASQUERADE_MATCH(),
+            IPSET_MASQUERADE_MATCH());
+
+        if (masqueradeCommand.isError()) {
+          return Error(
+              "Unable to create masquerade command: " +
+              masqueradeCommand.error());
+        }
+
+        ipsetCommand = ipsetCommand.get() + masqueradeCommand.get();
+      }
+
+      Future<string> ipset = runScriptCommand(ipsetCommand.get());
+
+      ipset.await();
+
+      if (!ipset.isReady()) {
+        return Error(
+            "Unable to create ipset:" +
+            (ipset.isFailed() ? ipset.failure() : "discarded"));
+      }
+    }
+
+    Option<Owned<IpamProcess>> ipam = None();
+    if (ipamDir.isSome()) {
+      Try<Owned<IpamProcess>> _ipam = IpamProcess::create(ipamDir.get());
+      if (_ipam.isError()) {
+        return Error("Unable to create the IPAM service: " + _ipam.error());
+      }
+
+      ipam = _ipam.get();
+    }
+
+    Option<Owned<ProberProcess>> prober = None();
+    if (probe.isSome()) {
+      if (probe->peers() == 0) {
+        return Error("The probes need at least one peer on each overlay");
+      }
+
+      Try<Owned<ProberProcess>> _prober = ProberProcess::create(
+          Seconds(probe->interval_secs()),
+          Milliseconds(probe->timeout_ms()),
+          probe->window());
+
+      if (_prober.isError()) {
+        return Error("Unable to create the prober: " + _prober.error());
+      }
+
+      prober = _prober.get();
+    }
+
+    return Owned<ManagerProcess>(
+        new ManagerProcess(
+          cniDir,
+          networkConfig,
+          maxConfigAttempts,
+          maxSubnets,
+          ipam,
+          overlayCni,
+          masquerade,
+          prober,
+          probe.isSome() ? probe->peers() : 0,
+          detector));
+  }
+
+  Future<Nothing> ready()
+  {
+    return connected.future();
+  }
+
+protected:
+  virtual void initialize()
+  {
+    LOG(INFO) << "Initializing overlay agent manager";
+
+    route("/overlay",
+          OVERLAY_HELP(),
+          &ManagerProcess::overlay);
+
+    state = REGISTERING;
+
+    detector->detect()
+      .onAny(defer(self(), &ManagerProcess::detected, lambda::_1));
+
+    // Install message handlers.
+    install<UpdateAgentOverlaysMessage>(
+        &ManagerProcess::updateAgentOverlays);
+
+    install<AgentRegisteredAcknowledgement>(
+        &ManagerProcess::agentRegisteredAcknowledgement);
+
+    if (networkConfig.mesos_bridge() && maxSubnets > 1) {
+      delay(SUBNET_CHECK_INTERVAL, self(), &ManagerProcess::checkSubnets);
+    }
+
+    if (ipam.isSome()) {
+      spawn(ipam->get());
+    }
+
+    if (networkConfig.bandwidth_limits_size() > 0) {
+      delay(SHAPING_INTERVAL, self(), &ManagerProcess::shape);
+    }
+
+    if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
+      delay(COUNTERS_INTERVAL, self(), &ManagerProcess::sampleCounters);
+    }
+
+    if (prober.isSome()) {
+      spawn(prober->get());
+    }
+
+    delay(INITIAL_BACKOFF_PERIOD, self(), &ManagerProcess::fetchAgents);
+
+    if (!networkConfig.host_gw()) {
+      // The direct routes left by a previous instance of the Agent are
+      // removed, the rules leading to their table are harmless.
+      Try<Nothing> unrouted = unrouteDirectly(hashset<string>());
+      if (unrouted.isError()) {
+        LOG(WARNING) << "Unable to remove the direct routes: "
+                     << unrouted.error();
+      }
+    }
+  }
+
+  virtual void finalize()
+  {
+    foreach (const Gauge& gauge, gauges) {
+      process::metrics::remove(gauge);
+    }
+
+    if (prober.isSome()) {
+      terminate(prober->get());
+      wait(prober->get());
+    }
+
+    if (ipam.isSome()) {
+      terminate(ipam->get());
+      wait(ipam->get());
+    }
+  }
+
+  virtual void exited(const UPID& pid)
+  {
+    LOG(INFO) << "Overlay master " << pid << " has exited";
+
+    if (overlayMaster.isSome() && overlayMaster.get() == pid) {
+      LOG(WARNING) << "Overlay master disconnected! "
+                   << "Waiting for a new overlay master to be detected";
+    }
+
+    LOG(INFO) << "Moving " << pid << " to `REGISTERING` state.";
+
+    state = REGISTERING;
+    doReliableRegistration(INITIAL_BACKOFF_PERIOD);
+  }
+
+  void updateAgentOverlays(
+      const UPID& from,
+      const UpdateAgentOverlaysMessage& message)
+  {
+    LOG(INFO) << "Received 'UpdateAgentOverlaysMessage' from " << from;
+
+    // Secondary subnets are handed out while the agent is registered.
+    if (state == REGISTERED) {
+      updateSecondaryOverlays(message);
+      return;
+    }
+
+    if (state != REGISTERING) {
+      LOG(WARNING) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
+                   << " because overlay agent is not in DISCONNECTED state";
+      return;
+    }
+
+    // The reply to this update, or to the update already in progress,
+    // acknowledges the latest update that has been received.
+    if (message.has_sequence()) {
+      updateSequence = message.sequence();
+    } else {
+      updateSequence = None();
+    }
+
+    secondaries = getSecondaries(message);
+
+    list<Future<Nothing>> futures;
+    foreach (const AgentOverlayInfo& overlay, message.overlays()) {
+      const string name = overlay.info().name();
+
+      if (overlay.secondary()) {
+        continue;
+      }
+
+      LOG(INFO) << "Configuring overlay network '" << name << "'";
+
+      // TODO(jieyu): Here, we assume that the overlay configuration
+      // never changes. Therefore, if the overlay is in `STATUS_OK` or
+      // if it is in `STATUS_CONFIGURING` state, we will skip the
+      // configuration. This might change soon.
+      if (overlays.contains(name) &&
+          overlays.at(name).has_state() &&
+          overlays.at(name).state().has_status() ) {
+        OverlayState::Status status = overlays.at(name).state().status();
+
+        if ((status == OverlayState::STATUS_OK) ||
+            (status == OverlayState::STATUS_CONFIGURING)) {
+          LOG(INFO) << "Skipping configuration for overlay network '"
+                    << name << "' as it "
+                    << ((status == OverlayState::STATUS_OK) ?
+                       "has been " : "is being ")
+                    << "configured.";
+
+          if (status == OverlayState::STATUS_OK) {
+            // We still set a `Future` for this overlay, so as to inform
+            // the Master about the state of this overlay network.
+            futures.push_back(Nothing());
+          }
+
+          continue;
+        }
+      }
+
+      CHECK(!overlay.has_state());
+
+      overlays[name] = overlay;
+
+      futures.push_back(configure(name));
+    }
+
+    // If we don't have any `Futures` setup that means this was a
+    // duplicate update corresponding to one already in progress. We
+    // should therefore not setup a response for acknowledging this
+    // registration.
+    if (futures.empty()) {
+      LOG(INFO) << "Looks like we received a duplicate config update from "
+                << from << " dropping this message.";
+      return;
+    }
+
+    // Wait for all the networks to be configured.
+    await(futures)
+      .onAny(defer(self(),
+                   &ManagerProcess::_updateAgentOverlays,
+                   lambda::_1));
+  }
+
+  void _updateAgentOverlays(
+      const Future<list<Future<Nothing>>>& results)
+  {
+    if (!results.isReady()) {
+      LOG(ERROR) << "Unable to configure any overlay: "
+                 << (results.isDiscarded() ? "discarded" : results.failure());
+
+      return;
+    }
+
+    vector<string> messages;
+    // Check if there were any failures while configuring the
+    // overlays.
+    foreach(const Future<Nothing>& result, results.get()) {
+      if (!result.isReady()) {
+        messages.push_back(
+            (result.isDiscarded() ? "discarded" : result.failure()));
+      }
+    }
+
+    if (!messages.empty()){
+      LOG(ERROR) << "Unable to configure some of the overlays on this Agent: "
+                 << strings::join("\n", messages);
+    }
+
+    if (state != REGISTERING) {
+      LOG(WARNING) << "Ignored sending registered message because "
+                   << "agent is not in REGISTERING state";
+      return;
+    }
+
+    sendAgentRegistered();
+  }
+
+  void sendAgentRegistered()
+  {
+    CHECK_SOME(overlayMaster);
+
+    AgentRegisteredMessage message;
+
+    if (updateSequence.isSome()) {
+      message.set_sequence(updateSequence.get());
+    }
+
+    foreach (const AgentOverlayInfo& overlay, getOverlays()) {
+      // Every overlay network should have a status, and it should be
+      // either in `STATUS_OK` or `STATUS_FAILED`.
+      CHECK(overlay.has_state());
+      CHECK(overlay.state().has_status());
+      CHECK(overlay.state().status() != OverlayState::STATUS_CONFIGURING);
+      CHECK(overlay.state().status() != OverlayState::STATUS_INVALID);
+
+      message.add_overlays()->CopyFrom(overlay);
+    }
+
+    LOG(INFO) << "Sending agent registered message to " << overlayMaster.get();
+
+    // NOTE: If this message does not reach the master, the master
+    // will keep sending 'UpdateAgentOverlaysMessage', which will
+    // essentially cause a retry of sending this message.
+    send(overlayMaster.get(), message);
+  }
+
+  // Applies the secondary subnets of an update received while the
+  // agent is registered. The update is acknowledged once the Mesos
+  // networks of the overlays whose subnets changed are reconfigured.
+  void updateSecondaryOverlays(const UpdateAgentOverlaysMessage& message)
+  {
+    if (message.has_sequence()) {
+      updateSequence = message.sequence();
+    } else {
+      updateSequence = None();
+    }
+
+    hashmap<string, vector<AgentOverlayInfo>> _secondaries =
+      getSecondaries(message);
+
+    // The secondary subnets of the overlays being reconfigured, to be
+    // restored if the reconfiguration fails.
+    hashmap<string, vector<AgentOverlayInfo>> previous;
+
+    list<Future<Nothing>> futures;
+    foreachkey (const string& name, overlays) {
+      vector<string> subnets;
+      vector<string> _subnets;
+
+      if (secondaries.contains(name)) {
+        foreach (const AgentOverlayInfo& overlay, secondaries.at(name)) {
+          subnets.push_back(overlay.subnet());
+        }
+      }
+
+      if (_secondaries.contains(name)) {
+        foreach (const AgentOverlayInfo& overlay, _secondaries.at(name)) {
+          _subnets.push_back(overlay.subnet());
+        }
+      }
+
+      if (subnets == _subnets) {
+        continue;
+      }
+
+      LOG(INFO) << "Configuring the secondary subnets "
+                << strings::join(", ", _subnets) << " of overlay network '"
+                << name << "'";
+
+      previous[name] = secondaries[name];
+      secondaries[name] = _secondaries[name];
+
+      futures.push_back(configureMesosNetwork(name));
+    }
+
+    // A retransmission of an update that has been applied already.
+    if (futures.empty()) {
+      sendAgentRegistered();
+      return;
+    }
+
+    await(futures)
+      .onAny(defer(self(),
+                   &ManagerProcess::_updateSecondaryOverlays,
+                   previous,
+                   lambda::_1));
+  }
+
+  void _updateSecondaryOverlays(
+      const hashmap<string, vector<AgentOverlayInfo>>& previous,
+      const Future<list<Future<Nothing>>>& results)
+  {
+    vector<string> messages;
+
+    if (!results.isReady()) {
+      messages.push_back(
+          (results.isDiscarded() ? "discarded" : results.failure()));
+    } else {
+      foreach (const Future<Nothing>& result, results.get()) {
+        if (!result.isReady()) {
+          messages.push_back(
+              (result.isDiscarded() ? "discarded" : result.failure()));
+        }
+      }
+    }
+
+    // Without acknowledging the update, the master retransmits it and
+    // the configuration is retried.
+    if (!messages.empty()) {
+      LOG(ERROR) << "Unable to configure the secondary subnets: "
+                 << strings::join("\n", messages);
+
+      foreachpair (const string& name,
+                   const vector<AgentOverlayInfo>& _secondaries,
+                   previous) {
+        secondaries[name] = _secondaries;
+      }
+
+      return;
+    }
+
+    if (state != REGISTERED) {
+      LOG(WARNING) << "Ignored sending registered message because "
+                   << "agent is not in REGISTERED state";
+      return;
+    }
+
+    sendAgentRegistered();
+  }
+
+  // Returns the secondary subnets of each overlay in an update.
+  static hashmap<string, vector<AgentOverlayInfo>> getSecondaries(
+      const UpdateAgentOverlaysMessage& message)
+  {
+    hashmap<string, vector<AgentOverlayInfo>> _secondaries;
+
+    foreach (const AgentOverlayInfo& overlay, message.overlays()) {
+      if (overlay.secondary()) {
+        _secondaries[overlay.info().name()].push_back(overlay);
+      }
+    }
+
+    return _secondaries;
+  }
+
+  // Returns the overlays on this agent, each one followed by its
+  // secondary subnets. The secondary subnets share the state of the
+  // overlay they belong to.
+  list<AgentOverlayInfo> getOverlays() const
+  {
+    list<AgentOverlayInfo> _overlays;
+
+    foreachpair (const string& name,
+                 const AgentOverlayInfo& overlay,
+                 overlays) {
+      _overlays.push_back(overlay);
+
+      if (!secondaries.contains(name)) {
+        continue;
+      }
+
+      foreach (const AgentOverlayInfo& secondary, secondaries.at(name)) {
+        _overlays.push_back(secondary);
+
+        if (overlay.has_state()) {
+          _overlays.back().mutable_state()->CopyFrom(overlay.state());
+        }
+      }
+    }
+
+    return _overlays;
+  }
+
+  // Asks the master for a secondary subnet of every overlay whose
+  // Mesos network is running out of addresses.
+  void checkSubnets()
+  {
+    if (state == REGISTERED && overlayMaster.isSome()) {
+      foreachpair (const string& name,
+                   const AgentOverlayInfo& overlay,
+                   overlays) {
+        if (!overlay.has_mesos_bridge()) {
+          continue;
+        }
+
+        const size_t subnets = 1 +
+          (secondaries.contains(name) ? secondaries.at(name).size() : 0);
+
+        if (subnets >= maxSubnets) {
+          continue;
+        }
+
+        leases(name)
+          .onAny(defer(self(),
+                       &Self::_checkSubnets,
+                       name,
+                       subnets,
+                       lambda::_1));
+      }
+    }
+
+    delay(SUBNET_CHECK_INTERVAL, self(), &ManagerProcess::checkSubnets);
+  }
+
+  void _checkSubnets(
+      const string& name,
+      size_t subnets,
+      const Future<size_t>& used)
+  {
+    if (!used.isReady()) {
+      LOG(WARNING) << "Unable to check the leases of overlay network '"
+                   << name << "': "
+                   << (used.isFailed() ? used.failure() : "discarded");
+      return;
+    }
+
+    if (state != REGISTERED || overlayMaster.isNone()) {
+      return;
+    }
+
+    Try<size_t> total = addresses(name);
+    if (total.isError()) {
+      LOG(WARNING) << "Unable to check the addresses of overlay network '"
+                   << name << "': " << total.error();
+      return;
+    }
+
+    if (used.get() * 100 < total.get() * SUBNET_USAGE_THRESHOLD) {
+      return;
+    }
+
+    LOG(INFO) << used.get() << " of the " << total.get()
+              << " addresses of overlay network '" << name
+              << "' are in use, requesting a secondary subnet";
+
+    RequestSubnetMessage message;
+    message.set_name(name);
+    message.set_subnets(subnets);
+
+    // NOTE: The request is repeated on the next check if the master
+    // does not allocate a subnet in the meantime.
+    send(overlayMaster.get(), message);
+  }
+
+  // Returns the number of addresses leased on the Mesos network of an
+  // overlay, by the IPAM service of the agent or by `host-local`.
+  Future<size_t> leases(const string& name)
+  {
+    if (ipam.isSome()) {
+      return dispatch(ipam->get(), &IpamProcess::leases, name);
+    }
+
+    const string directory = path::join(CNI_HOST_LOCAL_DIR, name);
+
+    if (!os::exists(directory)) {
+      return size_t(0);
+    }
+
+    Try<list<string>> entries = os::ls(directory);
+    if (entries.isError()) {
+      return Failure(entries.error());
+    }
+
+    // Every lease is a file named after the leased address.
+    size_t count = 0;
+    foreach (const string& entry, entries.get()) {
+      if (IP::parse(entry, AF_INET).isSome()) {
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+  // Returns the number of addresses that can be leased on the Mesos
+  // network of an overlay, leaving out the network, the gateway and
+  // the broadcast address of each subnet.
+  Try<size_t> addresses(const string& name)
+  {
+    CHECK(overlays.contains(name));
+
+    vector<string> subnets = {overlays.at(name).mesos_bridge().ip()};
+
+    if (secondaries.contains(name)) {
+      foreach (const AgentOverlayInfo& secondary, secondaries.at(name)) {
+        subnets.push_back(secondary.mesos_bridge().ip());
+      }
+    }
+
+    size_t count = 0;
+    foreach (const string& subnet, subnets) {
+      Try<IPNetwork> network = IPNetwork::parse(subnet, AF_INET);
+      if (network.isError()) {
+        return Error(network.error());
+      }
+
+      const size_t size = (size_t) 1 << (32 - network->prefix());
+      if (size > 3) {
+        count += size - 3;
+      }
+    }
+
+    return count;
+  }
+
+  // Applies the bandwidth limits of the overlays to the links they are
+  // shaped on, and samples the traffic of their classes. The VTEP of an
+  // overlay and its bridges are only shaped once they are there. The
+  // class of an overlay is `1:<n>`, by the position `n` of its limit
+  // in the configuration.
+  void shape()
+  {
+    hashmap<string, vector<TrafficInfo>> _traffic;
+
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      LOG(WARNING) << "Unable to shape the overlays: " << fd.error();
+
+      delay(SHAPING_INTERVAL, self(), &ManagerProcess::shape);
+      return;
+    }
+
+    Try<hashmap<string, int>> links = netlink::links(fd.get());
+    if (links.isError()) {
+      LOG(WARNING) << "Unable to shape the overlays: " << links.error();
+
+      os::close(fd.get());
+      delay(SHAPING_INTERVAL, self(), &ManagerProcess::shape);
+      return;
+    }
+
+    list<string> names;
+    list<Future<Try<vector<TrafficInfo>>>> containers;
+
+    for (int i = 0; i < networkConfig.bandwidth_limits_size(); i++) {
+      const BandwidthLimit& limit = networkConfig.bandwidth_limits(i);
+      const string& name = limit.overlay();
+      const uint16_t minor = i + 1;
+
+      if (!overlays.contains(name) ||
+          overlays.at(name).state().status() != OverlayState::STATUS_OK) {
+        continue;
+      }
+
+      const AgentOverlayInfo& overlay = overlays.at(name);
+
+      // The classes of the overlay, along with the index of their link.
+      vector<std::pair<int, TrafficInfo>> classes;
+
+      netlink::Batch batch;
+
+      // The traffic of the containers leaving the agent is the one from
+      // the subnets of the overlay through the VTEP, which is shared by
+      // the overlays.
+      const string& vtep = overlay.backend().has_geneve()
+        ? overlay.backend().geneve().vtep_name()
+        : overlay.backend().vxlan().vtep_name();
+      if (limit.has_egress_mbps() && links->contains(vtep)) {
+        const int index = links->at(vtep);
+
+        netlink::htb(&batch, vtep, index, 0);
+        netlink::htb(&batch, vtep, index, minor, rate(limit.egress_mbps()));
+
+        vector<string> subnets = {overlay.subnet()};
+        if (secondaries.contains(name)) {
+          foreach (const AgentOverlayInfo& secondary, secondaries.at(name)) {
+            subnets.push_back(secondary.mesos_bridge().ip());
+          }
+        }
+
+        for (size_t j = 0; j < subnets.size() && j < MAX_SHAPED_SUBNETS; j++) {
+          Try<IPNetwork> subnet = IPNetwork::parse(subnets[j], AF_INET);
+          if (subnet.isError()) {
+            continue;
+          }
+
+          netlink::classify(
+              &batch,
+              vtep,
+              index,
+              (uint16_t) ((minor << 4) | j),
+              minor,
+              subnet.get(),
+              true);
+        }
+
+        TrafficInfo info;
+        info.set_direction(TrafficInfo::EGRESS);
+        info.set_device(vtep);
+        info.set_limit_mbps(limit.egress_mbps());
+        classes.push_back(std::make_pair(index, info));
+      }
+
+      // The traffic to the containers is all the one through their
+      // bridges.
+      if (limit.has_ingress_mbps()) {
+        vector<string> bridges;
+        if (overlay.has_mesos_bridge()) {
+          bridges.push_back(overlay.mesos_bridge().name());
+        }
+
+        if (overlay.has_docker_bridge()) {
+          bridges.push_back(overlay.docker_bridge().name());
+        }
+
+        foreach (const string& bridge, bridges) {
+          if (!links->contains(bridge)) {
+            continue;
+          }
+
+          const int index = links->at(bridge);
+
+          netlink::htb(&batch, bridge, index, minor);
+          netlink::htb(
+              &batch,
+              bridge,
+              index,
+              minor,
+              rate(limit.ingress_mbps()));
+
+          TrafficInfo info;
+          info.set_direction(TrafficInfo::INGRESS);
+          info.set_device(bridge);
+          info.set_limit_mbps(limit.ingress_mbps());
+          classes.push_back(std::make_pair(index, info));
+        }
+      }
+
+      Try<Nothing> send = netlink::send(fd.get(), batch);
+      if (send.isError()) {
+        LOG(WARNING) << "Unable to shape overlay '" << name << "': "
+                     << send.error();
+        continue;
+      }
+
+      foreach (auto& _class, classes) {
+        Try<hashmap<uint32_t, netlink::Statistics>> statistics =
+          netlink::statistics(fd.get(), _class.first, true);
+
+        if (statistics.isError()) {
+          LOG(WARNING) << "Unable to sample the traffic of overlay '"
+                       << name << "': " << statistics.error();
+          continue;
+        }
+
+        const uint32_t handle = netlink::ROOT_HANDLE | minor;
+        if (!statistics->contains(handle)) {
+          continue;
+        }
+
+        TrafficInfo& info = _class.second;
+        info.set_bytes(statistics->at(handle).bytes);
+        info.set_packets(statistics->at(handle).packets);
+        info.set_drops(statistics->at(handle).drops);
+        info.set_overlimits(statistics->at(handle).overlimits);
+
+        _traffic[name].push_back(info);
+      }
+
+      if (ipam.isSome()) {
+        names.push_back(name);
+        containers.push_back(
+            dispatch(ipam->get(), &IpamProcess::traffic, name));
+      }
+    }
+
+    os::close(fd.get());
+
+    process::collect(containers)
+      .onAny(defer(self(), &Self::_shape, _traffic, names, lambda::_1));
+  }
+
+  void _shape(
+      hashmap<string, vector<TrafficInfo>> _traffic,
+      const list<string>& names,
+      const Future<list<Try<vector<TrafficInfo>>>>& containers)
+  {
+    if (containers.isReady()) {
+      auto name = names.begin();
+      foreach (const Try<vector<TrafficInfo>>& infos, containers.get()) {
+        if (infos.isError()) {
+          LOG(WARNING) << "Unable to sample the traffic of the containers "
+                       << "of overlay '" << *name << "': " << infos.error();
+        } else {
+          foreach (const TrafficInfo& info, infos.get()) {
+            _traffic[*name].push_back(info);
+          }
+        }
+
+        ++name;
+      }
+    }
+
+    // The throughput of a class is the one since the previous sample.
+    const Time now = Clock::now();
+
+    hashmap<string, uint64_t> _sampledBytes;
+    foreachpair (const string& name, vector<TrafficInfo>& infos, _traffic) {
+      foreach (TrafficInfo& info, infos) {
+        const string key =
+          name + "/" + stringify(info.direction()) + "/" + info.device();
+
+        if (sampled.isSome() &&
+            sampledBytes.contains(key) &&
+            sampledBytes.at(key) <= info.bytes() &&
+            now > sampled.get()) {
+          info.set_throughput_bps((uint64_t) (
+              (info.bytes() - sampledBytes.at(key)) * 8 /
+              (now - sampled.get()).secs()));
+        }
+
+        _sampledBytes[key] = info.bytes();
+      }
+    }
+
+    traffic = _traffic;
+    sampledBytes = _sampledBytes;
+    sampled = now;
+
+    delay(SHAPING_INTERVAL, self(), &ManagerProcess::shape);
+  }
+
+  // Samples the counters of the bridges of the overlays, with a single
+  // dump of the links, and derives their rates since the previous
+  // sample. The gauges of an overlay are added once its bridges are
+  // first sampled.
+  void sampleCounters()
+  {
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      LOG(WARNING) << "Unable to sample the counters of the overlays: "
+                   << fd.error();
+
+      delay(COUNTERS_INTERVAL, self(), &ManagerProcess::sampleCounters);
+      return;
+    }
+
+    Try<hashmap<string, netlink::LinkStatistics>> links =
+      netlink::linkStatistics(fd.get());
+
+    os::close(fd.get());
+
+    if (links.isError()) {
+      LOG(WARNING) << "Unable to sample the counters of the overlays: "
+                   << links.error();
+
+      delay(COUNTERS_INTERVAL, self(), &ManagerProcess::sampleCounters);
+      return;
+    }
+
+    const Time now = Clock::now();
+
+    hashmap<string, CountersInfo> _counters;
+    foreachpair (const string& name,
+                 const AgentOverlayInfo& overlay,
+                 overlays) {
+      vector<string> bridges;
+      if (overlay.has_mesos_bridge()) {
+        bridges.push_back(overlay.mesos_bridge().name());
+      }
+      if (overlay.has_docker_bridge()) {
+        bridges.push_back(overlay.docker_bridge().name());
+      }
+
+      bool found = false;
+      CountersInfo info;
+      foreach (const string& bridge, bridges) {
+        if (!links->contains(bridge)) {
+          continue;
+        }
+
+        const netlink::LinkStatistics& statistics = links->at(bridge);
+
+        info.set_egress_bytes(info.egress_bytes() + statistics.rxBytes);
+        info.set_egress_packets(
+            info.egress_packets() + statistics.rxPackets);
+        info.set_ingress_bytes(info.ingress_bytes() + statistics.txBytes);
+        info.set_ingress_packets(
+            info.ingress_packets() + statistics.txPackets);
+
+        found = true;
+      }
+
+      if (!found) {
+        continue;
+      }
+
+      // The counters start over when a bridge is created again, in
+      // which case the rates are left out until the next sample.
+      if (counters.contains(name) &&
+          countersSampled.isSome() &&
+          now > countersSampled.get()) {
+        const CountersInfo& previous = counters.at(name);
+        const double seconds = (now - countersSampled.get()).secs();
+
+        if (previous.egress_bytes() <= info.egress_bytes() &&
+            previous.egress_packets() <= info.egress_packets()) {
+          info.set_egress_bits_per_second((uint64_t) (
+              (info.egress_bytes() - previous.egress_bytes()) * 8 /
+              seconds));
+          info.set_egress_packets_per_second((uint64_t) (
+              (info.egress_packets() - previous.egress_packets()) /
+              seconds));
+        }
+
+        if (previous.ingress_bytes() <= info.ingress_bytes() &&
+            previous.ingress_packets() <= info.ingress_packets()) {
+          info.set_ingress_bits_per_second((uint64_t) (
+              (info.ingress_bytes() - previous.ingress_bytes()) * 8 /
+              seconds));
+          info.set_ingress_packets_per_second((uint64_t) (
+              (info.ingress_packets() - previous.ingress_packets()) /
+              seconds));
+        }
+      }
+
+      if (!counted.contains(name)) {
+        const string prefix = "overlay/agent/overlays/" + name + "/";
+        const google::protobuf::Descriptor* descriptor =
+          CountersInfo::descriptor();
+
+        for (int i = 0; i < descriptor->field_count(); i++) {
+          const string& field = descriptor->field(i)->name();
+
+          Gauge gauge(
+              prefix + field,
+              defer(self(), &ManagerProcess::_counter, name, field));
+
+          process::metrics::add(gauge);
+          gauges.push_back(gauge);
+        }
+
+        counted.insert(name);
+      }
+
+      _counters[name] = info;
+    }
+
+    counters = _counters;
+    countersSampled = now;
+
+    delay(COUNTERS_INTERVAL, self(), &ManagerProcess::sampleCounters);
+  }
+
+  // The gauges of an overlay read 0 while its bridges are gone.
+  double _counter(const string& name, const string& field)
+  {
+    if (!counters.contains(name)) {
+      return 0;
+    }
+
+    const CountersInfo& info = counters.at(name);
+
+    return (double) info.GetReflection()->GetUInt64(
+        info,
+        CountersInfo::descriptor()->FindFieldByName(field));
+  }
+
+  // Fetches the state of the Master, which holds all the Agents, once
+  // for all the loops that follow the other Agents. The state is not
+  // fetched if none of them needs it.
+  void fetchAgents()
+  {
+    if (state != REGISTERED || overlayMaster.isNone()) {
+      delay(INITIAL_BACKOFF_PERIOD, self(), &ManagerProcess::fetchAgents);
+      return;
+    }
+
+    // The encapsulation is set by the Master for all the overlays, the
+    // tunnels left by a previous instance of the Agent are removed if
+    // it is not Geneve anymore. The overlays might switch to Geneve on
+    // a later registration, so they are checked again either way.
+    if (!geneve()) {
+      Try<Nothing> untunneled = untunnel(hashset<string>());
+      if (untunneled.isError()) {
+        LOG(WARNING) << "Unable to remove the Geneve tunnels: "
+                     << untunneled.error();
+      }
+
+      if (!networkConfig.host_gw() &&
+          !networkConfig.neighbour_suppression() &&
+          prober.isNone()) {
+        delay(AGENTS_INTERVAL, self(), &ManagerProcess::fetchAgents);
+        return;
+      }
+    }
+
+    http::get(overlayMaster.get(), "state")
+      .onAny(defer(self(), &ManagerProcess::_fetchAgents, lambda::_1));
+  }
+
+  void _fetchAgents(const Future<http::Response>& response)
+  {
+    delay(AGENTS_INTERVAL, self(), &ManagerProcess::fetchAgents);
+
+    Try<mesos::modules::overlay::State> networkState = parseState(response);
+    if (networkState.isError()) {
+      LOG(WARNING) << "Unable to synchronize with the other Agents: "
+                   << networkState.error();
+      return;
+    }
+
+    if (networkConfig.host_gw()) {
+      routeDirectly(networkState.get());
+    }
+
+    if (geneve()) {
+      tunnel(networkState.get());
+    }
+
+    if (networkConfig.neighbour_suppression()) {
+      suppressNeighbours(networkState.get());
+    }
+
+    if (prober.isSome() &&
+        (peersSampled.isNone() ||
+         Clock::now() - peersSampled.get() >= PROBE_PEERS_INTERVAL)) {
+      samplePeers(networkState.get());
+
+      peersSampled = Clock::now();
+    }
+  }
+
+  // Returns whether the overlays use the Geneve backend.
+  bool geneve() const
+  {
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (overlay.backend().has_geneve()) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Samples the peers the prober sends its probes to, among the VTEPs
+  // of the other Agents in the state of the Master that share one of
+  // its overlays. The peers that are still there are kept, so that
+  // their latency and their loss are computed over a full window of
+  // probes.
+  void samplePeers(const mesos::modules::overlay::State& networkState)
+  {
+    const string address = stringify(self().address.ip);
+
+    // All the overlays of an Agent share its VTEP, so an Agent is a
+    // single candidate however many overlays it shares with this one.
+    vector<net::IP> candidates;
+    foreach (const AgentInfo& agent, networkState.agents()) {
+      if (agent.ip() == address) {
+        continue;
+      }
+
+      foreach (const AgentOverlayInfo& overlay, agent.overlays()) {
+        if (overlay.secondary() ||
+            !overlays.contains(overlay.info().name()) ||
+            (!overlay.backend().has_vxlan() &&
+             !overlay.backend().has_geneve())) {
+          continue;
+        }
+
+        Try<net::IPNetwork> vtep = net::IPNetwork::parse(
+            overlay.backend().has_geneve()
+              ? overlay.backend().geneve().vtep_ip()
+              : overlay.backend().vxlan().vtep_ip(),
+            AF_INET);
+
+        if (vtep.isSome()) {
+          candidates.push_back(vtep->address());
+          break;
+        }
+      }
+    }
+
+    // The peers of the previous sample are kept, and the rest are
+    // picked at random among the other candidates.
+    vector<net::IP> sampled;
+    vector<net::IP> others;
+    foreach (const net::IP& ip, candidates) {
+      if (sampled.size() < probePeers &&
+          std::find(peers.begin(), peers.end(), ip) != peers.end()) {
+        sampled.push_back(ip);
+      } else {
+        others.push_back(ip);
+      }
+    }
+
+    while (sampled.size() < probePeers && !others.empty()) {
+      const size_t i = ::random() % others.size();
+
+      sampled.push_back(others[i]);
+      others[i] = others.back();
+      others.pop_back();
+    }
+
+    peers = sampled;
+
+    dispatch(prober->get(), &ProberProcess::update, peers);
+  }
+
+  // Routes the subnets of the Agents on the same L2 segment directly
+  // through the Agents, on the overlays with `host_gw`. Both ends of a
+  // direct route need to enable `host_gw`, for the replies to come
+  // back the same way. The subnets of the Agents that are not routed
+  // directly yet go through the VTEP.
+  void routeDirectly(const mesos::modules::overlay::State& networkState)
+  {
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      LOG(WARNING) << "Unable to route the overlays directly: "
+                   << fd.error();
+      return;
+    }
+
+    netlink::Batch batch;
+
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (!overlay.backend().has_host_gw()) {
+        continue;
+      }
+
+      Try<net::IPNetwork> subnet =
+        net::IPNetwork::parse(overlay.info().subnet(), AF_INET);
+
+      if (subnet.isSome()) {
+        netlink::rule(
+            &batch,
+            subnet.get(),
+            HOST_GW_TABLE,
+            HOST_GW_RULE_PRIORITY);
+      }
+    }
+
+    const string address = stringify(self().address.ip);
+
+    // The link each peer is directly reachable on, if any.
+    hashmap<string, Option<int>> adjacent;
+    hashset<string> destinations;
+
+    foreach (const AgentInfo& agent, networkState.agents()) {
+      if (agent.ip() == address) {
+        continue;
+      }
+
+      foreach (const AgentOverlayInfo& overlay, agent.overlays()) {
+        const string& name = overlay.info().name();
+
+        if (!overlay.has_subnet() ||
+            !overlay.backend().has_host_gw() ||
+            !overlays.contains(name) ||
+            !overlays.at(name).backend().has_host_gw()) {
+          continue;
+        }
+
+        Try<net::IP> gateway =
+          net::IP::parse(overlay.backend().host_gw().ip(), AF_INET);
+
+        Try<net::IPNetwork> subnet =
+          net::IPNetwork::parse(overlay.subnet(), AF_INET);
+
+        if (gateway.isError() || subnet.isError()) {
+          continue;
+        }
+
+        const string& peer = overlay.backend().host_gw().ip();
+        if (!adjacent.contains(peer)) {
+          Result<int> index = netlink::adjacent(fd.get(), gateway.get());
+          if (index.isError()) {
+            LOG(WARNING) << "Unable to find the route to Agent " << peer
+                         << ": " << index.error();
+          }
+
+          adjacent[peer] =
+            index.isSome() ? Option<int>(index.get()) : None();
+        }
+
+        if (adjacent.at(peer).isNone()) {
+          continue;
+        }
+
+        netlink::route(
+            &batch,
+            subnet.get(),
+            gateway.get(),
+            adjacent.at(peer).get(),
+            HOST_GW_TABLE);
+
+        destinations.insert(stringify(subnet.get()));
+      }
+    }
+
+    Try<Nothing> send = netlink::send(fd.get(), batch);
+
+    os::close(fd.get());
+
+    if (send.isError()) {
+      LOG(WARNING) << "Unable to route the overlays directly: "
+                   << send.error();
+    }
+
+    // The routes to the subnets of the Agents that are gone, or that
+    // are not on the same L2 segment anymore.
+    Try<Nothing> unrouted = unrouteDirectly(destinations);
+    if (unrouted.isError()) {
+      LOG(WARNING) << "Unable to remove the stale direct routes: "
+                   << unrouted.error();
+    }
+  }
+
+  // Removes the direct routes to the subnets but the ones in `keep`.
+  static Try<Nothing> unrouteDirectly(const hashset<string>& keep)
+  {
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      return Error(fd.error());
+    }
+
+    Try<vector<net::IPNetwork>> routes =
+      netlink::routes(fd.get(), HOST_GW_TABLE);
+
+    if (routes.isError()) {
+      os::close(fd.get());
+      return Error(routes.error());
+    }
+
+    netlink::Batch batch;
+    foreach (const net::IPNetwork& route, routes.get()) {
+      if (!keep.contains(stringify(route))) {
+        netlink::unroute(&batch, route, HOST_GW_TABLE);
+      }
+    }
+
+    Try<Nothing> send = netlink::send(fd.get(), batch);
+
+    os::close(fd.get());
+
+    return send;
+  }
+
+  // Tunnels the subnets and the VTEPs of the other Agents through the
+  // Geneve VTEP, on the overlays with the Geneve backend. The VTEP is
+  // in external mode: the VNI, the remote end and the tenant of each
+  // tunnel are carried by its route.
+  void tunnel(const mesos::modules::overlay::State& networkState)
+  {
+    // All the overlays share the same VTEP.
+    Option<GeneveInfo> vtep;
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (overlay.backend().has_geneve()) {
+        vtep = overlay.backend().geneve();
+        break;
+      }
+    }
+
+    if (vtep.isNone()) {
+      return;
+    }
+
+    Try<net::IPNetwork> vtepIP =
+      net::IPNetwork::parse(vtep->vtep_ip(), AF_INET);
+
+    Try<net::MAC> vtepMAC = parseMAC(vtep->vtep_mac());
+
+    if (vtepIP.isError() || vtepMAC.isError()) {
+      LOG(WARNING) << "Unable to set up the Geneve VTEP '"
+                   << vtep->vtep_name() << "': "
+                   << (vtepIP.isError() ? vtepIP.error() : vtepMAC.error());
+      return;
+    }
+
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      LOG(WARNING) << "Unable to set up the Geneve tunnels: " << fd.error();
+      return;
+    }
+
+    Try<int> index = netlink::geneve(
+        fd.get(),
+        vtep->vtep_name(),
+        vtepMAC.get(),
+        networkConfig.overlay_mtu());
+
+    if (index.isError()) {
+      os::close(fd.get());
+
+      LOG(WARNING) << "Unable to set up the Geneve VTEP '"
+                   << vtep->vtep_name() << "': " << index.error();
+      return;
+    }
+
+    netlink::Batch batch;
+    netlink::address(&batch, vtep->vtep_name(), index.get(), vtepIP.get());
+    batch.tolerate(EEXIST);
+    netlink::up(&batch, vtep->vtep_name(), index.get());
+
+    // The VTEPs of the other Agents are in the subnet of the VTEP, and
+    // looked up in the table of the tunnels along with the overlays.
+    const uint32_t vtepMask = ntohl(vtepIP->netmask().in().get().s_addr);
+    const uint32_t vtepAddress = ntohl(vtepIP->address().in().get().s_addr);
+
+    netlink::rule(
+        &batch,
+        net::IPNetwork::create(
+            net::IP(vtepAddress & vtepMask),
+            vtepIP->prefix()).get(),
+        GENEVE_TABLE,
+        GENEVE_RULE_PRIORITY);
+
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (!overlay.backend().has_geneve()) {
+        continue;
+      }
+
+      Try<net::IPNetwork> subnet =
+        net::IPNetwork::parse(overlay.info().subnet(), AF_INET);
+
+      if (subnet.isSome()) {
+        netlink::rule(
+            &batch,
+            subnet.get(),
+            GENEVE_TABLE,
+            GENEVE_RULE_PRIORITY);
+      }
+    }
+
+    const string address = stringify(self().address.ip);
+
+    hashset<string> destinations;
+
+    foreach (const AgentInfo& agent, networkState.agents()) {
+      if (agent.ip() == address) {
+        continue;
+      }
+
+      Try<net::IP> remote = net::IP::parse(agent.ip(), AF_INET);
+      if (remote.isError()) {
+        continue;
+      }
+
+      foreach (const AgentOverlayInfo& overlay, agent.overlays()) {
+        const string& name = overlay.info().name();
+
+        if (!overlay.backend().has_geneve() ||
+            !overlays.contains(name) ||
+            !overlays.at(name).backend().has_geneve()) {
+          continue;
+        }
+
+        const GeneveInfo& peer = overlay.backend().geneve();
+
+        Try<net::IPNetwork> peerIP =
+          net::IPNetwork::parse(peer.vtep_ip(), AF_INET);
+
+        Try<net::MAC> peerMAC = parseMAC(peer.vtep_mac());
+
+        if (peerIP.isError() || peerMAC.isError()) {
+          continue;
+        }
+
+        const Option<uint32_t> tenant = overlay.info().has_tenant()
+          ? Option<uint32_t>(overlay.info().tenant())
+          : None();
+
+        // The VTEP of the peer, shared by its overlays.
+        const net::IPNetwork peerVtep =
+          net::IPNetwork::create(peerIP->address(), 32).get();
+
+        if (!destinations.contains(stringify(peerVtep))) {
+          netlink::neighbour(
+              &batch,
+              peerIP->address(),
+              peerMAC.get(),
+              index.get());
+
+          netlink::tunnel(
+              &batch,
+              peerVtep,
+              None(),
+              index.get(),
+              GENEVE_TABLE,
+              peer.vni(),
+              remote.get(),
+              None());
+
+          destinations.insert(stringify(peerVtep));
+        }
+
+        if (!overlay.has_subnet()) {
+          continue;
+        }
 
-      if (ipsetCommand.isError()) {
-        return Error(
-            "Unable to create `ipset` command: " + ipsetCommand.error());
+        Try<net::IPNetwork> subnet =
+          net::IPNetwork::parse(overlay.subnet(), AF_INET);
+
+        if (subnet.isError()) {
+          continue;
+        }
+
+        netlink::tunnel(
+            &batch,
+            subnet.get(),
+            peerIP->address(),
+            index.get(),
+            GENEVE_TABLE,
+            peer.vni(),
+            remote.get(),
+            tenant);
+
+        destinations.insert(stringify(subnet.get()));
       }
+    }
 
-      Future<string> ipset = runScriptCommand(ipsetCommand.get());
+    Try<Nothing> send = netlink::send(fd.get(), batch);
 
-      ipset.await();
+    os::close(fd.get());
 
-      if (!ipset.isReady()) {
-        return Error(
-            "Unable to create ipset:" +
-            (ipset.isFailed() ? ipset.failure() : "discarded"));
-      }
+    if (send.isError()) {
+      LOG(WARNING) << "Unable to set up the Geneve tunnels: "
+                   << send.error();
     }
 
-    return Owned<ManagerProcess>(
-        new ManagerProcess(
-          cniDir,
-          networkConfig,
-          maxConfigAttempts,
-          detector));
+    // The tunnels to the Agents that are gone.
+    Try<Nothing> untunneled = untunnel(destinations);
+    if (untunneled.isError()) {
+      LOG(WARNING) << "Unable to remove the stale Geneve tunnels: "
+                   << untunneled.error();
+    }
   }
 
-  Future<Nothing> ready()
+  // Removes the tunnels to the destinations but the ones in `keep`.
+  static Try<Nothing> untunnel(const hashset<string>& keep)
   {
-    return connected.future();
-  }
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      return Error(fd.error());
+    }
 
-protected:
-  virtual void initialize()
-  {
-    LOG(INFO) << "Initializing overlay agent manager";
+    Try<vector<net::IPNetwork>> routes =
+      netlink::routes(fd.get(), GENEVE_TABLE);
 
-    route("/overlay",
-          OVERLAY_HELP(),
-          &ManagerProcess::overlay);
+    if (routes.isError()) {
+      os::close(fd.get());
+      return Error(routes.error());
+    }
 
-    state = REGISTERING;
+    netlink::Batch batch;
+    foreach (const net::IPNetwork& route, routes.get()) {
+      if (!keep.contains(stringify(route))) {
+        netlink::unroute(&batch, route, GENEVE_TABLE);
+      }
+    }
 
-    detector->detect()
-      .onAny(defer(self(), &ManagerProcess::detected, lambda::_1));
+    Try<Nothing> send = netlink::send(fd.get(), batch);
 
-    // Install message handlers.
-    install<UpdateAgentOverlaysMessage>(
-        &ManagerProcess::updateAgentOverlays);
+    os::close(fd.get());
 
-    install<AgentRegisteredAcknowledgement>(
-        &ManagerProcess::agentRegisteredAcknowledgement);
+    return send;
   }
 
-  virtual void exited(const UPID& pid)
+  // Keeps the ARP requests of the VxLAN VTEP from being flooded: the
+  // VTEPs and MACs of the other Agents are set as permanent neighbours
+  // and forwarding entries of the VTEP, and the ones of the Agents that
+  // are gone are removed. The neighbours of the Geneve VTEP are set
+  // along with its tunnels.
+  void suppressNeighbours(
+      const mesos::modules::overlay::State& networkState)
   {
-    LOG(INFO) << "Overlay master " << pid << " has exited";
+    // All the VxLAN overlays share the same VTEP.
+    Option<string> vtep;
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (overlay.backend().has_vxlan()) {
+        vtep = overlay.backend().vxlan().vtep_name();
+        break;
+      }
+    }
 
-    if (overlayMaster.isSome() && overlayMaster.get() == pid) {
-      LOG(WARNING) << "Overlay master disconnected! "
-                   << "Waiting for a new overlay master to be detected";
+    if (vtep.isNone() || !networkState.has_network()) {
+      return;
     }
 
-    LOG(INFO) << "Moving " << pid << " to `REGISTERING` state.";
+    Try<net::IPNetwork> vtepSubnet = net::IPNetwork::parse(
+        networkState.network().vtep_subnet(),
+        AF_INET);
 
-    state = REGISTERING;
-    doReliableRegistration(INITIAL_BACKOFF_PERIOD);
-  }
+    Try<net::MAC> vtepOUI = parseMAC(networkState.network().vtep_mac_oui());
 
-  void updateAgentOverlays(
-      const UPID& from,
-      const UpdateAgentOverlaysMessage& message)
-  {
-    LOG(INFO) << "Received 'UpdateAgentOverlaysMessage' from " << from;
+    if (vtepSubnet.isError() || vtepOUI.isError()) {
+      LOG(WARNING) << "Unable to set the neighbours of the VTEP: "
+                   << (vtepSubnet.isError()
+                         ? vtepSubnet.error()
+                         : vtepOUI.error());
+      return;
+    }
 
-    if (state != REGISTERING) {
-      LOG(WARNING) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
-                   << " because overlay agent is not in DISCONNECTED state";
+    Try<int> fd = netlink::socket();
+    if (fd.isError()) {
+      LOG(WARNING) << "Unable to set the neighbours of the VTEP: "
+                   << fd.error();
       return;
     }
 
-    list<Future<Nothing>> futures;
-    foreach (const AgentOverlayInfo& overlay, message.overlays()) {
-      const string name = overlay.info().name();
+    // The VTEP is created outside of the agent, and is looked up every
+    // time.
+    Result<int> index = netlink::link(fd.get(), vtep.get());
+    if (!index.isSome()) {
+      os::close(fd.get());
 
-      LOG(INFO) << "Configuring overlay network '" << name << "'";
+      if (index.isError()) {
+        LOG(WARNING) << "Unable to set the neighbours of the VTEP: "
+                     << index.error();
+      }
+      return;
+    }
 
-      // TODO(jieyu): Here, we assume that the overlay configuration
-      // never changes. Therefore, if the overlay is in `STATUS_OK` or
-      // if it is in `STATUS_CONFIGURING` state, we will skip the
-      // configuration. This might change soon.
-      if (overlays.contains(name) &&
-          overlays.at(name).has_state() &&
-          overlays.at(name).state().has_status() ) {
-        OverlayState::Status status = overlays.at(name).state().status();
+    netlink::Batch batch;
 
-        if ((status == OverlayState::STATUS_OK) ||
-            (status == OverlayState::STATUS_CONFIGURING)) {
-          LOG(INFO) << "Skipping configuration for overlay network '"
-                    << name << "' as it "
-                    << ((status == OverlayState::STATUS_OK) ?
-                       "has been " : "is being ")
-                    << "configured.";
+    // The neighbours and forwarding entries that are set, by VTEP IP
+    // and by `<MAC> <remote>`.
+    hashset<string> neighbours;
+    hashset<string> fdbs;
 
-          if (status == OverlayState::STATUS_OK) {
-            // We still set a `Future` for this overlay, so as to inform
-            // the Master about the state of this overlay network.
-            futures.push_back(Nothing());
-          }
+    const string address = stringify(self().address.ip);
+
+    foreach (const AgentInfo& agent, networkState.agents()) {
+      if (agent.ip() == address) {
+        continue;
+      }
+
+      Try<net::IP> remote = net::IP::parse(agent.ip(), AF_INET);
+      if (remote.isError()) {
+        continue;
+      }
 
+      foreach (const AgentOverlayInfo& overlay, agent.overlays()) {
+        if (!overlay.backend().has_vxlan()) {
           continue;
         }
-      }
 
-      CHECK(!overlay.has_state());
+        const VxLANInfo& peer = overlay.backend().vxlan();
 
-      overlays[name] = overlay;
+        Try<net::IPNetwork> peerIP =
+          net::IPNetwork::parse(peer.vtep_ip(), AF_INET);
 
-      futures.push_back(configure(name));
+        Try<net::MAC> peerMAC = parseMAC(peer.vtep_mac());
+
+        if (peerIP.isError() || peerMAC.isError() ||
+            neighbours.contains(stringify(peerIP->address()))) {
+          continue;
+        }
+
+        netlink::neighbour(
+            &batch,
+            peerIP->address(),
+            peerMAC.get(),
+            index.get());
+
+        netlink::fdb(&batch, peerMAC.get(), remote.get(), index.get());
+
+        neighbours.insert(stringify(peerIP->address()));
+        fdbs.insert(stringify(peerMAC.get()) + " " + stringify(remote.get()));
+      }
     }
 
-    // If we don't have any `Futures` setup that means this was a
-    // duplicate update corresponding to one already in progress. We
-    // should therefore not setup a response for acknowledging this
-    // registration.
-    if (futures.empty()) {
-      LOG(INFO) << "Looks like we received a duplicate config update from "
-                << from << " dropping this message.";
-      return;
+    Try<Nothing> unsuppressed = unsuppressNeighbours(
+        fd.get(),
+        index.get(),
+        vtepSubnet.get(),
+        vtepOUI.get(),
+        neighbours,
+        fdbs,
+        &batch);
+
+    if (unsuppressed.isError()) {
+      LOG(WARNING) << "Unable to remove the stale neighbours of the VTEP: "
+                   << unsuppressed.error();
     }
 
-    // Wait for all the networks to be configured.
-    await(futures)
-      .onAny(defer(self(),
-                   &ManagerProcess::_updateAgentOverlays,
-                   lambda::_1));
+    Try<Nothing> send = netlink::send(fd.get(), batch);
+
+    os::close(fd.get());
+
+    if (send.isError()) {
+      LOG(WARNING) << "Unable to set the neighbours of the VTEP: "
+                   << send.error();
+    }
   }
 
-  void _updateAgentOverlays(
-      const Future<list<Future<Nothing>>>& results)
+  // Adds to `batch` the removal of the permanent neighbours of the
+  // VxLAN VTEP `index` in `vtepSubnet`, and of its forwarding entries
+  // of the MACs with the OUI `oui`, that are not kept. The entries set
+  // by others, e.g. the default destination of the VTEP, are left.
+  static Try<Nothing> unsuppressNeighbours(
+      int fd,
+      int index,
+      const net::IPNetwork& vtepSubnet,
+      const net::MAC& oui,
+      const hashset<string>& neighbours,
+      const hashset<string>& fdbs,
+      netlink::Batch* batch)
   {
-    if (!results.isReady()) {
-      LOG(ERROR) << "Unable to configure any overlay: "
-                 << (results.isDiscarded() ? "discarded" : results.failure());
+    Try<vector<netlink::Neighbour>> _neighbours =
+      netlink::neighbours(fd, index);
 
-      return;
+    if (_neighbours.isError()) {
+      return Error(_neighbours.error());
     }
 
-    vector<string> messages;
-    // Check if there were any failures while configuring the
-    // overlays.
-    foreach(const Future<Nothing>& result, results.get()) {
-      if (!result.isReady()) {
-        messages.push_back(
-            (result.isDiscarded() ? "discarded" : result.failure()));
-      }
+    Try<vector<netlink::Neighbour>> _fdbs = netlink::fdbs(fd, index);
+    if (_fdbs.isError()) {
+      return Error(_fdbs.error());
     }
 
-    if (!messages.empty()){
-      LOG(ERROR) << "Unable to configure some of the overlays on this Agent: "
-                 << strings::join("\n", messages);
-    }
+    const uint32_t mask = ntohl(vtepSubnet.netmask().in().get().s_addr);
+    const uint32_t subnet = ntohl(vtepSubnet.address().in().get().s_addr);
 
-    if (state != REGISTERING) {
-      LOG(WARNING) << "Ignored sending registered message because "
-                   << "agent is not in REGISTERING state";
-      return;
+    foreach (const netlink::Neighbour& neighbour, _neighbours.get()) {
+      const uint32_t ip = ntohl(neighbour.ip.in().get().s_addr);
+
+      if ((ip & mask) == (subnet & mask) &&
+          !neighbours.contains(stringify(neighbour.ip))) {
+        netlink::unneighbour(batch, neighbour.ip, index);
+      }
     }
 
-    CHECK_SOME(overlayMaster);
+    foreach (const netlink::Neighbour& fdb, _fdbs.get()) {
+      if (fdb.mac[0] == oui[0] &&
+          fdb.mac[1] == oui[1] &&
+          fdb.mac[2] == oui[2] &&
+          !fdbs.contains(stringify(fdb.mac) + " " + stringify(fdb.ip))) {
+        netlink::unfdb(batch, fdb.mac, fdb.ip, index);
+      }
+    }
 
-    AgentRegisteredMessage message;
+    return Nothing();
+  }
 
-    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
-      // Every overlay network should have a status, and it should be
-      // either in `STATUS_OK` or `STATUS_FAILED`.
-      CHECK(overlay.has_state());
-      CHECK(overlay.state().has_status());
-      CHECK(overlay.state().status() != OverlayState::STATUS_CONFIGURING);
-      CHECK(overlay.state().status() != OverlayState::STATUS_INVALID);
+  // Parses the response of the `state` endpoint of the Master.
+  static Try<mesos::modules::overlay::State> parseState(
+      const Future<http::Response>& response)
+  {
+    if (!response.isReady()) {
+      return Error(
+          "Unable to fetch the state of the overlay Master: " +
+          (response.isFailed() ? response.failure() : "discarded"));
+    }
 
-      message.add_overlays()->CopyFrom(overlay);
+    if (response->status != http::OK().status) {
+      return Error(
+          "Unable to fetch the state of the overlay Master: " +
+          response->status);
     }
 
-    LOG(INFO) << "Sending agent registered message to " << overlayMaster.get();
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(response->body);
+    if (json.isError()) {
+      return Error(
+          "Unable to parse the state of the overlay Master: " +
+          json.error());
+    }
 
-    // NOTE: If this message does not reach the master, the master
-    // will keep sending 'UpdateAgentOverlaysMessage', which will
-    // essentially cause a retry of sending this message.
-    send(overlayMaster.get(), message);
+    return ::protobuf::parse<mesos::modules::overlay::State>(json.get());
+  }
 
-    return;
+  // Converts a rate in Mbit/s to bytes per second.
+  static uint64_t rate(uint32_t mbps)
+  {
+    return (uint64_t) mbps * 1000000 / 8;
   }
 
   void agentRegisteredAcknowledgement(const UPID& from)
   {
     LOG(INFO) << "Received agent registered acknowledgment from " << from;
 
+    // Updates with secondary subnets are acknowledged while the
+    // agent is registered, they do not count as configuration
+    // attempts.
+    if (state == REGISTERED) {
+      return;
+    }
+
     configAttempts++;
 
     if (configAttempts > maxConfigAttempts) {
@@ -442,8 +2099,20 @@ protected:
     AgentInfo agent;
     agent.set_ip(stringify(self().address.ip));
 
-    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+    foreach (const AgentOverlayInfo& overlay, getOverlays()) {
       agent.add_overlays()->CopyFrom(overlay);
+
+      const string& name = overlay.info().name();
+      if (!overlay.secondary() && traffic.contains(name)) {
+        foreach (const TrafficInfo& info, traffic.at(name)) {
+          agent.mutable_overlays()->rbegin()->add_traffic()->CopyFrom(info);
+        }
+      }
+
+      if (!overlay.secondary() && counters.contains(name)) {
+        agent.mutable_overlays()->rbegin()->mutable_counters()->CopyFrom(
+            counters.at(name));
+      }
     }
 
     if (request.acceptsMediaType(APPLICATION_JSON)) {
@@ -533,18 +2202,25 @@ protected:
     } else {
       const string overlaySubnet = overlays[name].info().subnet();
 
-      Try<string> command = strings::format(
-          "ipset add -exist %s %s" " nomatch &&"
-          " iptables -t nat -C POSTROUTING -s %s -m set"
-          " --match-set %s dst -j MASQUERADE ||"
-          " iptables -t nat -A POSTROUTING -s %s -m"
-          " set --match-set %s dst -j MASQUERADE",
-          IPSET_OVERLAY,
-          overlaySubnet,
-          overlaySubnet,
-          IPSET_OVERLAY,
-          overlaySubnet,
-          IPSET_OVERLAY);
+      // With the `IPSET` masquerade, the rule installed along with the
+      // ipset covers the overlay as soon as its subnet is in the set.
+      Try<string> command = masquerade == AgentConfig::IPSET
+        ? strings::format(
+              "ipset add -exist %s %s nomatch",
+              IPSET_OVERLAY,
+              overlaySubnet)
+        : strings::format(
+              "ipset add -exist %s %s" " nomatch &&"
+              " iptables -t nat -C POSTROUTING -s %s -m set"
+              " --match-set %s dst -j MASQUERADE ||"
+              " iptables -t nat -A POSTROUTING -s %s -m"
+              " set --match-set %s dst -j MASQUERADE",
+              IPSET_OVERLAY,
+              overlaySubnet,
+              overlaySubnet,
+              IPSET_OVERLAY,
+              overlaySubnet,
+              IPSET_OVERLAY);
 
       if (command.isError()) {
         overlayFailure(command.error());
@@ -602,20 +2278,101 @@ protected:
       return Failure("Failed to parse bridge ip: " + subnet.error());
     }
 
+    // The secondary subnets of the overlay are handed to `host-local`
+    // as additional ranges of the same range set, so that it leases
+    // addresses from them once the primary subnet is exhausted. The
+    // IPAM service of the agent gets all the subnets as well.
+    vector<IPNetwork> subnets = {subnet.get()};
+    vector<string> ranges;
+    if (secondaries.contains(name)) {
+      foreach (const AgentOverlayInfo& secondary, secondaries.at(name)) {
+        Try<IPNetwork> range = IPNetwork::parse(
+            secondary.mesos_bridge().ip(),
+            AF_INET);
+
+        if (range.isError()) {
+          return Failure("Failed to parse bridge ip: " + range.error());
+        }
+
+        subnets.push_back(range.get());
+        ranges.push_back(stringify(range.get()));
+      }
+    }
+
+    // With the IPAM service of the agent, the subnets are handed to
+    // the service before the CNI configuration refers to it.
+    Future<Nothing> configured = Nothing();
+    Option<string> socket = None();
+    if (ipam.isSome()) {
+      configured =
+        dispatch(ipam->get(), &IpamProcess::configure, name, subnets);
+
+      socket = ipam->get()->socket();
+    }
+
     AgentNetworkConfig _networkConfig;
     _networkConfig.CopyFrom(networkConfig);
 
-    auto config = [name, subnet, overlay, _networkConfig](JSON::ObjectWriter* writer) {
+    const bool _overlayCni = overlayCni;
+
+    // The limits of the containers are handed to the overlay CNI
+    // plugin, which applies them along with their labels.
+    Option<BandwidthLimit> bandwidth = None();
+    foreach (const BandwidthLimit& limit, networkConfig.bandwidth_limits()) {
+      if (limit.overlay() == name &&
+          (limit.has_container_egress_mbps() ||
+           limit.has_container_ingress_mbps())) {
+        bandwidth = limit;
+      }
+    }
+
+    auto config = [name, subnet, ranges, socket, overlay, _networkConfig,
+                   _overlayCni, bandwidth](JSON::ObjectWriter* writer) {
       writer->field("name", name);
-      writer->field("type", "bridge");
+      writer->field("type", _overlayCni ? CNI_OVERLAY_PLUGIN : "bridge");
       writer->field("bridge", overlay.mesos_bridge().name());
       writer->field("isGateway", true);
       writer->field("ipMasq", false);
       writer->field("mtu", _networkConfig.overlay_mtu());
 
-      writer->field("ipam", [subnet](JSON::ObjectWriter* writer) {
-        writer->field("type", "host-local");
-        writer->field("subnet", stringify(subnet.get()));
+      if (bandwidth.isSome()) {
+        writer->field("bandwidth", [bandwidth](JSON::ObjectWriter* writer) {
+          if (bandwidth->has_container_egress_mbps()) {
+            writer->field("egress_mbps", bandwidth->container_egress_mbps());
+          }
+
+          if (bandwidth->has_container_ingress_mbps()) {
+            writer->field(
+                "ingress_mbps",
+                bandwidth->container_ingress_mbps());
+          }
+        });
+      }
+
+      writer->field("ipam", [subnet, ranges, socket](
+          JSON::ObjectWriter* writer) {
+        if (socket.isSome()) {
+          writer->field("type", IPAM_PLUGIN);
+          writer->field("socket", socket.get());
+        } else if (ranges.empty()) {
+          writer->field("type", "host-local");
+          writer->field("subnet", stringify(subnet.get()));
+        } else {
+          writer->field("type", "host-local");
+          writer->field("ranges", [subnet, ranges](JSON::ArrayWriter* writer) {
+            writer->element([subnet, ranges](JSON::ArrayWriter* writer) {
+              writer->element([subnet](JSON::ObjectWriter* writer) {
+                writer->field("subnet", stringify(subnet.get()));
+              });
+
+              foreach (const string& range, ranges) {
+                writer->element([range](JSON::ObjectWriter* writer) {
+                  writer->field("subnet", range);
+                });
+              }
+            });
+          });
+        }
 
         writer->field("routes", [](JSON::ArrayWriter* writer) {
           writer->element([](JSON::ObjectWriter* writer) {
@@ -633,7 +2390,7 @@ protected:
       return Failure("Failed to write CNI config: " + write.error());
     }
 
-    return Nothing();
+    return configured;
   }
 
   Future<Nothing> configureDockerNetwork(const string& name)
@@ -771,11 +2528,23 @@ private:
       const string& _cniDir,
       const AgentNetworkConfig _networkConfig,
       const uint32_t _maxConfigAttempts,
+      const uint32_t _maxSubnets,
+      const Option<Owned<IpamProcess>>& _ipam,
+      const bool _overlayCni,
+      const AgentConfig::Masquerade _masquerade,
+      const Option<Owned<ProberProcess>>& _prober,
+      const uint32_t _probePeers,
       Owned<MasterDetector> _detector)
     : ProcessBase(AGENT_MANAGER_PROCESS_ID),
       cniDir(_cniDir),
       networkConfig(_networkConfig),
       maxConfigAttempts(_maxConfigAttempts),
+      maxSubnets(_maxSubnets),
+      ipam(_ipam),
+      overlayCni(_overlayCni),
+      masquerade(_masquerade),
+      prober(_prober),
+      probePeers(_probePeers),
       detector(_detector)
   {
     configAttempts = 0;
@@ -797,10 +2566,51 @@ private:
 
   hashmap<string, AgentOverlayInfo> overlays;
 
+  // Secondary subnets of each overlay, used by its Mesos network.
+  hashmap<string, vector<AgentOverlayInfo>> secondaries;
+
+  // Sequence number of the latest `UpdateAgentOverlaysMessage`.
+  Option<uint64_t> updateSequence;
+
   const uint32_t maxConfigAttempts;
 
   uint32_t configAttempts;
 
+  // Number of subnets, including the secondary ones, the agent holds
+  // at most on each overlay.
+  const uint32_t maxSubnets;
+
+  // IPAM service leasing the addresses of the Mesos networks, instead
+  // of `host-local`.
+  Option<Owned<IpamProcess>> ipam;
+
+  // Whether the Mesos networks use the overlay CNI plugin.
+  const bool overlayCni;
+
+  // Whether the traffic leaving the overlays is masqueraded by a rule
+  // per overlay, or by the single rule installed along with the ipset.
+  const AgentConfig::Masquerade masquerade;
+
+  // Traffic of the classes shaping each overlay as of the latest
+  // sample, and the bytes sent by each class by then.
+  hashmap<string, vector<TrafficInfo>> traffic;
+  hashmap<string, uint64_t> sampledBytes;
+  Option<Time> sampled;
+
+  // Counters of the bridges of each overlay as of the latest sample,
+  // and the overlays whose gauges have been added.
+  hashmap<string, CountersInfo> counters;
+  Option<Time> countersSampled;
+  hashset<string> counted;
+  vector<Gauge> gauges;
+
+  // Prober of the VTEPs of other Agents, and the VTEPs it probes, at
+  // most `probePeers` of them.
+  Option<Owned<ProberProcess>> prober;
+  const uint32_t probePeers;
+  vector<net::IP> peers;
+  Option<Time> peersSampled;
+
   Owned<MasterDetector> detector;
 
 };
@@ -819,6 +2629,14 @@ public:
           agentConfig.has_network_config() ?
           agentConfig.network_config() : AgentNetworkConfig(),
           agentConfig.max_configuration_attempts(),
+          agentConfig.max_subnets(),
+          agentConfig.has_ipam_dir() ?
+          Option<string>(agentConfig.ipam_dir()) : None(),
+          agentConfig.overlay_cni(),
+          agentConfig.conntrack_bypass(),
+          agentConfig.masquerade(),
+          agentConfig.has_probe() ?
+          Option<ProbeConfig>(agentConfig.probe()) : None(),
           detector);
 
     if (process.isError()) {
@@ -0,0 +1,262 @@
+#ifndef __OVERLAY_BUDDY_HPP__
+#define __OVERLAY_BUDDY_HPP__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/interval.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// Buddy-system allocator over an index space of `blocks` blocks of
+// 2^`maxOrder` units each. A block of order `k` spans 2^k units and
+// is identified by the offset of its first unit, which is always a
+// multiple of 2^k. Allocating a block splits the smallest free block
+// that fits, freeing a block merges it with its free buddies.
+//
+// The blocks of the highest order are kept in an `IntervalSet`, so
+// that an allocator with a single order behaves like a flat
+// `IntervalSet` index space. The lower orders are kept in ordered
+// sets. Allocation, free and reservation are O(maxOrder * log n), and
+// always hand out the block with the lowest offset.
+class BuddyAllocator
+{
+public:
+  BuddyAllocator(uint32_t _blocks, uint8_t _maxOrder)
+    : blocks(_blocks),
+      maxOrder(_maxOrder),
+      freeBlocks(_maxOrder)
+  {
+    reset();
+  }
+
+  Try<uint32_t> allocate(uint8_t order)
+  {
+    if (order > maxOrder) {
+      return Error(
+          "Order " + stringify((uint32_t) order) + " exceeds the maximum "
+          "order " + stringify((uint32_t) maxOrder));
+    }
+
+    // Find the smallest free block that can hold the allocation.
+    for (uint8_t k = order; k < maxOrder; k++) {
+      if (!freeBlocks[k].empty()) {
+        uint32_t offset = *freeBlocks[k].begin();
+        freeBlocks[k].erase(freeBlocks[k].begin());
+
+        return split(offset, k, order);
+      }
+    }
+
+    if (top.empty()) {
+      return Error("No free blocks available");
+    }
+
+    uint32_t block = top.begin()->lower();
+    top -= block;
+
+    return split(block << maxOrder, maxOrder, order);
+  }
+
+  Try<Nothing> free(uint32_t offset, uint8_t order)
+  {
+    Try<Nothing> valid = validate(offset, order);
+    if (valid.isError()) {
+      return Error(valid.error());
+    }
+
+    if (contained(offset, order)) {
+      return Error("Block " + stringify(offset) + " is already free");
+    }
+
+    // A block whose parts are free already was not allocated with
+    // this order, freeing it would make the free blocks overlap.
+    if (overlaps(offset, order)) {
+      return Error(
+          "Block " + stringify(offset) + " of order " +
+          stringify((uint32_t) order) + " holds free blocks");
+    }
+
+    available += (uint64_t) 1 << order;
+
+    // Merge the block with its buddy for as long as the buddy is free.
+    while (order < maxOrder) {
+      uint32_t buddy = offset ^ ((uint32_t) 1 << order);
+
+      if (freeBlocks[order].erase(buddy) == 0) {
+        freeBlocks[order].insert(offset);
+        return Nothing();
+      }
+
+      offset = std::min(offset, buddy);
+      order++;
+    }
+
+    top += offset >> maxOrder;
+
+    return Nothing();
+  }
+
+  // Marks a specific block as allocated, e.g. when recovering.
+  Try<Nothing> reserve(uint32_t offset, uint8_t order)
+  {
+    Try<Nothing> valid = validate(offset, order);
+    if (valid.isError()) {
+      return Error(valid.error());
+    }
+
+    // Find the free block containing the block to reserve.
+    for (uint8_t k = order; k < maxOrder; k++) {
+      uint32_t base = offset & ~(((uint32_t) 1 << k) - 1);
+
+      if (freeBlocks[k].erase(base) > 0) {
+        split(base, k, order, offset);
+        return Nothing();
+      }
+    }
+
+    uint32_t block = offset >> maxOrder;
+
+    if (!top.contains(block)) {
+      return Error("Block " + stringify(offset) + " is not available");
+    }
+
+    top -= block;
+
+    split(block << maxOrder, maxOrder, order, offset);
+
+    return Nothing();
+  }
+
+  void reset()
+  {
+    foreach (std::set<uint32_t>& _freeBlocks, freeBlocks) {
+      _freeBlocks.clear();
+    }
+
+    top = IntervalSet<uint32_t>();
+
+    if (blocks > 0) {
+      top +=
+        (Bound<uint32_t>::closed(0),
+         Bound<uint32_t>::closed(blocks - 1));
+    }
+
+    available = (uint64_t) blocks << maxOrder;
+  }
+
+  // Returns the number of units that are not allocated.
+  uint64_t availableUnits() const
+  {
+    return available;
+  }
+
+private:
+  Try<Nothing> validate(uint32_t offset, uint8_t order) const
+  {
+    if (order > maxOrder) {
+      return Error(
+          "Order " + stringify((uint32_t) order) + " exceeds the maximum "
+          "order " + stringify((uint32_t) maxOrder));
+    }
+
+    if ((offset & (((uint32_t) 1 << order) - 1)) != 0) {
+      return Error(
+          "Block " + stringify(offset) + " is not aligned to its order " +
+          stringify((uint32_t) order));
+    }
+
+    if ((offset >> maxOrder) >= blocks) {
+      return Error("Block " + stringify(offset) + " is out of range");
+    }
+
+    return Nothing();
+  }
+
+  // Returns whether the block is part of a free block.
+  bool contained(uint32_t offset, uint8_t order) const
+  {
+    for (uint8_t k = order; k < maxOrder; k++) {
+      if (freeBlocks[k].count(offset & ~(((uint32_t) 1 << k) - 1)) > 0) {
+        return true;
+      }
+    }
+
+    return top.contains(offset >> maxOrder);
+  }
+
+  // Returns whether any free block of a lower order lies within the
+  // block.
+  bool overlaps(uint32_t offset, uint8_t order) const
+  {
+    const uint64_t end = (uint64_t) offset + ((uint64_t) 1 << order);
+
+    for (uint8_t k = 0; k < std::min(order, maxOrder); k++) {
+      std::set<uint32_t>::const_iterator block =
+        freeBlocks[k].lower_bound(offset);
+
+      if (block != freeBlocks[k].end() && *block < end) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Splits the free block at `offset` of order `from` down to the
+  // block of order `to` that contains `target`, freeing the halves
+  // that are not needed. Returns the offset of the allocated block.
+  uint32_t split(uint32_t offset, uint8_t from, uint8_t to)
+  {
+    return split(offset, from, to, offset);
+  }
+
+  uint32_t split(uint32_t offset, uint8_t from, uint8_t to, uint32_t target)
+  {
+    while (from > to) {
+      from--;
+
+      uint32_t half = (uint32_t) 1 << from;
+
+      if (target & half) {
+        freeBlocks[from].insert(offset);
+        offset += half;
+      } else {
+        freeBlocks[from].insert(offset + half);
+      }
+    }
+
+    available -= (uint64_t) 1 << to;
+
+    return offset;
+  }
+
+  uint32_t blocks;
+  uint8_t maxOrder;
+
+  // Free blocks of the highest order, by index.
+  IntervalSet<uint32_t> top;
+
+  // Free blocks of the lower orders, by offset.
+  std::vector<std::set<uint32_t>> freeBlocks;
+
+  uint64_t available;
+};
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_BUDDY_HPP__
@@ -0,0 +1,212 @@
+#ifndef __OVERLAY_CNI_HPP__
+#define __OVERLAY_CNI_HPP__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <net/if.h>
+
+#include <iostream>
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/json.hpp>
+#include <stout/jsonify.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/strings.hpp>
+#include <stout/try.hpp>
+
+
+// Helpers shared by the CNI plugins of the overlay, and by the Agent
+// module for the names of the links they create.
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace cni {
+
+// Error codes of the CNI specification. The codes from 100 on are
+// specific to the plugins.
+constexpr int ERROR_INVALID_ENVIRONMENT = 4;
+constexpr int ERROR_DECODE_FAILURE = 6;
+constexpr int ERROR_INVALID_CONFIG = 7;
+constexpr int ERROR_IPAM = 100;
+constexpr int ERROR_NETLINK = 101;
+
+// Version of the network configurations without a `cniVersion`, such
+// as the ones written by the overlay Agent module.
+constexpr char DEFAULT_VERSION[] = "0.2.0";
+
+// Reply of the plugins to the `VERSION` command.
+constexpr char VERSIONS[] =
+  "{\"cniVersion\":\"0.3.1\","
+  "\"supportedVersions\":[\"0.1.0\",\"0.2.0\",\"0.3.0\",\"0.3.1\"]}";
+
+
+// Prints a CNI error, and returns the exit status of the plugin.
+inline int fail(
+    const std::string& version,
+    int code,
+    const std::string& message)
+{
+  std::cout << jsonify([&](JSON::ObjectWriter* writer) {
+    writer->field("cniVersion", version);
+    writer->field("code", code);
+    writer->field("msg", message);
+  }) << std::endl;
+
+  return EXIT_FAILURE;
+}
+
+
+// Reads the network configuration handed to the plugin.
+inline Try<std::string> readStdin()
+{
+  std::string data;
+  char buffer[4096];
+
+  while (true) {
+    ssize_t length = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ErrnoError();
+    }
+
+    if (length == 0) {
+      return data;
+    }
+
+    data.append(buffer, length);
+  }
+}
+
+
+// Returns the name of the host end of the veth pair of a container
+// interface. The name is derived from the container, so that the pair
+// can be removed without entering the network namespace of the
+// container, which might be gone already.
+inline std::string vethName(
+    const std::string& containerId,
+    const std::string& ifname)
+{
+  // FNV-1a, which unlike `std::hash` is the same in every build of
+  // the plugin.
+  uint64_t hash = 14695981039346656037ULL;
+  foreach (char c, containerId + "/" + ifname) {
+    hash ^= (uint8_t) c;
+    hash *= 1099511628211ULL;
+  }
+
+  char name[IFNAMSIZ];
+  snprintf(
+      name,
+      sizeof(name),
+      "veth%011llx",
+      (unsigned long long) (hash & 0xfffffffffffULL));
+
+  return name;
+}
+
+
+// Returns the value of a label of the container, which Mesos hands to
+// the plugins in the network configuration.
+inline Option<std::string> label(
+    const JSON::Object& config,
+    const std::string& key)
+{
+  Result<JSON::Object> args = config.find<JSON::Object>("args");
+  if (!args.isSome()) {
+    return None();
+  }
+
+  // The key of the arguments of Mesos holds dots, which `find()`
+  // takes as separators.
+  auto arguments = args->values.find("org.apache.mesos");
+  if (arguments == args->values.end() ||
+      !arguments->second.is<JSON::Object>()) {
+    return None();
+  }
+
+  Result<JSON::Array> labels = arguments->second.as<JSON::Object>()
+    .find<JSON::Array>("network_info.labels.labels");
+
+  if (!labels.isSome()) {
+    return None();
+  }
+
+  foreach (const JSON::Value& value, labels->values) {
+    if (!value.is<JSON::Object>()) {
+      continue;
+    }
+
+    const JSON::Object& label = value.as<JSON::Object>();
+
+    Result<JSON::String> _key = label.find<JSON::String>("key");
+    Result<JSON::String> _value = label.find<JSON::String>("value");
+
+    if (_key.isSome() && _key->value == key && _value.isSome()) {
+      return _value->value;
+    }
+  }
+
+  return None();
+}
+
+
+// Builds the result of an `ADD` holding a single IPv4 address. The
+// last one of `interfaces`, if any, is the interface of the container
+// the address is set on.
+inline JSON::Object result(
+    const std::string& version,
+    const std::string& address,
+    const std::string& gateway,
+    const JSON::Array& routes,
+    const JSON::Array& interfaces = JSON::Array())
+{
+  JSON::Object result;
+  result.values["cniVersion"] = version;
+
+  // Results up to version 0.2.0 of the specification hold a single
+  // IPv4 configuration, later ones a list of addresses.
+  if (strings::startsWith(version, "0.1.") ||
+      strings::startsWith(version, "0.2.")) {
+    JSON::Object ip4;
+    ip4.values["ip"] = address;
+    ip4.values["gateway"] = gateway;
+    ip4.values["routes"] = routes;
+
+    result.values["ip4"] = ip4;
+  } else {
+    JSON::Object ip;
+    ip.values["version"] = "4";
+    ip.values["address"] = address;
+    ip.values["gateway"] = gateway;
+
+    if (!interfaces.values.empty()) {
+      ip.values["interface"] = interfaces.values.size() - 1;
+      result.values["interfaces"] = interfaces;
+    }
+
+    JSON::Array ips;
+    ips.values.push_back(ip);
+
+    result.values["ips"] = ips;
+    result.values["routes"] = routes;
+  }
+
+  return result;
+}
+
+} // namespace cni {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_CNI_HPP__
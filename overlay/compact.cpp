@@ -0,0 +1,493 @@
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/mac.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include "compact.hpp"
+#include "overlay.hpp"
+
+using std::string;
+using std::vector;
+
+using net::IP;
+using net::IPNetwork;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// Returns the IPv4 address in host byte order.
+static uint32_t address(const IP& ip)
+{
+  return ntohl(ip.in().get().s_addr);
+}
+
+
+// Derives the VTEP MAC from the OUI and the least 24 bits of the VTEP
+// IP, the same way `Vtep::generateMAC` in the Master does.
+static Try<string> vtepMAC(const string& oui, uint32_t ip)
+{
+  vector<string> tokens = strings::split(oui, ":");
+  if (tokens.size() != 6) {
+    return Error("Invalid OUI MAC address: " + oui);
+  }
+
+  uint8_t mac[6];
+  for (size_t i = 0; i < 3; i++) {
+    sscanf(tokens[i].c_str(), "%hhx", &mac[i]);
+  }
+
+  mac[3] = (ip >> 16) & 0xff;
+  mac[4] = (ip >> 8) & 0xff;
+  mac[5] = ip & 0xff;
+
+  return stringify(net::MAC(mac));
+}
+
+
+// Derives the bridge of an overlay from the Agent subnet. The Mesos
+// bridge gets the lower and the Docker bridge the upper half of the
+// subnet, and the Mesos bridge gets the whole of a secondary subnet.
+static Try<BridgeInfo> bridge(
+    const string& name,
+    uint32_t subnet,
+    uint32_t prefix,
+    bool docker,
+    bool secondary)
+{
+  if (docker) {
+    subnet |= 0x1 << (32 - (prefix + 1));
+  }
+
+  Try<IPNetwork> network =
+    IPNetwork::create(IP(subnet), secondary ? prefix : prefix + 1);
+  if (network.isError()) {
+    return Error(network.error());
+  }
+
+  BridgeInfo info;
+  info.set_name((docker ? DOCKER_BRIDGE_PREFIX : MESOS_BRIDGE_PREFIX) + name);
+  info.set_ip(stringify(network.get()));
+
+  return info;
+}
+
+
+Try<Nothing> compact(const State& state, CompactState* compact)
+{
+  compact->Clear();
+
+  if (!state.has_network()) {
+    if (state.agents_size() > 0) {
+      return Error("Cannot encode Agents without a network configuration");
+    }
+
+    return Nothing();
+  }
+
+  const NetworkConfig& network = state.network();
+
+  compact->mutable_network()->CopyFrom(network);
+
+  Try<IPNetwork> vtepSubnet = IPNetwork::parse(network.vtep_subnet(), AF_INET);
+  if (vtepSubnet.isError()) {
+    return Error("Unable to parse the VTEP subnet: " + vtepSubnet.error());
+  }
+
+  hashmap<string, int> indexes;
+  for (int i = 0; i < network.overlays_size(); i++) {
+    indexes[network.overlays(i).name()] = i;
+  }
+
+  hashmap<string, uint32_t> topologies;
+
+  for (int i = 0; i < state.agents_size(); i++) {
+    const AgentInfo& agentInfo = state.agents(i);
+
+    Try<IP> ip = IP::parse(agentInfo.ip(), AF_INET);
+    if (ip.isError()) {
+      return Error(
+          "Unable to parse the IP of Agent " + agentInfo.ip() + ": " +
+          ip.error());
+    }
+
+    CompactState::Agent* agent = compact->add_agents();
+    agent->set_ip(address(ip.get()));
+
+    if (agentInfo.has_topology()) {
+      if (!topologies.contains(agentInfo.topology())) {
+        topologies[agentInfo.topology()] = compact->topologies_size();
+        compact->add_topologies(agentInfo.topology());
+      }
+
+      agent->set_topology(topologies.at(agentInfo.topology()));
+    }
+
+    for (int j = 0; j < agentInfo.overlays_size(); j++) {
+      const AgentOverlayInfo& overlay = agentInfo.overlays(j);
+      const string& name = overlay.info().name();
+
+      if (!indexes.contains(name)) {
+        return Error(
+            "Unknown overlay '" + name + "' on Agent " + agentInfo.ip());
+      }
+
+      // NOTE: The overlays are matched by name only, their info is
+      // derived from the network configuration on expansion. An Agent
+      // stored before the configuration of an overlay changed, e.g.,
+      // before `host_gw` was added to it, is thereby brought up to
+      // date instead of making the whole network state unreadable.
+      const OverlayInfo& info = network.overlays(indexes.at(name));
+
+      CompactState::Overlay* _overlay = agent->add_overlays();
+      _overlay->set_index(indexes.at(name));
+
+      if (overlay.has_subnet()) {
+        Try<IPNetwork> subnet = IPNetwork::parse(overlay.subnet(), AF_INET);
+        if (subnet.isError()) {
+          return Error(
+              "Unable to parse the subnet of overlay '" + name +
+              "' on Agent " + agentInfo.ip() + ": " + subnet.error());
+        }
+
+        const uint32_t prefix = subnet->prefix();
+        const uint32_t minPrefix =
+          info.has_min_prefix() ? info.min_prefix() : info.prefix();
+        const uint32_t maxPrefix =
+          info.has_max_prefix() ? info.max_prefix() : info.prefix();
+
+        if (prefix < minPrefix || prefix > maxPrefix) {
+          return Error(
+              "Subnet " + overlay.subnet() + " of Agent " + agentInfo.ip() +
+              " does not match the prefixes of overlay '" + name + "'");
+        }
+
+        _overlay->set_subnet(address(subnet->address()));
+
+        if (prefix != info.prefix()) {
+          _overlay->set_prefix(prefix);
+        }
+
+        if (overlay.secondary()) {
+          if (overlay.has_docker_bridge()) {
+            return Error(
+                "Secondary subnet " + overlay.subnet() + " of Agent " +
+                agentInfo.ip() + " has a Docker bridge");
+          }
+
+          _overlay->set_secondary(true);
+        }
+
+        auto encodeBridge = [&](
+            const BridgeInfo& bridgeInfo,
+            bool docker) -> Try<Nothing> {
+          Try<BridgeInfo> expected = bridge(
+              name,
+              _overlay->subnet(),
+              prefix,
+              docker,
+              overlay.secondary());
+
+          if (expected.isError()) {
+            return Error(expected.error());
+          }
+
+          if (bridgeInfo.name() != expected->name() ||
+              bridgeInfo.ip() != expected->ip()) {
+            return Error(
+                "Bridge " + bridgeInfo.name() + " of Agent " +
+                agentInfo.ip() + " cannot be derived from its subnet");
+          }
+
+          return Nothing();
+        };
+
+        if (overlay.has_mesos_bridge()) {
+          Try<Nothing> encode = encodeBridge(overlay.mesos_bridge(), false);
+          if (encode.isError()) {
+            return Error(encode.error());
+          }
+
+          _overlay->set_mesos_bridge(true);
+        }
+
+        if (overlay.has_docker_bridge()) {
+          Try<Nothing> encode = encodeBridge(overlay.docker_bridge(), true);
+          if (encode.isError()) {
+            return Error(encode.error());
+          }
+
+          _overlay->set_docker_bridge(true);
+        }
+      } else if (overlay.has_mesos_bridge() || overlay.has_docker_bridge()) {
+        return Error(
+            "Overlay '" + name + "' on Agent " + agentInfo.ip() +
+            " has bridges but no subnet");
+      } else if (overlay.secondary()) {
+        return Error(
+            "Secondary overlay '" + name + "' on Agent " + agentInfo.ip() +
+            " has no subnet");
+      }
+
+      // Both encapsulations have the same VNI and VTEP, which are
+      // compacted the same way.
+      VxLANInfo vxlan;
+      if (network.encapsulation() == NetworkConfig::GENEVE) {
+        if (!overlay.backend().has_geneve()) {
+          return Error(
+              "Overlay '" + name + "' on Agent " + agentInfo.ip() +
+              " has no Geneve backend");
+        }
+
+        const GeneveInfo& geneve = overlay.backend().geneve();
+        vxlan.set_vni(geneve.vni());
+        vxlan.set_vtep_name(geneve.vtep_name());
+        vxlan.set_vtep_ip(geneve.vtep_ip());
+        vxlan.set_vtep_mac(geneve.vtep_mac());
+      } else {
+        if (!overlay.backend().has_vxlan()) {
+          return Error(
+              "Overlay '" + name + "' on Agent " + agentInfo.ip() +
+              " has no VxLAN backend");
+        }
+
+        vxlan.CopyFrom(overlay.backend().vxlan());
+      }
+
+      // All Agents share the same VNI and VTEP device name.
+      if (!compact->has_vni()) {
+        compact->set_vni(vxlan.vni());
+        compact->set_vtep_name(vxlan.vtep_name());
+      } else if (compact->vni() != vxlan.vni() ||
+                 compact->vtep_name() != vxlan.vtep_name()) {
+        return Error(
+            "Backend of Agent " + agentInfo.ip() +
+            " differs from the other Agents");
+      }
+
+      Try<IPNetwork> vtepIP = IPNetwork::parse(vxlan.vtep_ip(), AF_INET);
+      if (vtepIP.isError()) {
+        return Error(
+            "Unable to parse the VTEP IP of Agent " + agentInfo.ip() +
+            ": " + vtepIP.error());
+      }
+
+      if (vtepIP->prefix() != vtepSubnet->prefix()) {
+        return Error(
+            "VTEP IP " + vxlan.vtep_ip() + " of Agent " + agentInfo.ip() +
+            " does not match the VTEP subnet");
+      }
+
+      // All overlay instances on an Agent share the same VTEP.
+      if (!agent->has_vtep_ip()) {
+        agent->set_vtep_ip(address(vtepIP->address()));
+
+        Try<string> mac = vtepMAC(network.vtep_mac_oui(), agent->vtep_ip());
+        if (mac.isError()) {
+          return Error(mac.error());
+        }
+
+        if (strings::lower(mac.get()) != strings::lower(vxlan.vtep_mac())) {
+          return Error(
+              "VTEP MAC " + vxlan.vtep_mac() + " of Agent " +
+              agentInfo.ip() + " cannot be derived from its VTEP IP");
+        }
+      } else if (agent->vtep_ip() != address(vtepIP->address())) {
+        return Error(
+            "Overlays on Agent " + agentInfo.ip() + " use different VTEPs");
+      }
+
+      // The subnets of an Agent are routed directly through the Agent
+      // itself, on the overlays with `host_gw`.
+      if (overlay.backend().has_host_gw()) {
+        if (!info.host_gw() ||
+            overlay.backend().host_gw().ip() != agentInfo.ip()) {
+          return Error(
+              "Direct routing of overlay '" + name + "' on Agent " +
+              agentInfo.ip() + " cannot be derived from the Agent");
+        }
+
+        agent->set_host_gw(true);
+      }
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> expand(
+    const CompactState& compact,
+    const CompactState::Agent& agent,
+    AgentInfo* agentInfo)
+{
+  agentInfo->Clear();
+
+  if (!compact.has_network()) {
+    return Error("Cannot decode Agents without a network configuration");
+  }
+
+  const NetworkConfig& network = compact.network();
+
+  agentInfo->set_ip(stringify(IP(agent.ip())));
+
+  if (agent.has_topology()) {
+    if (agent.topology() >= (uint32_t) compact.topologies_size()) {
+      return Error(
+          "Agent " + agentInfo->ip() + " refers to unknown topology " +
+          stringify(agent.topology()));
+    }
+
+    agentInfo->set_topology(compact.topologies(agent.topology()));
+  }
+
+  if (agent.overlays_size() == 0) {
+    return Nothing();
+  }
+
+  if (!agent.has_vtep_ip()) {
+    return Error("Agent " + agentInfo->ip() + " has no VTEP IP");
+  }
+
+  Try<IPNetwork> vtepSubnet = IPNetwork::parse(network.vtep_subnet(), AF_INET);
+  if (vtepSubnet.isError()) {
+    return Error("Unable to parse the VTEP subnet: " + vtepSubnet.error());
+  }
+
+  Try<IPNetwork> vtepIP =
+    IPNetwork::create(IP(agent.vtep_ip()), vtepSubnet->prefix());
+
+  if (vtepIP.isError()) {
+    return Error(
+        "Unable to create the VTEP IP of Agent " + agentInfo->ip() +
+        ": " + vtepIP.error());
+  }
+
+  Try<string> vtepMac = vtepMAC(network.vtep_mac_oui(), agent.vtep_ip());
+  if (vtepMac.isError()) {
+    return Error(vtepMac.error());
+  }
+
+  for (int j = 0; j < agent.overlays_size(); j++) {
+    const CompactState::Overlay& _overlay = agent.overlays(j);
+
+    if (_overlay.index() >= (uint32_t) network.overlays_size()) {
+      return Error(
+          "Agent " + agentInfo->ip() + " refers to unknown overlay " +
+          stringify(_overlay.index()));
+    }
+
+    const OverlayInfo& info = network.overlays(_overlay.index());
+
+    AgentOverlayInfo* overlay = agentInfo->add_overlays();
+    overlay->mutable_info()->CopyFrom(info);
+
+    if (_overlay.has_subnet()) {
+      const uint32_t prefix =
+        _overlay.has_prefix() ? _overlay.prefix() : info.prefix();
+
+      Try<IPNetwork> subnet =
+        IPNetwork::create(IP(_overlay.subnet()), prefix);
+
+      if (subnet.isError()) {
+        return Error(
+            "Unable to create the subnet of overlay '" + info.name() +
+            "' on Agent " + agentInfo->ip() + ": " + subnet.error());
+      }
+
+      overlay->set_subnet(stringify(subnet.get()));
+
+      if (_overlay.secondary()) {
+        overlay->set_secondary(true);
+      }
+
+      if (_overlay.mesos_bridge()) {
+        Try<BridgeInfo> mesos = bridge(
+            info.name(),
+            _overlay.subnet(),
+            prefix,
+            false,
+            _overlay.secondary());
+
+        if (mesos.isError()) {
+          return Error(mesos.error());
+        }
+
+        overlay->mutable_mesos_bridge()->CopyFrom(mesos.get());
+      }
+
+      if (_overlay.docker_bridge()) {
+        Try<BridgeInfo> docker = bridge(
+            info.name(),
+            _overlay.subnet(),
+            prefix,
+            true,
+            false);
+
+        if (docker.isError()) {
+          return Error(docker.error());
+        }
+
+        overlay->mutable_docker_bridge()->CopyFrom(docker.get());
+      }
+    }
+
+    if (network.encapsulation() == NetworkConfig::GENEVE) {
+      GeneveInfo* geneve = overlay->mutable_backend()->mutable_geneve();
+      geneve->set_vni(compact.vni());
+      geneve->set_vtep_name(compact.vtep_name());
+      geneve->set_vtep_ip(stringify(vtepIP.get()));
+      geneve->set_vtep_mac(vtepMac.get());
+    } else {
+      VxLANInfo* vxlan = overlay->mutable_backend()->mutable_vxlan();
+      vxlan->set_vni(compact.vni());
+      vxlan->set_vtep_name(compact.vtep_name());
+      vxlan->set_vtep_ip(stringify(vtepIP.get()));
+      vxlan->set_vtep_mac(vtepMac.get());
+    }
+
+    if (agent.host_gw() && info.host_gw()) {
+      overlay->mutable_backend()->mutable_host_gw()->set_ip(agentInfo->ip());
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> expand(const CompactState& compact, State* state)
+{
+  state->Clear();
+
+  if (!compact.has_network()) {
+    if (compact.agents_size() > 0) {
+      return Error("Cannot decode Agents without a network configuration");
+    }
+
+    return Nothing();
+  }
+
+  state->mutable_network()->CopyFrom(compact.network());
+
+  for (int i = 0; i < compact.agents_size(); i++) {
+    Try<Nothing> expanded =
+      expand(compact, compact.agents(i), state->add_agents());
+
+    if (expanded.isError()) {
+      return expanded;
+    }
+  }
+
+  return Nothing();
+}
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,41 @@
+#ifndef __OVERLAY_COMPACT_HPP__
+#define __OVERLAY_COMPACT_HPP__
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+// ONLY USEFUL AFTER RUNNING PROTOC.
+#include <overlay/overlay.pb.h>
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// Encodes `state` into its normalized representation. Returns an
+// `Error` if `state` holds information that cannot be derived from
+// the `CompactState`, e.g. a VTEP MAC that does not match the VTEP
+// IP of the Agent.
+//
+// NOTE: The `State` of the overlays on the Agents is not encoded, and
+// neither is their `OverlayInfo`, which is that of the overlay of the
+// same name in the network configuration once expanded.
+Try<Nothing> compact(const State& state, CompactState* compact);
+
+
+// Decodes the normalized representation back into `state`.
+Try<Nothing> expand(const CompactState& compact, State* state);
+
+
+// Decodes the Agent `agent` of `compact` into `agentInfo`. `agent`
+// does not need to be one of the Agents of `compact`.
+Try<Nothing> expand(
+    const CompactState& compact,
+    const CompactState::Agent& agent,
+    AgentInfo* agentInfo);
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_COMPACT_HPP__
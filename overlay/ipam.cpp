@@ -0,0 +1,787 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/id.hpp>
+#include <process/io.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/protobuf.hpp>
+#include <stout/stringify.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/exists.hpp>
+#include <stout/os/fsync.hpp>
+#include <stout/os/open.hpp>
+#include <stout/os/rename.hpp>
+#include <stout/os/write.hpp>
+
+#include "cni.hpp"
+#include "ipam.hpp"
+#include "netlink.hpp"
+
+
+namespace io = process::io;
+
+using std::string;
+using std::vector;
+
+using net::IP;
+using net::IPNetwork;
+
+using process::defer;
+using process::delay;
+using process::Failure;
+using process::Future;
+using process::Owned;
+
+using mesos::modules::overlay::TrafficInfo;
+using mesos::modules::overlay::internal::IpamLease;
+using mesos::modules::overlay::internal::IpamRequest;
+using mesos::modules::overlay::internal::IpamResponse;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// Interval at which the leases of the containers that are gone are
+// released.
+constexpr Duration IPAM_GC_INTERVAL = Minutes(1);
+
+// Number of entries the lease journal can hold before it is rewritten
+// with the current leases, once most of its entries are stale.
+constexpr size_t IPAM_JOURNAL_ENTRIES = 1024;
+
+
+static Try<struct sockaddr_un> unixAddress(const string& path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path)) {
+    return Error("Socket path '" + path + "' is too long");
+  }
+
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  return address;
+}
+
+
+static string leaseKey(const string& containerId, const string& ifname)
+{
+  return containerId + "/" + ifname;
+}
+
+
+Try<IpamResponse> ipam(const string& socket, const IpamRequest& request)
+{
+  Try<struct sockaddr_un> address = unixAddress(socket);
+  if (address.isError()) {
+    return Error(address.error());
+  }
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to create socket");
+  }
+
+  if (::connect(
+          fd,
+          (struct sockaddr*) &address.get(),
+          sizeof(address.get())) < 0) {
+    ErrnoError error("Failed to connect to '" + socket + "'");
+    os::close(fd);
+    return error;
+  }
+
+  Try<Nothing> write = os::write(fd, stringify(JSON::protobuf(request)));
+  if (write.isError()) {
+    os::close(fd);
+    return Error("Failed to send the request: " + write.error());
+  }
+
+  // The service reads the request till the end of the stream.
+  if (::shutdown(fd, SHUT_WR) < 0) {
+    ErrnoError error("Failed to send the request");
+    os::close(fd);
+    return error;
+  }
+
+  string data;
+  char buffer[4096];
+
+  while (true) {
+    ssize_t length = ::read(fd, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      ErrnoError error("Failed to read the reply");
+      os::close(fd);
+      return error;
+    }
+
+    if (length == 0) {
+      break;
+    }
+
+    data.append(buffer, length);
+  }
+
+  os::close(fd);
+
+  Try<JSON::Object> json = JSON::parse<JSON::Object>(data);
+  if (json.isError()) {
+    return Error("Failed to parse the reply: " + json.error());
+  }
+
+  Try<IpamResponse> response = ::protobuf::parse<IpamResponse>(json.get());
+  if (response.isError()) {
+    return Error("Failed to parse the reply: " + response.error());
+  }
+
+  return response.get();
+}
+
+
+Try<Owned<IpamProcess>> IpamProcess::create(const string& directory)
+{
+  Try<Nothing> mkdir = os::mkdir(directory);
+  if (mkdir.isError()) {
+    return Error(
+        "Failed to create directory '" + directory + "': " + mkdir.error());
+  }
+
+  const string socket = path::join(directory, IPAM_SOCKET);
+
+  Try<struct sockaddr_un> address = unixAddress(socket);
+  if (address.isError()) {
+    return Error(address.error());
+  }
+
+  // The socket of a previous instance of the Agent.
+  if (os::exists(socket)) {
+    Try<Nothing> rm = os::rm(socket);
+    if (rm.isError()) {
+      return Error("Failed to remove '" + socket + "': " + rm.error());
+    }
+  }
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    return ErrnoError("Failed to create socket");
+  }
+
+  // NOTE: The process owns the socket from here on.
+  Owned<IpamProcess> process(new IpamProcess(directory, listener));
+
+  if (::bind(
+          listener,
+          (struct sockaddr*) &address.get(),
+          sizeof(address.get())) < 0) {
+    return ErrnoError("Failed to bind to '" + socket + "'");
+  }
+
+  if (::listen(listener, SOMAXCONN) < 0) {
+    return ErrnoError("Failed to listen on '" + socket + "'");
+  }
+
+  // NOTE: This is a prerequisite for `io::poll`.
+  Try<Nothing> nonblock = os::nonblock(listener);
+  if (nonblock.isError()) {
+    return Error("Failed to set socket as non-blocking: " + nonblock.error());
+  }
+
+  Try<Nothing> recover = process->recover();
+  if (recover.isError()) {
+    return Error("Failed to recover the leases: " + recover.error());
+  }
+
+  return process;
+}
+
+
+IpamProcess::IpamProcess(const string& _directory, int _listener)
+  : ProcessBase(process::ID::generate("overlay-ipam")),
+    directory(_directory),
+    listener(_listener),
+    journal(-1),
+    entries(0) {}
+
+
+IpamProcess::~IpamProcess()
+{
+  os::close(listener);
+
+  if (journal >= 0) {
+    os::close(journal);
+  }
+}
+
+
+string IpamProcess::socket() const
+{
+  return path::join(directory, IPAM_SOCKET);
+}
+
+
+void IpamProcess::initialize()
+{
+  accept();
+
+  delay(IPAM_GC_INTERVAL, self(), &IpamProcess::_gc);
+}
+
+
+void IpamProcess::finalize()
+{
+  polling.discard();
+
+  os::rm(socket());
+}
+
+
+Future<Nothing> IpamProcess::configure(
+    const string& name,
+    const vector<IPNetwork>& subnets)
+{
+  vector<Pool> pools;
+
+  foreach (const IPNetwork& subnet, subnets) {
+    if (subnet.prefix() < 8 || subnet.prefix() > 30) {
+      return Failure(
+          "Unable to lease addresses from subnet " + stringify(subnet));
+    }
+
+    Pool pool;
+    pool.prefix = subnet.prefix();
+    pool.size = 1u << (32 - pool.prefix);
+    pool.first = ntohl(subnet.address().in().get().s_addr) & ~(pool.size - 1);
+    pool.used.assign((pool.size + 63) / 64, 0);
+
+    if (pool.size % 64 != 0) {
+      pool.used.back() = ~(uint64_t) 0 << (pool.size % 64);
+    }
+
+    // The network, the gateway and the broadcast address.
+    pool.used[0] |= 3;
+    pool.used[(pool.size - 1) / 64] |= (uint64_t) 1 << ((pool.size - 1) % 64);
+
+    pools.push_back(pool);
+  }
+
+  Network& network = networks[name];
+  network.pools = pools;
+
+  if (network.pool >= pools.size()) {
+    network.pool = 0;
+    network.offset = 0;
+  }
+
+  foreachvalue (const IpamLease& lease, network.leases) {
+    if (!mark(&network, lease.ip(), true)) {
+      LOG(WARNING) << "Address " << IP(lease.ip()) << " leased to container "
+                   << lease.container_id() << " is not in any subnet of "
+                   << "network '" << name << "'";
+    }
+  }
+
+  return Nothing();
+}
+
+
+size_t IpamProcess::leases(const string& name)
+{
+  if (!networks.contains(name)) {
+    return 0;
+  }
+
+  return networks.at(name).leases.size();
+}
+
+
+Try<vector<TrafficInfo>> IpamProcess::traffic(const string& name)
+{
+  vector<TrafficInfo> traffic;
+
+  if (!networks.contains(name) || networks.at(name).leases.empty()) {
+    return traffic;
+  }
+
+  Try<int> fd = netlink::socket();
+  if (fd.isError()) {
+    return Error(fd.error());
+  }
+
+  Try<hashmap<string, int>> links = netlink::links(fd.get());
+  if (links.isError()) {
+    os::close(fd.get());
+    return Error(links.error());
+  }
+
+  foreachvalue (const IpamLease& lease, networks.at(name).leases) {
+    if (!lease.has_ifname()) {
+      continue;
+    }
+
+    const string veth = cni::vethName(lease.container_id(), lease.ifname());
+    if (!links->contains(veth)) {
+      continue;
+    }
+
+    Try<hashmap<uint32_t, netlink::Statistics>> statistics =
+      netlink::statistics(fd.get(), links->at(veth), false);
+
+    if (statistics.isError()) {
+      os::close(fd.get());
+      return Error(statistics.error());
+    }
+
+    // Only the containers with a limit have a TBF qdisc.
+    foreachvalue (const netlink::Statistics& qdisc, statistics.get()) {
+      if (qdisc.kind != "tbf") {
+        continue;
+      }
+
+      TrafficInfo info;
+      info.set_direction(TrafficInfo::INGRESS);
+      info.set_device(veth);
+      info.set_container_id(lease.container_id());
+      info.set_bytes(qdisc.bytes);
+      info.set_packets(qdisc.packets);
+      info.set_drops(qdisc.drops);
+      info.set_overlimits(qdisc.overlimits);
+
+      traffic.push_back(info);
+    }
+  }
+
+  os::close(fd.get());
+
+  return traffic;
+}
+
+
+size_t IpamProcess::gc()
+{
+  size_t released = 0;
+
+  foreachpair (const string& name, Network& network, networks) {
+    vector<string> keys;
+
+    foreachpair (const string& key, const IpamLease& lease, network.leases) {
+      if (lease.has_netns() && !os::exists(lease.netns())) {
+        keys.push_back(key);
+      }
+    }
+
+    foreach (const string& key, keys) {
+      LOG(INFO) << "Releasing address "
+                << IP(network.leases.at(key).ip()) << " of network '"
+                << name << "' leased to container " << key
+                << " since its network namespace is gone";
+
+      release(&network, key);
+      released++;
+    }
+  }
+
+  return released;
+}
+
+
+IpamResponse IpamProcess::handle(const IpamRequest& request)
+{
+  IpamResponse response;
+
+  const string key = leaseKey(request.container_id(), request.ifname());
+
+  // Releasing an address that is not leased is not an error, the CNI
+  // plugins can be asked to tear down a container more than once.
+  if (request.command() == IpamRequest::DEL) {
+    if (networks.contains(request.network())) {
+      release(&networks.at(request.network()), key);
+    }
+
+    return response;
+  }
+
+  if (!networks.contains(request.network()) ||
+      networks.at(request.network()).pools.empty()) {
+    response.set_error("Unknown network '" + request.network() + "'");
+    return response;
+  }
+
+  Network& network = networks.at(request.network());
+
+  if (!network.leases.contains(key)) {
+    Option<uint32_t> ip = allocate(&network);
+    if (ip.isNone()) {
+      response.set_error(
+          "No addresses left on network '" + request.network() + "'");
+      return response;
+    }
+
+    IpamLease lease;
+    lease.set_network(request.network());
+    lease.set_ip(ip.get());
+    lease.set_container_id(request.container_id());
+
+    if (request.has_ifname()) {
+      lease.set_ifname(request.ifname());
+    }
+
+    if (request.has_netns()) {
+      lease.set_netns(request.netns());
+    }
+
+    network.leases[key] = lease;
+
+    Try<Nothing> _append = append(lease);
+    if (_append.isError()) {
+      network.leases.erase(key);
+      mark(&network, ip.get(), false);
+
+      response.set_error("Failed to checkpoint the lease: " + _append.error());
+      return response;
+    }
+  }
+
+  const uint32_t ip = network.leases.at(key).ip();
+
+  foreach (const Pool& pool, network.pools) {
+    if (ip >= pool.first && ip - pool.first < pool.size) {
+      response.set_ip(stringify(IP(ip)) + "/" + stringify((int) pool.prefix));
+      response.set_gateway(stringify(IP(pool.first + 1)));
+
+      return response;
+    }
+  }
+
+  response.set_error(
+      "Address " + stringify(IP(ip)) + " leased to container " + key +
+      " is not in any subnet of network '" + request.network() + "'");
+
+  return response;
+}
+
+
+Try<Nothing> IpamProcess::recover()
+{
+  const string path = path::join(directory, IPAM_JOURNAL);
+
+  if (os::exists(path)) {
+    Try<int> fd = os::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd.isError()) {
+      return Error("Failed to open '" + path + "': " + fd.error());
+    }
+
+    while (true) {
+      // A lease that was only partially written when the Agent went
+      // away is ignored.
+      Result<IpamLease> lease =
+        ::protobuf::read<IpamLease>(fd.get(), true, true);
+
+      if (lease.isError()) {
+        os::close(fd.get());
+        return Error("Failed to read '" + path + "': " + lease.error());
+      }
+
+      if (lease.isNone()) {
+        break;
+      }
+
+      Network& network = networks[lease->network()];
+      const string key = leaseKey(lease->container_id(), lease->ifname());
+
+      if (lease->released()) {
+        network.leases.erase(key);
+      } else {
+        network.leases[key] = lease.get();
+      }
+    }
+
+    os::close(fd.get());
+  }
+
+  return checkpoint();
+}
+
+
+Try<Nothing> IpamProcess::checkpoint()
+{
+  const string path = path::join(directory, IPAM_JOURNAL);
+  const string temporary = path + ".tmp";
+
+  Try<int> fd = os::open(
+      temporary,
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      S_IRUSR | S_IWUSR);
+
+  if (fd.isError()) {
+    return Error("Failed to open '" + temporary + "': " + fd.error());
+  }
+
+  size_t count = 0;
+  foreachvalue (const Network& network, networks) {
+    foreachvalue (const IpamLease& lease, network.leases) {
+      Try<Nothing> write = ::protobuf::write(fd.get(), lease);
+      if (write.isError()) {
+        os::close(fd.get());
+        return Error("Failed to write '" + temporary + "': " + write.error());
+      }
+
+      count++;
+    }
+  }
+
+  Try<Nothing> fsync = os::fsync(fd.get());
+  os::close(fd.get());
+
+  if (fsync.isError()) {
+    return Error("Failed to sync '" + temporary + "': " + fsync.error());
+  }
+
+  Try<Nothing> rename = os::rename(temporary, path);
+  if (rename.isError()) {
+    return Error("Failed to rename '" + temporary + "': " + rename.error());
+  }
+
+  if (journal >= 0) {
+    os::close(journal);
+    journal = -1;
+  }
+
+  Try<int> _journal = os::open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (_journal.isError()) {
+    return Error("Failed to open '" + path + "': " + _journal.error());
+  }
+
+  journal = _journal.get();
+  entries = count;
+
+  return Nothing();
+}
+
+
+Try<Nothing> IpamProcess::append(const IpamLease& lease)
+{
+  if (journal < 0) {
+    return Error("The lease journal is not open");
+  }
+
+  // NOTE: The journal is not synced, it only needs to survive a
+  // restart of the Agent. The leases are of no use once the host
+  // reboots, as the containers holding them are gone.
+  Try<Nothing> write = ::protobuf::write(journal, lease);
+  if (write.isError()) {
+    return write;
+  }
+
+  entries++;
+
+  if (entries < IPAM_JOURNAL_ENTRIES) {
+    return Nothing();
+  }
+
+  size_t count = 0;
+  foreachvalue (const Network& network, networks) {
+    count += network.leases.size();
+  }
+
+  if (entries < 2 * count) {
+    return Nothing();
+  }
+
+  return checkpoint();
+}
+
+
+void IpamProcess::release(Network* network, const string& key)
+{
+  if (!network->leases.contains(key)) {
+    return;
+  }
+
+  IpamLease lease = network->leases.at(key);
+  network->leases.erase(key);
+
+  mark(network, lease.ip(), false);
+
+  lease.set_released(true);
+
+  Try<Nothing> _append = append(lease);
+  if (_append.isError()) {
+    LOG(WARNING) << "Failed to checkpoint the release of address "
+                 << IP(lease.ip()) << " of network '" << lease.network()
+                 << "': " << _append.error();
+  }
+}
+
+
+bool IpamProcess::mark(Network* network, uint32_t ip, bool used)
+{
+  foreach (Pool& pool, network->pools) {
+    if (ip < pool.first || ip - pool.first >= pool.size) {
+      continue;
+    }
+
+    const size_t bit = ip - pool.first;
+
+    if (used) {
+      pool.used[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    } else {
+      pool.used[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+
+Option<uint32_t> IpamProcess::allocate(Network* network)
+{
+  const size_t count = network->pools.size();
+  if (count == 0) {
+    return None();
+  }
+
+  // The pool the lookup starts at is visited once more at the end,
+  // for the addresses before `offset`.
+  for (size_t i = 0; i <= count; i++) {
+    const size_t index = (network->pool + i) % count;
+    Pool& pool = network->pools[index];
+
+    const size_t start = (i == 0) ? network->offset : 0;
+
+    for (size_t word = start / 64; word < pool.used.size(); word++) {
+      uint64_t free = ~pool.used[word];
+
+      if (word == start / 64) {
+        free &= ~(uint64_t) 0 << (start % 64);
+      }
+
+      if (free == 0) {
+        continue;
+      }
+
+      const size_t bit = word * 64 + __builtin_ctzll(free);
+
+      pool.used[word] |= (uint64_t) 1 << (bit % 64);
+
+      network->pool = index;
+      network->offset = bit + 1;
+
+      return pool.first + bit;
+    }
+  }
+
+  return None();
+}
+
+
+void IpamProcess::accept()
+{
+  polling = io::poll(listener, io::READ);
+  polling.onAny(defer(self(), &IpamProcess::_accept, lambda::_1));
+}
+
+
+void IpamProcess::_accept(const Future<short>& ready)
+{
+  if (!ready.isReady()) {
+    if (ready.isFailed()) {
+      LOG(ERROR) << "Failed to wait for IPAM requests: " << ready.failure();
+    }
+
+    return;
+  }
+
+  while (true) {
+    int fd = ::accept4(
+        listener,
+        nullptr,
+        nullptr,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(ERROR) << "Failed to accept IPAM request";
+      }
+
+      break;
+    }
+
+    io::read(fd)
+      .onAny(defer(self(), &IpamProcess::serve, fd, lambda::_1));
+  }
+
+  accept();
+}
+
+
+void IpamProcess::serve(int fd, const Future<string>& data)
+{
+  IpamResponse response;
+
+  if (!data.isReady()) {
+    response.set_error(
+        "Failed to read the request: " +
+        (data.isFailed() ? data.failure() : "discarded"));
+  } else {
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(data.get());
+    if (json.isError()) {
+      response.set_error("Failed to parse the request: " + json.error());
+    } else {
+      Try<IpamRequest> request = ::protobuf::parse<IpamRequest>(json.get());
+      if (request.isError()) {
+        response.set_error("Failed to parse the request: " + request.error());
+      } else {
+        response = handle(request.get());
+      }
+    }
+  }
+
+  io::write(fd, stringify(JSON::protobuf(response)))
+    .onAny([fd](const Future<Nothing>&) {
+      os::close(fd);
+    });
+}
+
+
+void IpamProcess::_gc()
+{
+  gc();
+
+  delay(IPAM_GC_INTERVAL, self(), &IpamProcess::_gc);
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
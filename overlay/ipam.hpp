@@ -0,0 +1,157 @@
+#ifndef __OVERLAY_IPAM_HPP__
+#define __OVERLAY_IPAM_HPP__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
+
+#include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+// ONLY USEFUL AFTER RUNNING PROTOC.
+#include "overlay/messages.pb.h"
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// Type of the CNI IPAM plugin that forwards the requests of the CNI
+// bridge plugin to the `IpamProcess`.
+constexpr char IPAM_PLUGIN[] = "mesos-overlay-ipam";
+
+// Names of the unix socket and of the lease journal of the
+// `IpamProcess`, within its directory.
+constexpr char IPAM_SOCKET[] = "ipam.sock";
+constexpr char IPAM_JOURNAL[] = "leases";
+
+
+// Sends a request to the IPAM service listening on `socket`, and
+// waits for its reply.
+Try<internal::IpamResponse> ipam(
+    const std::string& socket,
+    const internal::IpamRequest& request);
+
+
+// IPAM service of the Agent. It leases the addresses of the subnets
+// of the Mesos networks to the containers, keeping a bitmap of the
+// addresses of each subnet, and serves the `mesos-overlay-ipam` CNI
+// plugin over a unix socket. The leases are appended to a journal, so
+// that they survive a restart of the Agent, and the leases of the
+// containers whose network namespace is gone are released
+// periodically.
+class IpamProcess : public process::Process<IpamProcess>
+{
+public:
+  // Recovers the leases from the journal in `directory`, and listens
+  // on a socket in it.
+  static Try<process::Owned<IpamProcess>> create(
+      const std::string& directory);
+
+  virtual ~IpamProcess();
+
+  // Path of the socket the service listens on.
+  std::string socket() const;
+
+  // Sets the subnets the addresses of a Mesos network are leased
+  // from. The network, the gateway and the broadcast address of each
+  // subnet are never leased.
+  process::Future<Nothing> configure(
+      const std::string& network,
+      const std::vector<net::IPNetwork>& subnets);
+
+  // Returns the number of addresses leased on a Mesos network.
+  size_t leases(const std::string& network);
+
+  // Returns the counters of the TBF qdiscs limiting the ingress of the
+  // containers of a Mesos network, on the host end of their veth pairs.
+  Try<std::vector<TrafficInfo>> traffic(const std::string& network);
+
+  // Releases the leases of the containers whose network namespace is
+  // gone, and returns how many have been released.
+  size_t gc();
+
+  internal::IpamResponse handle(const internal::IpamRequest& request);
+
+protected:
+  virtual void initialize();
+  virtual void finalize();
+
+private:
+  // The addresses of a subnet, one bit per address. The bits past the
+  // end of the subnet are set, so that they are never leased.
+  struct Pool
+  {
+    // First address of the subnet in host byte order.
+    uint32_t first;
+    uint32_t size;
+    uint8_t prefix;
+
+    std::vector<uint64_t> used;
+  };
+
+  struct Network
+  {
+    Network() : pool(0), offset(0) {}
+
+    std::vector<Pool> pools;
+
+    // Position the next lookup for a free address starts at. Leases
+    // are handed out round-robin, so that an address is not leased
+    // again right after it has been released.
+    size_t pool;
+    size_t offset;
+
+    // Leases by container ID and interface.
+    hashmap<std::string, internal::IpamLease> leases;
+  };
+
+  IpamProcess(const std::string& directory, int listener);
+
+  Try<Nothing> recover();
+
+  // Rewrites the journal with the current leases only.
+  Try<Nothing> checkpoint();
+
+  Try<Nothing> append(const internal::IpamLease& lease);
+
+  void release(Network* network, const std::string& key);
+
+  // Returns whether `ip` is in a subnet of the network.
+  static bool mark(Network* network, uint32_t ip, bool used);
+
+  static Option<uint32_t> allocate(Network* network);
+
+  void accept();
+  void _accept(const process::Future<short>& ready);
+  void serve(int fd, const process::Future<std::string>& data);
+  void _gc();
+
+  const std::string directory;
+
+  const int listener;
+  process::Future<short> polling;
+
+  int journal;
+
+  // Number of entries in the journal, including the released leases.
+  size_t entries;
+
+  hashmap<std::string, Network> networks;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_IPAM_HPP__
@@ -0,0 +1,122 @@
+// CNI IPAM plugin of the overlay Mesos networks. It forwards the
+// requests of the CNI bridge plugin to the IPAM service of the overlay
+// Agent module, listening on the unix socket set as `ipam.socket` in
+// the network configuration.
+
+#include <iostream>
+#include <string>
+
+#include <stout/json.hpp>
+#include <stout/option.hpp>
+#include <stout/os.hpp>
+#include <stout/result.hpp>
+#include <stout/try.hpp>
+
+#include "cni.hpp"
+#include "ipam.hpp"
+
+
+using std::cout;
+using std::endl;
+using std::string;
+
+using mesos::modules::overlay::agent::ipam;
+using mesos::modules::overlay::internal::IpamRequest;
+using mesos::modules::overlay::internal::IpamResponse;
+
+namespace cni = mesos::modules::overlay::cni;
+
+
+int main(int argc, char** argv)
+{
+  Option<string> command = os::getenv("CNI_COMMAND");
+
+  if (command == "VERSION") {
+    cout << cni::VERSIONS << endl;
+
+    return EXIT_SUCCESS;
+  }
+
+  string version = cni::DEFAULT_VERSION;
+
+  Try<string> input = cni::readStdin();
+  if (input.isError()) {
+    return cni::fail(
+        version,
+        cni::ERROR_DECODE_FAILURE,
+        "Failed to read the network configuration: " + input.error());
+  }
+
+  Try<JSON::Object> config = JSON::parse<JSON::Object>(input.get());
+  if (config.isError()) {
+    return cni::fail(
+        version,
+        cni::ERROR_DECODE_FAILURE,
+        "Failed to parse the network configuration: " + config.error());
+  }
+
+  Result<JSON::String> _version = config->find<JSON::String>("cniVersion");
+  if (_version.isSome()) {
+    version = _version->value;
+  }
+
+  Result<JSON::String> name = config->find<JSON::String>("name");
+  Result<JSON::String> socket = config->find<JSON::String>("ipam.socket");
+
+  if (!name.isSome() || !socket.isSome()) {
+    return cni::fail(
+        version,
+        cni::ERROR_INVALID_CONFIG,
+        "The network configuration needs a `name` and an `ipam.socket`");
+  }
+
+  Option<string> containerId = os::getenv("CNI_CONTAINERID");
+  if (containerId.isNone() || (command != "ADD" && command != "DEL")) {
+    return cni::fail(
+        version,
+        cni::ERROR_INVALID_ENVIRONMENT,
+        "Needs `CNI_CONTAINERID` and a `CNI_COMMAND` of ADD or DEL");
+  }
+
+  IpamRequest request;
+  request.set_command(command == "ADD" ? IpamRequest::ADD : IpamRequest::DEL);
+  request.set_network(name->value);
+  request.set_container_id(containerId.get());
+
+  Option<string> ifname = os::getenv("CNI_IFNAME");
+  if (ifname.isSome()) {
+    request.set_ifname(ifname.get());
+  }
+
+  Option<string> netns = os::getenv("CNI_NETNS");
+  if (netns.isSome()) {
+    request.set_netns(netns.get());
+  }
+
+  Try<IpamResponse> response = ipam(socket->value, request);
+  if (response.isError()) {
+    return cni::fail(version, cni::ERROR_IPAM, response.error());
+  }
+
+  if (response->has_error()) {
+    return cni::fail(version, cni::ERROR_IPAM, response->error());
+  }
+
+  if (request.command() == IpamRequest::DEL) {
+    return EXIT_SUCCESS;
+  }
+
+  JSON::Array routes;
+  Result<JSON::Array> _routes = config->find<JSON::Array>("ipam.routes");
+  if (_routes.isSome()) {
+    routes = _routes.get();
+  }
+
+  cout << stringify(cni::result(
+      version,
+      response->ip(),
+      response->gateway(),
+      routes)) << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -1,8 +1,10 @@
 #include <stdio.h>
 
+#include <algorithm>
 #include <list>
 
 #include <stout/check.hpp>
+#include <stout/duration.hpp>
 #include <stout/interval.hpp>
 #include <stout/ip.hpp>
 #include <stout/json.hpp>
@@ -23,16 +25,25 @@
 #include <process/protobuf.hpp>
 #include <process/subprocess.hpp>
 
+#include <process/metrics/counter.hpp>
+#include <process/metrics/gauge.hpp>
+#include <process/metrics/metrics.hpp>
+#include <process/metrics/timer.hpp>
+
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 #include <mesos/module/anonymous.hpp>
+#include <mesos/log/log.hpp>
 #include <mesos/state/log.hpp>
 #include <mesos/state/protobuf.hpp>
 #include <mesos/state/storage.hpp>
 #include <mesos/zookeeper/detector.hpp>
 
+#include "compact.hpp"
 #include "messages.hpp"
 #include "overlay.hpp"
+#include "table.hpp"
+#include "topology.hpp"
 
 namespace http = process::http;
 
@@ -52,25 +63,32 @@ using process::HELP;
 using process::Owned;
 using process::Failure;
 using process::Future;
+using process::Promise;
 using process::TLDR;
 using process::UPID;
 using process::USAGE;
 
+using process::metrics::Counter;
+using process::metrics::Gauge;
+using process::metrics::Timer;
+
 using mesos::log::Log;
 using mesos::modules::Anonymous;
 using mesos::modules::Module;
 using mesos::modules::overlay::AgentOverlayInfo;
-using mesos::modules::overlay::BackendInfo;
+using mesos::modules::overlay::CompactState;
+using mesos::modules::overlay::LookupInfo;
 using mesos::modules::overlay::NetworkConfig;
-using mesos::modules::overlay::VxLANInfo;
 using mesos::modules::overlay::State;
 using mesos::modules::overlay::MESOS_ZK;
 using mesos::modules::overlay::MESOS_QUORUM;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::LogStorageOperation;
 using mesos::modules::overlay::internal::MasterConfig;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RequestSubnetMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 using mesos::Parameters;
 using mesos::state::LogStorage;
@@ -83,17 +101,48 @@ namespace overlay {
 namespace master {
 
 constexpr char REPLICATED_LOG_STORE[] = "overlay_replicated_log";
-constexpr char REPLICATED_LOG_STORE_KEY[] = "network-state";
+constexpr char REPLICATED_LOG_STORE_KEY[] = "network-state-v2";
 constexpr char REPLICATED_LOG_STORE_REPLICAS[] = "overlay_log_replicas";
 
+// Key under which the network state was stored, as a `State`, before
+// the `CompactState` encoding was introduced. It is only read to
+// migrate the network state and expunged after the first store.
+constexpr char LEGACY_REPLICATED_LOG_STORE_KEY[] = "network-state";
+
 constexpr Duration PENDING_MESSAGE_PERIOD = Seconds(10);
 
+// Bounds of the exponential backoff used to retransmit an
+// `UpdateAgentOverlaysMessage` until the Agent acknowledges it.
+constexpr Duration UPDATE_RETRY_INTERVAL_MIN = Seconds(2);
+constexpr Duration UPDATE_RETRY_INTERVAL_MAX = Seconds(30);
+
+// Interval at which a master in standby mode tails the replicated log.
+constexpr Duration STANDBY_TAIL_INTERVAL = Seconds(1);
+
+// Maximum number of secondary subnets of an overlay an Agent can hold.
+constexpr size_t MAX_SECONDARY_SUBNETS = 8;
+
+// The backend shared by all the overlays. The VNI is the same for both
+// encapsulations, the VTEP devices differ.
+constexpr uint32_t VXLAN_VNI = 1024;
+constexpr char VXLAN_VTEP_NAME[] = "vtep1024";
+constexpr char GENEVE_VTEP_NAME[] = "gnv1024";
+
 const string OVERLAY_HELP = HELP(
     TLDR("Allocate overlay network resources for Master."),
     USAGE("/overlay-master/overlays"),
     DESCRIPTION("Allocate subnets, VTEP IP and the MAC addresses.", "")
 );
 
+const string LOOKUP_HELP = HELP(
+    TLDR("Find the Agent an overlay IP has been allocated to."),
+    USAGE("/overlay-master/lookup?ip=<ip>"),
+    DESCRIPTION(
+        "Returns the Agent, and the overlay subnet or the VTEP IP of the",
+        "Agent, that hold the IP.",
+        "")
+);
+
 
 struct Vtep
 {
@@ -182,6 +231,25 @@ struct Vtep
     freeIP += (Bound<uint32_t>::closed(1), Bound<uint32_t>::closed(endIP - 1));
   }
 
+  // Returns the number of VTEP IPs that can still be allocated.
+  size_t freeCount() const
+  {
+    size_t count = 0;
+
+    foreach (const Interval<uint32_t>& interval, freeIP) {
+      count += interval.upper() - interval.lower();
+    }
+
+    return count;
+  }
+
+  // Returns the number of VTEP IPs in the pool, excluding the
+  // network and the broadcast address.
+  size_t totalCount() const
+  {
+    return (0xffffffff >> network.prefix()) - 1;
+  }
+
   // Network allocated to the VTEP.
   IPNetwork network;
 
@@ -194,212 +262,175 @@ struct Vtep
 struct Overlay
 {
   Overlay(
-      const string& _name,
-      const net::IPNetwork& _network,
-      const uint8_t _prefix)
-    : name(_name),
+      const OverlayInfo& _info,
+      const net::IPNetwork& _network)
+    : info(_info),
+    name(_info.name()),
     network(_network),
-    prefix(_prefix)
-  {
-    // `network` has already been vetted to be an AF_INET address.
-    uint32_t endSubnet = 0xffffffff; // 255.255.255.255
-    endSubnet = endSubnet >> (network.prefix() + 32 - prefix);
+    prefix(_info.prefix()),
+    minPrefix(_info.has_min_prefix() ? _info.min_prefix() : _info.prefix()),
+    maxPrefix(_info.has_max_prefix() ? _info.max_prefix() : _info.prefix()),
+    freeNetworks(
+        (uint32_t) 1 << (minPrefix - network.prefix()),
+        maxPrefix - minPrefix,
+        _info.has_topology_prefix()
+          ? Option<uint8_t>(maxPrefix - _info.topology_prefix())
+          : None()) {}
 
-    freeNetworks +=
-      (Bound<uint32_t>::closed(0),
-       Bound<uint32_t>::closed(endSubnet));
+  OverlayInfo getOverlayInfo() const
+  {
+    return info;
   }
 
-  OverlayInfo getOverlayInfo() const
+  // Returns the prefix of the smallest Agent subnet that holds
+  // `capacity` container addresses, within the prefixes allowed by the
+  // overlay. The Mesos bridge only gets half of the subnet, less its
+  // network, broadcast and gateway addresses.
+  uint8_t getAgentPrefix(const Option<uint32_t>& capacity) const
   {
-    OverlayInfo overlay;
+    if (capacity.isNone()) {
+      return prefix;
+    }
 
-    overlay.set_name(name);
-    overlay.set_subnet(stringify(network));
-    overlay.set_prefix(prefix);
+    const uint64_t addresses = 2 * ((uint64_t) capacity.get() + 3);
 
-    return overlay;
+    uint8_t _prefix = 32;
+    while (_prefix > minPrefix &&
+           ((uint64_t) 1 << (32 - _prefix)) < addresses) {
+      _prefix--;
+    }
+
+    return std::min(_prefix, maxPrefix);
   }
 
-  Try<net::IPNetwork> allocate()
+  // Allocates a subnet from the blocks reserved for `topology`, if
+  // the overlay has a `topology_prefix`.
+  Try<net::IPNetwork> allocate(
+      uint8_t _prefix,
+      const Option<string>& topology)
   {
-    if (freeNetworks.empty()) {
-      return Error("No free subnets available in the " + name + "overlay");
+    if (_prefix < minPrefix || _prefix > maxPrefix) {
+      return Error(
+          "Prefix " + stringify((uint32_t) _prefix) + " is not allowed in"
+          " the " + name + " overlay");
     }
 
-    uint32_t subnet = freeNetworks.begin()->lower();
-    freeNetworks -= subnet;
+    Try<uint32_t> subnet =
+      freeNetworks.allocate(maxPrefix - _prefix, topology);
+
+    if (subnet.isError()) {
+      return Error(
+          "No free subnets available in the " + name + " overlay: " +
+          subnet.error());
+    }
 
     uint32_t agentSubnet = ntohl(network.address().in().get().s_addr);
 
     // Get the suffix of the Agent subnet.
-    subnet = subnet << (32 - prefix);
-    agentSubnet |= subnet;
+    agentSubnet |= subnet.get() << (32 - maxPrefix);
 
-    return net::IPNetwork::create(net::IP(agentSubnet), prefix);
+    return net::IPNetwork::create(net::IP(agentSubnet), _prefix);
   }
 
   Try<Nothing> free(const net::IPNetwork& subnet)
   {
-    if (subnet.prefix() != prefix) {
-      return Error(
-          "Cannot free this network because prefix " + stringify(subnet.prefix()) +
-          " does not match Agent prefix " + stringify(prefix) + " of the overlay");
+    Try<uint32_t> _subnet = index(subnet);
+    if (_subnet.isError()) {
+      return Error("Cannot free this network: " + _subnet.error());
     }
 
-    if (subnet.prefix() < network.prefix()) {
-      return Error(
-          "Cannot free this network since it does not belong "
-          " to the overlay subnet");
-    }
-
-    uint32_t address = ntohl(subnet.address().in().get().s_addr);
-
-    freeNetworks += address;
-
-    return Nothing();
+    return freeNetworks.free(_subnet.get(), maxPrefix - subnet.prefix());
   }
 
-  Try<Nothing> reserve(const net::IPNetwork& subnet)
+  Try<Nothing> reserve(
+      const net::IPNetwork& subnet,
+      const Option<string>& topology)
   {
-    uint32_t netmask = ntohl(network.netmask().in().get().s_addr);
-    uint32_t _subnet = ntohl(subnet.address().in().get().s_addr);
+    Try<uint32_t> _subnet = index(subnet);
+    if (_subnet.isError()) {
+      return Error(
+          "Unable to reserve subnet " + stringify(subnet) + ": " +
+          _subnet.error());
+    }
 
-    // Retrieve the integer representation of subnet in the
-    // `IntervalSet`.
-    _subnet &= ~netmask;
-    _subnet = _subnet >> (32 - subnet.prefix());
+    Try<Nothing> reserved = freeNetworks.reserve(
+        _subnet.get(),
+        maxPrefix - subnet.prefix(),
+        topology);
 
-    if (!freeNetworks.contains(_subnet)) {
+    if (reserved.isError()) {
       return Error(
           "Unable to reserve unavailable subnet " +
-          stringify(subnet) + "(" + stringify(_subnet) + ")");
+          stringify(subnet) + "(" + stringify(_subnet.get()) + "): " +
+          reserved.error());
     }
 
-    freeNetworks -= _subnet;
-
     return Nothing();
   }
 
   void reset()
   {
-    // Re-initialize `freeNetworks`.
-    freeNetworks = IntervalSet<uint32_t>();
+    freeNetworks.reset();
+  }
 
-    uint32_t endSubnet = 0xffffffff; // 255.255.255.255
-    endSubnet = endSubnet >> (network.prefix() + 32 - prefix);
+  // Returns the number of Agent subnets, of the default `prefix`,
+  // that can still be allocated.
+  size_t freeCount() const
+  {
+    return freeNetworks.availableUnits() >> (maxPrefix - prefix);
+  }
 
-    freeNetworks +=
-      (Bound<uint32_t>::closed(0),
-       Bound<uint32_t>::closed(endSubnet));
+  // Returns the number of Agent subnets, of the default `prefix`, the
+  // overlay can be split into.
+  size_t totalCount() const
+  {
+    return (size_t) 1 << (prefix - network.prefix());
   }
 
+  // The configuration of the overlay.
+  OverlayInfo info;
+
   // Canonical name of the network.
   std::string name;
 
   // Network allocated to this overlay.
   net::IPNetwork network;
 
-  // Prefix length allocated to each agent.
+  // Default prefix length allocated to each agent.
   uint8_t prefix;
 
-  // Free subnets available in this network. The subnets are
-  // calcualted using the prefix length set for the agents in
-  // `prefix`.
-  IntervalSet<uint32_t> freeNetworks;
-};
-
-
-class Agent
-{
-public:
-  static Try<Agent> create(const AgentInfo& agentInfo)
-  {
-    Try<net::IP> _ip = net::IP::parse(agentInfo.ip(), AF_INET);
-
-    if (_ip.isError()) {
-      return Error("Unable to create `Agent`: " + _ip.error());
-    }
-
-    Agent agent(_ip.get());
-
-    for (int i = 0; i < agentInfo.overlays_size(); i++) {
-      agent.addOverlay(agentInfo.overlays(i));
-    }
-
-    // We should clear any overlay `State` that might have been set.
-    // The `State` will be set once this information is downloaded to
-    // the corresponding agent.
-    agent.clearOverlaysState();
-
-    return agent;
-  }
-
-  Agent(const net::IP& _ip) : ip(_ip) {};
-
-  const net::IP getIP() const { return ip; };
-
-  void addOverlay(const AgentOverlayInfo& overlay)
-  {
-    if (overlays.contains(overlay.info().name())) {
-      return;
-    }
-
-    // Create a new overlay on this agent.
-    overlays.emplace(
-        overlay.info().name(),
-        Owned<AgentOverlayInfo>(new AgentOverlayInfo()));
-
-    overlays[overlay.info().name()]->CopyFrom(overlay);
-  }
-
-  list<AgentOverlayInfo> getOverlays() const
-  {
-    list<AgentOverlayInfo> _overlays;
-
-    foreachvalue (const Owned<AgentOverlayInfo>& overlay, overlays) {
-      _overlays.push_back(*overlay);
-    }
+  // Range of prefix lengths that can be allocated to agents.
+  uint8_t minPrefix;
+  uint8_t maxPrefix;
 
-    return _overlays;
-  }
+  // Free subnets available in this network, indexed in units of
+  // `maxPrefix` subnets.
+  TopologyAllocator freeNetworks;
 
-  void clearOverlaysState()
+private:
+  // Returns the index of `subnet` in units of `maxPrefix` subnets.
+  Try<uint32_t> index(const net::IPNetwork& subnet) const
   {
-    foreachvalue (Owned<AgentOverlayInfo>& overlay, overlays) {
-      overlay->clear_state();
+    if (subnet.prefix() < minPrefix || subnet.prefix() > maxPrefix) {
+      return Error(
+          "Prefix " + stringify(subnet.prefix()) + " is not allowed in"
+          " the " + name + " overlay");
     }
-  }
-
-  AgentInfo getAgentInfo() const
-  {
-    AgentInfo info;
 
-    info.set_ip(stringify(ip));
+    uint32_t netmask = ntohl(network.netmask().in().get().s_addr);
+    uint32_t address = ntohl(network.address().in().get().s_addr);
+    uint32_t _subnet = ntohl(subnet.address().in().get().s_addr);
 
-    foreachvalue(const Owned<AgentOverlayInfo>& overlay, overlays) {
-      info.add_overlays()->CopyFrom(*overlay);
+    if ((_subnet & netmask) != address) {
+      return Error("Subnet does not belong to the overlay subnet");
     }
 
-    return info;
-  }
-
-  void updateOverlayState(const AgentOverlayInfo& overlay)
-  {
-    const string name = overlay.info().name();
-    if (!overlays.contains(name)) {
-      LOG(ERROR) << "Got update for unknown network "
-                 << overlay.info().name() ;
-    }
+    // Retrieve the integer representation of subnet in the
+    // `BuddyAllocator`.
+    _subnet &= ~netmask;
 
-    overlays.at(name)->mutable_state()->set_status(overlay.state().status());
+    return _subnet >> (32 - maxPrefix);
   }
-
-private:
-  net::IP ip;
-
-  // A list of all overlay networks that reside on this agent.
-  hashmap<string, Owned<AgentOverlayInfo>> overlays;
 };
 
 
@@ -431,23 +462,21 @@ static Try<net::MAC> createMAC(const string& _mac, const bool& oui)
 }
 
 
-// Defines an operation that can be performed on a `State` object for
-// a given `AgentInfo`. Every operation returns a `Future<bool>` that
-// will be set once the operation is actually performed on the `State`
-// object. The operation is usually considered "performed" when the
-// mutated `State` is checkpointed to some storage (usually a
-// replicated log).
+// Defines an operation that changes the network state that needs to
+// be checkpointed for a given Agent. Every operation returns a
+// `Future<bool>` that will be set once the operation is actually
+// performed. The operation is usually considered "performed" when the
+// `AgentTable` holding the change is checkpointed to some storage
+// (usually a replicated log).
 class Operation : public process::Promise<bool> {
 public:
   Operation() : success(false) {}
 
   virtual ~Operation() {}
 
-  Try<bool> operator()(
-      State* networkState,
-      hashmap<net::IP, Agent>* agents)
+  Try<bool> operator()(const AgentTable& agents)
   {
-    const Try<bool> result = perform(networkState, agents);
+    const Try<bool> result = perform(agents);
 
     success = !result.isError();
 
@@ -456,53 +485,105 @@ public:
 
   virtual const string description() const = 0;
 
+  // Adds the changes of the operation that are not in the
+  // `AgentTable` yet to the network state being written.
+  virtual void stage(const AgentTable& agents, CompactState* state) const {}
+
+  // Applies the staged changes to the `AgentTable` once they have been
+  // stored.
+  virtual void commit(AgentTable* agents) const {}
+
   // Sets the promise based on whether the operation was successful.
   bool set() { return process::Promise<bool>::set(success); }
 
 protected:
-  virtual Try<bool> perform(
-      State* networkState,
-      hashmap<net::IP, Agent>* agents) = 0;
+  virtual Try<bool> perform(const AgentTable& agents) = 0;
 
 private:
   bool success;
 };
 
 
-// Add an `AgentInfo` to a `State` object.
+// Add an Agent to the network state. The Agent is added to the
+// `AgentTable` before the operation is performed.
 class AddAgent : public Operation {
 public:
-  explicit AddAgent(const AgentInfo& _agentInfo)
-  {
-    agentInfo.CopyFrom(_agentInfo);
-  }
+  explicit AddAgent(const net::IP& _ip) : ip(_ip) {}
 
   const std::string description() const
   {
-    return "Add operation for agent: " + agentInfo.ip();
+    return "Add operation for agent: " + stringify(ip);
   }
 
 protected:
-  Try<bool> perform(State* networkState, hashmap<net::IP, Agent>* agents)
+  Try<bool> perform(const AgentTable& agents)
   {
     // Make sure the Agent we are going to add is already present in `agents`.
-    Try<net::IP> ip = net::IP::parse(agentInfo.ip(), AF_INET);
-    if (ip.isError()) {
-      return Error("Unable to parse the Agent IP: " + ip.error());
+    if (agents.find(ip) == nullptr) {
+      return Error(
+          "Could not find the Agent (" + stringify(ip) +
+          ") that needed to be added to `State`.");
+    }
+
+    return true;
+  }
+
+private:
+  net::IP ip;
+};
+
+
+// Update an Agent already in the network state. The Agent is updated
+// in the `AgentTable` before the operation is performed, except for
+// an overlay added to the Agent, e.g. a secondary subnet, that is only
+// added to the `AgentTable` once it has been stored.
+class UpdateAgent : public Operation {
+public:
+  explicit UpdateAgent(
+      const net::IP& _ip,
+      const Option<AgentOverlay>& _overlay = None())
+    : ip(_ip), overlay(_overlay) {}
+
+  const std::string description() const
+  {
+    return "Update operation for agent: " + stringify(ip);
+  }
+
+  void stage(const AgentTable& agents, CompactState* state) const
+  {
+    Option<size_t> position = agents.position(ip);
+
+    if (overlay.isSome() && position.isSome()) {
+      agents.compact(
+          overlay.get(),
+          state->mutable_agents(position.get())->add_overlays());
+    }
+  }
+
+  void commit(AgentTable* agents) const
+  {
+    AgentRecord* agent = agents->find(ip);
+
+    if (overlay.isSome() && agent != nullptr) {
+      agents->addOverlay(agent, overlay.get());
     }
+  }
 
-    if (!agents->contains(ip.get())) {
+protected:
+  Try<bool> perform(const AgentTable& agents)
+  {
+    if (agents.find(ip) == nullptr) {
       return Error(
-          "Could not find the Agent (" + stringify(ip.get()) +
-          ") that needed to be added to `State`.");
+          "Could not find the Agent (" + stringify(ip) +
+          ") that needed to be updated in `State`.");
     }
 
-    networkState->add_agents()->CopyFrom(agentInfo);
     return true;
   }
 
 private:
-  AgentInfo agentInfo;
+  net::IP ip;
+  Option<AgentOverlay> overlay;
 };
 
 
@@ -622,12 +703,46 @@ public:
             overlay.name() + "': " + valid.error());
       }
 
+      // Agents can ask for subnets with prefixes between `min_prefix`
+      // and `max_prefix`, the allocator needs both of them to be
+      // within the overlay subnet.
+      const uint32_t minPrefix =
+        overlay.has_min_prefix() ? overlay.min_prefix() : overlay.prefix();
+      const uint32_t maxPrefix =
+        overlay.has_max_prefix() ? overlay.max_prefix() : overlay.prefix();
+
+      if ((int) minPrefix < address->prefix() ||
+          minPrefix > overlay.prefix() ||
+          overlay.prefix() > maxPrefix ||
+          maxPrefix > 32) {
+        return Error(
+            "Invalid prefixes for the overlay network '" + overlay.name() +
+            "': the Agent prefixes need to be within the overlay subnet, "
+            "and `min_prefix` <= `prefix` <= `max_prefix` <= 32");
+      }
+
+      // The blocks reserved for a topology hold Agent subnets of any
+      // of the allowed prefixes.
+      if (overlay.has_topology_prefix() &&
+          ((int) overlay.topology_prefix() < address->prefix() ||
+           overlay.topology_prefix() > minPrefix)) {
+        return Error(
+            "Invalid `topology_prefix` for the overlay network '" +
+            overlay.name() + "': it needs to be within the overlay subnet, "
+            "and not longer than `min_prefix`");
+      }
+
+      // The tenant is only carried by the options of Geneve.
+      if (overlay.has_tenant() &&
+          networkConfig.encapsulation() != NetworkConfig::GENEVE) {
+        return Error(
+            "Invalid `tenant` for the overlay network '" + overlay.name() +
+            "': it needs the Geneve encapsulation");
+      }
+
       overlays.emplace(
           overlay.name(),
-          Owned<Overlay>(new Overlay(
-            overlay.name(),
-            address.get(),
-            (uint8_t) overlay.prefix())));
+          Owned<Overlay>(new Overlay(overlay, address.get())));
     }
 
     if (overlays.empty()) {
@@ -723,6 +838,12 @@ public:
       storage = new LogStorage(log);
     }
 
+    if (masterConfig.standby() && log == nullptr) {
+      return Error(
+          "Standby mode requires the replicated log, please specify "
+          "`replicated_log_dir`");
+    }
+
     Owned<mesos::state::protobuf::State> replicatedLog;
 
     if (storage != nullptr) {
@@ -737,7 +858,8 @@ public:
           networkConfig,
           replicatedLog,
           storage,
-          log));
+          log,
+          masterConfig.standby()));
   }
 
   ~ManagerProcess()
@@ -745,6 +867,7 @@ public:
     LOG(INFO) << "Shutting down the master manager process...";
 
     replicatedLog.reset();
+    reader.reset();
 
     if (storage != nullptr)  {
       delete storage;
@@ -765,6 +888,12 @@ protected:
           OVERLAY_HELP,
           &ManagerProcess::state);
 
+    LOG(INFO) << "Adding route for '" << self().id << "/lookup'";
+
+    route("/lookup",
+          LOOKUP_HELP,
+          &ManagerProcess::lookup);
+
     // When a new agent comes up or an existing agent reconnects with
     // the master, it'll first send a `RegisterAgentMessage` to the
     // master. The master will reply with `UpdateAgentNetworkMessage`.
@@ -772,10 +901,32 @@ protected:
 
     // When the agent finishes its configuration based on the content
     // in `UpdateAgentNetworkMessage`, it'll reply the master with an
-    // `AgentRegisteredMessage`.
-    // TODO(jieyu): Master should retry `UpdateAgentNetworkMessage` in
-    // case the message gets dropped.
+    // `AgentRegisteredMessage`. Until then the master retransmits the
+    // `UpdateAgentNetworkMessage`.
     install<AgentRegisteredMessage>(&ManagerProcess::agentRegistered);
+
+    // An agent running out of addresses on an overlay asks for a
+    // secondary subnet, which is sent with an
+    // `UpdateAgentNetworkMessage` like the rest of its configuration.
+    install<RequestSubnetMessage>(&ManagerProcess::requestSubnet);
+
+    if (standby) {
+      LOG(INFO) << "Tailing the replicated log in standby mode";
+      tail();
+    }
+  }
+
+  virtual void exited(const UPID& pid)
+  {
+    // Stop retransmitting updates to an Agent that went away. It will
+    // re-register once it comes back.
+    if (outstandingUpdates.contains(pid.address.ip) &&
+        outstandingUpdates.at(pid.address.ip).pid == pid) {
+      LOG(INFO) << "Agent " << pid << " has exited, dropping its "
+                << "outstanding update";
+
+      outstandingUpdates.erase(pid.address.ip);
+    }
   }
 
   void registerAgent(
@@ -784,38 +935,73 @@ protected:
   {
     LOG(INFO) << "Got registration from pid: " << pid;
 
-    if (replicatedLog.get() != nullptr) {
-      if (storedState.isNone() && !recovering) {
+    // Start measuring the registration latency on the first message
+    // we see from this Agent. The measurement is completed once the
+    // Agent is sent its overlay configuration in `_registerAgent`.
+    if (!registrations.contains(pid.address.ip)) {
+      Owned<Promise<Nothing>> registration(new Promise<Nothing>());
+      metrics.registration.time(registration->future());
+
+      registrations.put(pid.address.ip, registration);
+    }
+
+    if (replicatedLog.get() != nullptr && storedState.isNone()) {
+      if (!recovering) {
         // We haven't started recovering.
         LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " moving to `RECOVERING`"
-          << " state . Hence, not sending an update to agent"
-          << pid;
+          << " state";
         recover();
+      }
+
+      // In standby mode the Agents stored in the replicated log are
+      // already known, and their configuration can be sent while we
+      // are recovering.
+      if (agents.find(pid.address.ip) != nullptr) {
+        LOG(INFO) << "Agent " << pid << " re-registering while"
+                  << " recovering from the tailed network state.";
+        _registerAgent(pid, true);
         return;
-      } else if (storedState.isNone() && recovering) {
-        // We are recovering. Drop the message, the agent will try to
-        // re-register.
-        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
-          << " state . Hence, not sending an update to agent"
-          << pid;
-        return;
-      } // else -> `storedState.isSome` , we have recovered.
-    }
+      }
+
+      // Any other registration is answered once the recovery is
+      // complete.
+      LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
+        << " state . Hence, queuing the registration from agent "
+        << pid;
+      pendingRegistrations.put(
+          pid.address.ip,
+          PendingRegistration(pid, registerMessage));
+      return;
+    } // else -> `storedState.isSome` , we have recovered.
+
+    Option<size_t> position = agents.position(pid.address.ip);
 
-    if (agents.contains(pid.address.ip)) {
+    if (position.isSome()) {
       LOG(INFO) << "Agent " << pid << " re-registering.";
 
       // Ensure that the agent is added to the replicated log.
-      const string agentIP = stringify(pid.address.ip);
-      for (int i = 0; i < networkState.agents_size(); i++) {
-        if (agentIP == networkState.agents(i).ip()) {
-          // Given that `networkState` already has this Agent, the
-          // information is already stored in replicated log and hence
-          // we can just send an "ACK" to the agent with the
-          // configuration info
-          _registerAgent(pid, true);
+      if (position.get() < checkpointed) {
+        // Given that the Agent has been checkpointed, the information
+        // is already stored in replicated log and hence we can just
+        // send an "ACK" to the agent with the configuration info,
+        // unless the Agent has enabled or disabled direct routing
+        // since.
+        AgentRecord* agent = agents.find(pid.address.ip);
+        const bool hostGw = registerMessage.network_config().host_gw();
+
+        if (agent->hostGw != hostGw) {
+          agent->hostGw = hostGw;
+
+          update(Owned<Operation>(new UpdateAgent(pid.address.ip)))
+            .onAny(defer(self(),
+                         &ManagerProcess::_registerAgent,
+                         pid,
+                         lambda::_1));
           return;
         }
+
+        _registerAgent(pid, true);
+        return;
       }
 
       // The fact that we have reached here implies that the Agent
@@ -825,19 +1011,28 @@ protected:
       LOG(INFO) << "Agent " << pid
                 << " info has not been updated in the replicated log."
                 << " Hence dropping this registration request.";
+
+      discardRegistration(pid.address.ip);
       return;
     } else {
       // New Agent.
       LOG(INFO) << "New registration from pid: " << pid;
-      agents.emplace(pid.address.ip, Agent(pid.address.ip));
 
-      Agent* agent = &(agents.at(pid.address.ip));
+      const AgentNetworkConfig& agentNetworkConfig =
+        registerMessage.network_config();
+
+      Option<string> topology = None();
+      if (agentNetworkConfig.has_topology()) {
+        topology = agentNetworkConfig.topology();
+      }
 
       Try<net::IPNetwork> vtepIP = vtep.allocateIP();
       if (vtepIP.isError()) {
         LOG(ERROR)
           << "Unable to get VTEP IP for Agent: " << vtepIP.error()
           << "Cannot fulfill registration for Agent: " << pid;
+
+        discardRegistration(pid.address.ip);
         return;
       }
       LOG(INFO) << "Allocated VTEP IP : " << vtepIP.get();
@@ -847,67 +1042,50 @@ protected:
         LOG(ERROR)
           << "Unable to get VTEP MAC for Agent: " << vtepMAC.error()
           << "Cannot fulfill registration for Agent: " << pid;
-          return;
+
+        discardRegistration(pid.address.ip);
+        return;
       }
       VLOG(1) << "Allocated VTEP MAC : " << vtepMAC.get();
 
+      AgentRecord* agent =
+        agents.add(pid.address.ip, vtepIP->address(), topology);
+
+      agent->hostGw = agentNetworkConfig.host_gw();
+
       // Walk through all the overlay networks. Allocate a subnet from
-      // each overlay to the Agent. Allocate a VTEP IP and MAC for each
-      // agent. Queue the message on the Agent. Finally, ask Master to
-      // reliably send these messages to the Agent.
+      // each overlay to the Agent. The VTEP IP and MAC, and the
+      // bridges, are derived from the `AgentTable` when the overlay
+      // configuration is sent to the Agent.
       foreachpair (const string& name, Owned<Overlay>& overlay, overlays) {
-        AgentOverlayInfo _overlay;
-        Option<net::IPNetwork> agentSubnet = None();
+        AgentOverlay _overlay(agents.getOverlay(name).get());
 
-        _overlay.mutable_info()->set_name(name);
-        _overlay.mutable_info()->set_subnet(stringify(overlay->network));
-        _overlay.mutable_info()->set_prefix(overlay->prefix);
+        if (agentNetworkConfig.allocate_subnet()) {
+          Option<uint32_t> capacity = None();
+          if (agentNetworkConfig.has_capacity()) {
+            capacity = agentNetworkConfig.capacity();
+          }
 
-        if (registerMessage.network_config().allocate_subnet()) {
-          Try<net::IPNetwork> _agentSubnet = overlay->allocate();
-          if (_agentSubnet.isError()) {
+          Try<net::IPNetwork> agentSubnet =
+            overlay->allocate(overlay->getAgentPrefix(capacity), topology);
+          if (agentSubnet.isError()) {
             LOG(ERROR) << "Cannot allocate subnet from overlay "
                        << name << " to Agent " << pid << ":"
-                       << _agentSubnet.error();
+                       << agentSubnet.error();
             continue;
           }
 
-          agentSubnet = _agentSubnet.get();
-          _overlay.set_subnet(stringify(agentSubnet.get()));
-
-          // Allocate bridges for Mesos and Docker.
-          Try<Nothing> bridges = allocateBridges(
-              &_overlay,
-              registerMessage.network_config());
-
-          if (bridges.isError()) {
-            LOG(ERROR) << "Unable to allocate bridge for network "
-                       << name << ": " << bridges.error();
-            if ( agentSubnet.isSome()) {
-              overlay->free(agentSubnet.get());
-            }
-            continue;
-          }
+          _overlay.setSubnet(agentSubnet.get());
+          _overlay.mesosBridge = agentNetworkConfig.mesos_bridge();
+          _overlay.dockerBridge = agentNetworkConfig.docker_bridge();
         }
 
-        VxLANInfo vxlan;
-        vxlan.set_vni(1024);
-        vxlan.set_vtep_name("vtep1024");
-        vxlan.set_vtep_ip(stringify(vtepIP.get()));
-        vxlan.set_vtep_mac(stringify(vtepMAC.get()));
-
-        BackendInfo backend;
-        backend.mutable_vxlan()->CopyFrom(vxlan);
-
-        _overlay.mutable_backend()->CopyFrom(backend);
-
-        agent->addOverlay(_overlay);
+        agents.addOverlay(agent, _overlay);
       }
 
-      // Update the `networkState in the replicated log before
+      // Update the network state in the replicated log before
       // sending the overlay configuration to the Agent.
-      update(Owned<Operation>(
-            new AddAgent(agents.at(pid.address.ip).getAgentInfo())))
+      update(Owned<Operation>(new AddAgent(pid.address.ip)))
         .onAny(defer(self(),
               &ManagerProcess::_registerAgent,
               pid,
@@ -919,212 +1097,896 @@ protected:
   }
 
   // Will be called once the operation is successfully applied to the
-  // `networkState`.
+  // network state.
   void _registerAgent(const UPID& pid, const Future<bool>& result)
   {
     if (!result.isReady()) {
       LOG(WARNING) << "Unable to process registration request from "
                    << pid << " due to: "
                    << (result.isDiscarded() ? "discarded" : result.failure());
+
+      discardRegistration(pid.address.ip);
       return;
     }
 
-    CHECK(agents.contains(pid.address.ip));
+    CHECK_NOTNULL(agents.find(pid.address.ip));
 
-    list<AgentOverlayInfo> _overlays = agents.at(pid.address.ip).getOverlays();
+    // Every update gets a new sequence number so that an
+    // acknowledgement for a previous update does not stop the
+    // retransmission of this one.
+    OutstandingUpdate outstanding;
+    outstanding.pid = pid;
+    outstanding.sequence = ++updateSequence;
+    outstanding.backoff = UPDATE_RETRY_INTERVAL_MIN;
 
-    // Create the network update message and send it to the Agent.
-    UpdateAgentOverlaysMessage update;
+    outstandingUpdates.put(pid.address.ip, outstanding);
 
-    foreach(const AgentOverlayInfo& overlay, _overlays) {
-      update.add_overlays()->CopyFrom(overlay);
-    }
+    link(pid);
 
-    // Clear the state for all overlays in this update.
-    for (int i = 0; i < update.overlays_size(); i++) {
-      update.mutable_overlays(i)->clear_state();
-    }
+    sendUpdate(pid.address.ip);
+
+    delay(outstanding.backoff,
+          self(),
+          &ManagerProcess::retransmitUpdate,
+          pid.address.ip,
+          outstanding.sequence);
 
-    send(pid, update);
+    if (registrations.contains(pid.address.ip)) {
+      registrations.at(pid.address.ip)->set(Nothing());
+      registrations.erase(pid.address.ip);
+    }
   }
 
-  void agentRegistered(const UPID& from, const AgentRegisteredMessage& message)
+  // Discards the registration of an Agent that is rejected, so that
+  // it is not left pending. The Agent starts a new registration when
+  // it registers again.
+  void discardRegistration(const net::IP& ip)
   {
-    if(agents.contains(from.address.ip)) {
-      LOG(INFO) << "Got ACK for addition of networks from " << from;
-      for(int i = 0; i < message.overlays_size(); i++) {
-        agents.at(from.address.ip).updateOverlayState(message.overlays(i));
-      }
-
-      // We don't need to store the "state" of an overlay network on
-      // an agent in the replicated log so go ahead and update the
-      // `networkState` without updating the overlay replicated log.
-      for (int i = 0; i < networkState.agents_size(); i++) {
-        if (stringify(from.address.ip) == networkState.agents(i).ip()) {
-          networkState.mutable_agents(i)->CopyFrom(
-              agents.at(from.address.ip).getAgentInfo());
-
-          LOG(INFO) << "Sending register ACK to: " << from;
-          send(from, AgentRegisteredAcknowledgement());
-          return;
-        }
-      }
-      LOG(ERROR) << "Unable to find the registered agent in the `networkState`";
-    } else {
-      LOG(ERROR) << "Got ACK for network message for non-existent PID "
-                 << from;
+    if (registrations.contains(ip)) {
+      registrations.at(ip)->discard();
+      registrations.erase(ip);
     }
   }
 
-  Future<http::Response> state(const http::Request& request)
+  // Sends the overlay configuration of an Agent with the sequence of
+  // its outstanding update.
+  void sendUpdate(const net::IP& ip)
   {
-    VLOG(1) << "Responding to `state` endpoint";
+    const AgentRecord* agent = CHECK_NOTNULL(agents.find(ip));
+    CHECK(outstandingUpdates.contains(ip));
 
-    return http::OK(
-        JSON::protobuf(networkState),
-        request.url.query.get("jsonp"));
-  }
+    const OutstandingUpdate& outstanding = outstandingUpdates.at(ip);
 
-  void recover()
-  {
-    // Nothing to recover.
-    CHECK_NOTNULL(replicatedLog.get());
+    AgentInfo agentInfo;
+    Try<Nothing> built = agents.getAgentInfo(*agent, &agentInfo);
+    if (built.isError()) {
+      LOG(ERROR) << "Unable to build the overlay configuration of Agent "
+                 << outstanding.pid << ": " << built.error();
+      return;
+    }
 
-    recovering = true;
+    // Create the network update message and send it to the Agent.
+    UpdateAgentOverlaysMessage update;
+    update.set_sequence(outstanding.sequence);
+    update.mutable_overlays()->Swap(agentInfo.mutable_overlays());
 
-    replicatedLog->fetch<State>(REPLICATED_LOG_STORE_KEY)
-      .onAny(defer(self(),
-                   &ManagerProcess::_recover,
-                   lambda::_1));
+    // Clear the state for all overlays in this update.
+    for (int i = 0; i < update.overlays_size(); i++) {
+      update.mutable_overlays(i)->clear_state();
+    }
+
+    send(outstanding.pid, update);
   }
 
-  void _recover(Future<Variable<State>> variable)
+  void retransmitUpdate(const net::IP& ip, uint64_t sequence)
   {
-    CHECK_NOTNULL(replicatedLog.get());
-
-    if (!variable.isReady()) {
-      LOG(WARNING) << "This " << self().id <<"might have been demoted."
-                   << "Aborting recovery of replicated log"
-                   <<(variable.isDiscarded() ? "discarded" : variable.failure());
-
+    // The update has been acknowledged, or superseded by a newer one.
+    if (!outstandingUpdates.contains(ip) ||
+        outstandingUpdates.at(ip).sequence != sequence) {
       return;
     }
 
-    State _networkState = variable.get().get();
+    OutstandingUpdate& outstanding = outstandingUpdates.at(ip);
 
-    // Only if the `network_config` is present does it imply that the
-    // overlay-master stored state in the replicated log, else  this
-    // is the first time an overlay-master is accessing the
-    // replicated log and hence the state will be empty.
-    if (!_networkState.has_network()) {
-      LOG(INFO) << "No network state present, hence nothing to"
-                << " recover from replicated log";
+    LOG(INFO) << "Retransmitting update " << sequence << " to "
+              << outstanding.pid;
 
-      // Update the `storeState` variable so that we know where to
-      // update the `State` in the replicated log.
-      storedState = variable.get();
+    ++metrics.updates_retransmitted;
 
-      LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
-      return;
-    }
+    sendUpdate(ip);
 
-    // Re-populate the agents, the overlay subnets that have been
-    // allocated, and the VTEP IP and VTEP MAC that have been
-    // allocated. The information stored in the replicated log should
-    // not have any errors.
-    for (int i = 0; i < _networkState.agents_size(); i++) {
-      const AgentInfo& agentInfo = _networkState.agents(i);
+    outstanding.backoff =
+      std::min(outstanding.backoff * 2, UPDATE_RETRY_INTERVAL_MAX);
 
-      // Cleare the `State` of the `AgentInfo`
+    delay(outstanding.backoff,
+          self(),
+          &ManagerProcess::retransmitUpdate,
+          ip,
+          sequence);
+  }
 
-      Try<Agent> agent = Agent::create(agentInfo);
-      if (agent.isError()) {
-        LOG(ERROR) << "Could not recover Agent: "<< agent.error();
-        abort();
+  void agentRegistered(const UPID& from, const AgentRegisteredMessage& message)
+  {
+    if (outstandingUpdates.contains(from.address.ip)) {
+      const uint64_t sequence =
+        outstandingUpdates.at(from.address.ip).sequence;
+
+      // Agents that do not know about sequences acknowledge any
+      // update.
+      if (message.has_sequence() && message.sequence() != sequence) {
+        LOG(INFO) << "Ignoring ACK for update " << message.sequence()
+                  << " from " << from << ", waiting for update "
+                  << sequence;
+        return;
       }
 
-      agents.emplace(agent->getIP(), agent.get());
-      VLOG(1) << "Recovered agent: " << agent->getIP();
-
-      for (int j = 0; j < agentInfo.overlays_size(); j++) {
-        const AgentOverlayInfo& overlay = agentInfo.overlays(j);
+      outstandingUpdates.erase(from.address.ip);
+    }
 
-        // clear the overlay state.
-        _networkState.mutable_agents(i)->mutable_overlays(j)->clear_state();
+    Option<size_t> position = agents.position(from.address.ip);
 
-        Try<net::IPNetwork> network = net::IPNetwork::parse(
-            overlay.subnet(),
-            AF_INET);
+    if (position.isSome()) {
+      LOG(INFO) << "Got ACK for addition of networks from " << from;
 
-        if (network.isError()) {
-          LOG(ERROR) << "Unable to parse the retrieved network: "
-            << overlay.subnet() << ": "
-            << network.error();
-          abort();
+      // We don't need to store the "state" of an overlay network on
+      // an agent in the replicated log so go ahead and update the
+      // `agents` without updating the overlay replicated log.
+      AgentRecord* agent = agents.find(from.address.ip);
+      for (int i = 0; i < message.overlays_size(); i++) {
+        Try<Nothing> updated = agents.setStatus(agent, message.overlays(i));
+        if (updated.isError()) {
+          LOG(ERROR) << "Got update for " << from << ": "
+                     << updated.error();
         }
+      }
 
-        // We should already have this particular overlay at bootup.
-        CHECK(overlays.contains(overlay.info().name()));
-        Try<Nothing> result = overlays.at(overlay.info().name())->reserve(network.get());
-        if (result.isError()) {
-          LOG(ERROR) << "Unable to reserve the subnet " << network.get()
-                     << ": " << result.error();
-          abort();
+      if (position.get() < checkpointed) {
+        LOG(INFO) << "Sending register ACK to: " << from;
+        send(from, AgentRegisteredAcknowledgement());
+        return;
+      }
+
+      LOG(ERROR) << "Unable to find the registered agent in the network state";
+    } else {
+      LOG(ERROR) << "Got ACK for network message for non-existent PID "
+                 << from;
+    }
+  }
+
+  void requestSubnet(const UPID& from, const RequestSubnetMessage& message)
+  {
+    const string& name = message.name();
+
+    LOG(INFO) << "Agent " << from << " requested a secondary subnet of"
+              << " overlay " << name;
+
+    // The Agent keeps asking for as long as it needs a subnet.
+    if (replicatedLog.get() != nullptr && storedState.isNone()) {
+      LOG(INFO) << "Dropping the subnet request from " << from
+                << " since the network state has not been recovered";
+      return;
+    }
+
+    AgentRecord* agent = agents.find(from.address.ip);
+    if (agent == nullptr) {
+      LOG(ERROR) << "Got a subnet request from unknown Agent " << from;
+      return;
+    }
+
+    Option<uint16_t> index = agents.getOverlay(name);
+
+    Option<AgentOverlay> primary = None();
+    size_t secondaries = 0;
+
+    if (index.isSome()) {
+      foreach (const AgentOverlay& overlay, agent->overlays) {
+        if (overlay.overlay != index.get()) {
+          continue;
         }
 
-        // All overlay instances on an Agent share the same VTEP IP
-        // and MAC. Hence, the backend information on all the overlay
-        // information would be the same. We therefore need to reserve
-        // the VTEP IP and MAC only once.
-        if (j == 0) {
-          Try<net::IPNetwork> vtepIP =
-            net::IPNetwork::parse(overlay.backend().vxlan().vtep_ip(), AF_INET);
-          if (vtepIP.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved `vtepIP`: "
-              << overlay.backend().vxlan().vtep_ip() << ": "
-              << vtepIP.error();
-            abort();
-          }
+        if (overlay.secondary) {
+          secondaries++;
+        } else {
+          primary = overlay;
+        }
+      }
 
-          // NOTE: We only need to reserve the VTEP IP and not the
-          // VTEP MAC since the VTEP MAC is derived from the VTEP IP.
-          // Look at the `generateMAC` method in `VTEP` to see how
-          // this is done.
-          LOG(INFO) << "Reserving VTEP IP: " << vtepIP.get();
-          Try<Nothing> result = vtep.reserve(vtepIP.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve VTEP IP: "
-              << vtepIP.get() << ": " << result.error();
-            abort();
+      // The secondary subnets that are being stored count as well.
+      if (stagedSubnets.contains(from.address.ip)) {
+        foreach (uint16_t overlay, stagedSubnets.at(from.address.ip)) {
+          if (overlay == index.get()) {
+            secondaries++;
           }
         }
       }
     }
 
-    // Recovery done. Copy the recovered state into the `State`
-    // object.
-    networkState.CopyFrom(_networkState);
+    if (primary.isNone() ||
+        !overlays.contains(name) ||
+        !primary->mesosBridge) {
+      LOG(ERROR) << "Agent " << from << " has no Mesos network on overlay "
+                 << name << ", dropping its subnet request";
+      return;
+    }
+
+    // The subnet has been allocated already, the Agent will get it
+    // with the update that is outstanding.
+    if (message.subnets() <= secondaries) {
+      LOG(INFO) << "Ignoring stale subnet request from " << from;
+      return;
+    }
+
+    if (secondaries >= MAX_SECONDARY_SUBNETS) {
+      LOG(ERROR) << "Agent " << from << " already holds the maximum of "
+                 << MAX_SECONDARY_SUBNETS << " secondary subnets of overlay "
+                 << name;
+      return;
+    }
+
+    Owned<Overlay> overlay = overlays.at(name);
+
+    Try<net::IPNetwork> subnet =
+      overlay->allocate(primary->prefix, agents.getTopology(*agent));
+    if (subnet.isError()) {
+      LOG(ERROR) << "Cannot allocate a secondary subnet from overlay "
+                 << name << " to Agent " << from << ": " << subnet.error();
+      return;
+    }
+
+    LOG(INFO) << "Allocated secondary subnet " << subnet.get()
+              << " of overlay " << name << " to Agent " << from;
+
+    // The Mesos bridge gets the whole secondary subnet. It is only
+    // added to `agents` once it has been stored, otherwise it would
+    // be handed out (e.g., by `lookup`) even if the write fails.
+    AgentOverlay secondary(index.get());
+    secondary.setSubnet(subnet.get());
+    secondary.mesosBridge = true;
+    secondary.secondary = true;
+
+    stagedSubnets[from.address.ip].push_back(index.get());
+
+    update(Owned<Operation>(new UpdateAgent(from.address.ip, secondary)))
+      .onAny(defer(self(),
+                   &ManagerProcess::_requestSubnet,
+                   from,
+                   index.get(),
+                   lambda::_1));
+  }
+
+  void _requestSubnet(
+      const UPID& from,
+      uint16_t overlay,
+      const Future<bool>& update)
+  {
+    // The secondary subnet is either in `agents` now, or it has been
+    // dropped along with the network state that was not stored.
+    if (stagedSubnets.contains(from.address.ip)) {
+      vector<uint16_t>& staged = stagedSubnets.at(from.address.ip);
+
+      vector<uint16_t>::iterator it =
+        std::find(staged.begin(), staged.end(), overlay);
+
+      if (it != staged.end()) {
+        staged.erase(it);
+      }
+
+      if (staged.empty()) {
+        stagedSubnets.erase(from.address.ip);
+      }
+    }
+
+    _registerAgent(from, update);
+  }
+
+  Future<http::Response> state(const http::Request& request)
+  {
+    VLOG(1) << "Responding to `state` endpoint";
+
+    // Only the Agents that have been checkpointed are part of the
+    // network state.
+    State networkState;
+    networkState.mutable_network()->CopyFrom(networkConfig);
+
+    for (size_t i = 0; i < checkpointed; i++) {
+      Try<Nothing> built = agents.getAgentInfo(
+          agents.records()[i],
+          networkState.add_agents());
+
+      if (built.isError()) {
+        return http::InternalServerError(
+            "Unable to build the network state: " + built.error());
+      }
+    }
+
+    return http::OK(
+        JSON::protobuf(networkState),
+        request.url.query.get("jsonp"));
+  }
+
+  Future<http::Response> lookup(const http::Request& request)
+  {
+    Option<string> _ip = request.url.query.get("ip");
+    if (_ip.isNone()) {
+      return http::BadRequest("Missing the 'ip' query parameter");
+    }
+
+    Try<net::IP> ip = net::IP::parse(_ip.get(), AF_INET);
+    if (ip.isError()) {
+      return http::BadRequest(
+          "Unable to parse the IP '" + _ip.get() + "': " + ip.error());
+    }
+
+    // Only the allocations that have been checkpointed are part of
+    // the network state.
+    Option<Allocation> allocation = agents.lookup(ip.get());
+    if (allocation.isNone() || allocation->agent >= checkpointed) {
+      return http::NotFound(
+          "No Agent holds the IP " + stringify(ip.get()));
+    }
+
+    const AgentRecord& agent = agents.records()[allocation->agent];
+
+    LookupInfo info;
+    info.set_ip(stringify(ip.get()));
+    info.set_agent(stringify(net::IP(agent.ip)));
+
+    if (allocation->overlay.isSome()) {
+      const AgentOverlay& overlay =
+        agent.overlays[allocation->overlay.get()];
+
+      info.set_overlay(agents.getOverlayInfo(overlay.overlay).name());
+      info.set_subnet(stringify(overlay.getSubnet().get()));
+
+      if (overlay.secondary) {
+        info.set_secondary(true);
+      }
+    } else {
+      info.set_subnet(stringify(net::IPNetwork::create(
+          net::IP(agent.vtepIP),
+          vtep.network.prefix()).get()));
+    }
+
+    return http::OK(
+        JSON::protobuf(info),
+        request.url.query.get("jsonp"));
+  }
+
+  void recover()
+  {
+    // Nothing to recover.
+    CHECK_NOTNULL(replicatedLog.get());
+
+    recovering = true;
+
+    metrics.recovery.start();
+
+    replicatedLog->fetch<CompactState>(REPLICATED_LOG_STORE_KEY)
+      .onAny(defer(self(),
+                   &ManagerProcess::_recover,
+                   lambda::_1));
+  }
+
+  void _recover(Future<Variable<CompactState>> variable)
+  {
+    CHECK_NOTNULL(replicatedLog.get());
+
+    if (!variable.isReady()) {
+      LOG(WARNING) << "This " << self().id <<"might have been demoted."
+                   << "Aborting recovery of replicated log"
+                   <<(variable.isDiscarded() ? "discarded" : variable.failure());
+
+      return;
+    }
+
+    // If there is no network state in the `CompactState` encoding
+    // this master might be the first one running after an upgrade,
+    // hence check for a network state stored in the legacy encoding.
+    if (!variable.get().get().has_network()) {
+      replicatedLog->fetch<State>(LEGACY_REPLICATED_LOG_STORE_KEY)
+        .onAny(defer(self(),
+                     &ManagerProcess::_migrate,
+                     variable.get(),
+                     lambda::_1));
+      return;
+    }
+
+    __recover(variable.get(), variable.get().get());
+  }
+
+  void _migrate(
+      const Variable<CompactState>& variable,
+      Future<Variable<State>> legacy)
+  {
+    CHECK_NOTNULL(replicatedLog.get());
+
+    if (!legacy.isReady()) {
+      LOG(WARNING) << "This " << self().id <<"might have been demoted."
+                   << "Aborting recovery of replicated log"
+                   <<(legacy.isDiscarded() ? "discarded" : legacy.failure());
+
+      return;
+    }
+
+    CompactState _networkState;
+
+    if (legacy.get().get().has_network()) {
+      LOG(INFO) << "Migrating the network state from the legacy encoding";
+
+      Try<Nothing> compacted = compact(legacy.get().get(), &_networkState);
+      if (compacted.isError()) {
+        LOG(ERROR) << "Unable to encode the legacy network state: "
+                   << compacted.error();
+        abort();
+      }
+
+      // The legacy network state will be expunged once the network
+      // state has been stored in the `CompactState` encoding.
+      legacyState = legacy.get();
+    }
+
+    __recover(variable, _networkState);
+  }
+
+  void __recover(
+      const Variable<CompactState>& variable,
+      const CompactState& _networkState)
+  {
+    // Only if the `network_config` is present does it imply that the
+    // overlay-master stored state in the replicated log, else  this
+    // is the first time an overlay-master is accessing the
+    // replicated log and hence the state will be empty.
+    if (!_networkState.has_network()) {
+      LOG(INFO) << "No network state present, hence nothing to"
+                << " recover from replicated log";
+    } else {
+      // In standby mode `agents` and the allocators already hold the
+      // network state tailed from the replicated log, hence only the
+      // entries stored since need to be applied.
+      Try<Nothing> restored = Error("No tailed network state");
+      if (standby && agents.size() > 0) {
+        restored = apply(_networkState);
+        if (restored.isError()) {
+          LOG(WARNING) << "Unable to apply the network state to the tailed"
+                       << " one, recovering it from scratch: "
+                       << restored.error();
+        } else {
+          LOG(INFO) << "Promoted from the tailed network state with "
+                    << agents.size() << " agents";
+        }
+      }
+
+      // The information stored in the replicated log should not have
+      // any errors.
+      if (restored.isError()) {
+        restored = restore(_networkState);
+      }
+
+      if (restored.isError()) {
+        LOG(ERROR) << "Unable to recover the network state: "
+                   << restored.error();
+        abort();
+      }
+    }
 
     // Update the `storeState` variable so that we know where to
     // update the `State` in the replicated log.
-    storedState = variable.get();
+    storedState = variable;
+
+    metrics.recovery.stop();
 
     LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
-    return;
+
+    // Answer the registrations that were received while recovering.
+    hashmap<net::IP, PendingRegistration> _pendingRegistrations =
+      pendingRegistrations;
+
+    pendingRegistrations.clear();
+
+    foreachvalue (const PendingRegistration& registration,
+                  _pendingRegistrations) {
+      registerAgent(registration.first, registration.second);
+    }
+  }
+
+  // Re-populates the agents, the overlay subnets that have been
+  // allocated, and the VTEP IP and VTEP MAC that have been allocated
+  // from a network state stored in the replicated log.
+  Try<Nothing> restore(const CompactState& _networkState)
+  {
+    resetAllocations();
+
+    return apply(_networkState);
+  }
+
+  // Adds the Agents, and the overlay subnets of the Agents, of a later
+  // network state of the replicated log than the one `agents` holds,
+  // and reserves their allocations. Unlike `restore`, the Agents that
+  // are known already are kept along with their allocations.
+  Try<Nothing> apply(const CompactState& _networkState)
+  {
+    // The number of overlays of each Agent known already, only the
+    // overlays added since need to be reserved.
+    vector<size_t> known;
+    known.reserve(agents.size());
+
+    foreach (const AgentRecord& agent, agents.records()) {
+      known.push_back(agent.overlays.size());
+    }
+
+    Try<Nothing> extended = agents.extend(_networkState);
+    if (extended.isError()) {
+      return Error("Could not recover the Agents: " + extended.error());
+    }
+
+    for (size_t i = 0; i < agents.size(); i++) {
+      const AgentRecord& agent = agents.records()[i];
+
+      if (i >= known.size()) {
+        VLOG(1) << "Recovered agent: " << net::IP(agent.ip);
+      }
+
+      const Option<string> topology = agents.getTopology(agent);
+
+      for (size_t j = i < known.size() ? known[i] : 0;
+           j < agent.overlays.size();
+           j++) {
+        const AgentOverlay& overlay = agent.overlays[j];
+
+        // Agents that did not ask for a subnet only have a VTEP.
+        Option<net::IPNetwork> network = overlay.getSubnet();
+        if (network.isNone()) {
+          continue;
+        }
+
+        const string& name = agents.getOverlayInfo(overlay.overlay).name();
+
+        Try<Nothing> result =
+          overlays.at(name)->reserve(network.get(), topology);
+
+        if (result.isError()) {
+          return Error(
+              "Unable to reserve the subnet " + stringify(network.get()) +
+              ": " + result.error());
+        }
+      }
+
+      // Agents stored before they had any overlays have no VTEP IP.
+      if (i < known.size() || agent.vtepIP == 0) {
+        continue;
+      }
+
+      Try<net::IPNetwork> vtepIP = net::IPNetwork::create(
+          net::IP(agent.vtepIP),
+          vtep.network.prefix());
+
+      if (vtepIP.isError()) {
+        return Error(
+            "Unable to create the retrieved `vtepIP`: " + vtepIP.error());
+      }
+
+      // NOTE: We only need to reserve the VTEP IP and not the
+      // VTEP MAC since the VTEP MAC is derived from the VTEP IP.
+      // Look at the `generateMAC` method in `VTEP` to see how
+      // this is done.
+      VLOG(1) << "Reserving VTEP IP: " << vtepIP.get();
+      Try<Nothing> result = vtep.reserve(vtepIP.get());
+      if (result.isError()) {
+        return Error(
+            "Unable to reserve VTEP IP: " + stringify(vtepIP.get()) +
+            ": " + result.error());
+      }
+    }
+
+    // All the Agents we recovered are in the replicated log.
+    checkpointed = agents.size();
+
+    return Nothing();
+  }
+
+  // Reads the entries appended to the replicated log since the last
+  // time it was tailed. Only used in standby mode, while this master
+  // is not leading.
+  void tail()
+  {
+    CHECK(standby);
+    CHECK_NOTNULL(reader.get());
+
+    if (recovering || storedState.isSome()) {
+      VLOG(1) << "Leading, hence not tailing the replicated log";
+
+      tailing = false;
+      return;
+    }
+
+    tailing = true;
+
+    list<Future<Log::Position>> positions;
+    positions.push_back(reader->beginning());
+    positions.push_back(reader->ending());
+
+    process::collect(positions)
+      .then(defer(self(), &ManagerProcess::_tail, lambda::_1))
+      .onAny(defer(self(), &ManagerProcess::__tail, lambda::_1));
+  }
+
+  Future<list<Log::Entry>> _tail(const list<Log::Position>& positions)
+  {
+    // The log might have been truncated past the last entry that has
+    // been read.
+    Log::Position from = positions.front();
+    if (tailed.isSome() && from < tailed.get()) {
+      from = tailed.get();
+    }
+
+    return reader->read(from, positions.back());
+  }
+
+  void __tail(const Future<list<Log::Entry>>& entries)
+  {
+    if (!entries.isReady()) {
+      VLOG(1) << "Unable to tail the replicated log: "
+              << (entries.isDiscarded() ? "discarded" : entries.failure());
+    } else if (!recovering && storedState.isNone()) {
+      // `LogStorage` appends a snapshot of a variable every time it
+      // is stored, hence we only need to apply the latest one.
+      Option<CompactState> latest = None();
+
+      foreach (const Log::Entry& entry, entries.get()) {
+        tailed = entry.position;
+
+        LogStorageOperation operation;
+        if (!operation.ParseFromString(entry.data) ||
+            operation.type() != LogStorageOperation::SNAPSHOT) {
+          continue;
+        }
+
+        const LogStorageOperation::Entry& snapshot =
+          operation.snapshot().entry();
+
+        if (snapshot.name() == REPLICATED_LOG_STORE_KEY) {
+          CompactState _networkState;
+          if (!_networkState.ParseFromString(snapshot.value())) {
+            LOG(WARNING) << "Unable to parse the network state at "
+                         << "position " << entry.position.identity();
+            continue;
+          }
+
+          latest = _networkState;
+        } else if (snapshot.name() == LEGACY_REPLICATED_LOG_STORE_KEY) {
+          State legacy;
+          if (!legacy.ParseFromString(snapshot.value())) {
+            LOG(WARNING) << "Unable to parse the legacy network state at "
+                         << "position " << entry.position.identity();
+            continue;
+          }
+
+          CompactState _networkState;
+          Try<Nothing> compacted = compact(legacy, &_networkState);
+          if (compacted.isError()) {
+            LOG(WARNING) << "Unable to encode the legacy network state: "
+                         << compacted.error();
+            continue;
+          }
+
+          latest = _networkState;
+        }
+      }
+
+      if (latest.isSome() && latest->has_network()) {
+        // The network state only ever grows, hence the later state is
+        // applied on top of the one tailed already. Should it not
+        // extend it, e.g., after the log was truncated, it is restored
+        // from scratch.
+        Try<Nothing> restored = apply(latest.get());
+        if (restored.isError()) {
+          VLOG(1) << "Restoring the tailed network state: "
+                  << restored.error();
+
+          restored = restore(latest.get());
+        }
+
+        if (restored.isError()) {
+          LOG(WARNING) << "Unable to apply the tailed network state: "
+                       << restored.error();
+
+          resetAllocations();
+        } else {
+          VLOG(1) << "Applied the tailed network state with "
+                  << agents.size() << " agents";
+        }
+      }
+    }
+
+    delay(STANDBY_TAIL_INTERVAL, self(), &ManagerProcess::tail);
   }
 
 private:
+  struct Metrics
+  {
+    explicit Metrics(const ManagerProcess& manager)
+      : registration("overlay/master/registration", Hours(1)),
+        recovery("overlay/master/recovery"),
+        log_store("overlay/master/log/store", Hours(1)),
+        log_stores("overlay/master/log/stores"),
+        log_store_bytes("overlay/master/log/store_bytes"),
+        operations_pending(
+            "overlay/master/operations_pending",
+            defer(manager, &ManagerProcess::_operations_pending)),
+        updates_outstanding(
+            "overlay/master/updates/outstanding",
+            defer(manager, &ManagerProcess::_updates_outstanding)),
+        updates_retransmitted("overlay/master/updates/retransmitted"),
+        vtep_ips_free(
+            "overlay/master/vtep/ips_free",
+            defer(manager, &ManagerProcess::_vtep_ips_free)),
+        vtep_ips_used(
+            "overlay/master/vtep/ips_used",
+            defer(manager, &ManagerProcess::_vtep_ips_used))
+    {
+      process::metrics::add(registration);
+      process::metrics::add(recovery);
+      process::metrics::add(log_store);
+      process::metrics::add(log_stores);
+      process::metrics::add(log_store_bytes);
+      process::metrics::add(operations_pending);
+      process::metrics::add(updates_outstanding);
+      process::metrics::add(updates_retransmitted);
+      process::metrics::add(vtep_ips_free);
+      process::metrics::add(vtep_ips_used);
+
+      // The overlays are static for the lifetime of the process,
+      // hence we can set up their gauges once.
+      foreachkey (const string& name, manager.overlays) {
+        const string prefix = "overlay/master/overlays/" + name + "/";
+
+        overlays.push_back(Gauge(
+            prefix + "subnets_free",
+            defer(manager, &ManagerProcess::_subnets_free, name)));
+
+        overlays.push_back(Gauge(
+            prefix + "subnets_used",
+            defer(manager, &ManagerProcess::_subnets_used, name)));
+      }
+
+      foreach (const Gauge& gauge, overlays) {
+        process::metrics::add(gauge);
+      }
+    }
+
+    ~Metrics()
+    {
+      process::metrics::remove(registration);
+      process::metrics::remove(recovery);
+      process::metrics::remove(log_store);
+      process::metrics::remove(log_stores);
+      process::metrics::remove(log_store_bytes);
+      process::metrics::remove(operations_pending);
+      process::metrics::remove(updates_outstanding);
+      process::metrics::remove(updates_retransmitted);
+      process::metrics::remove(vtep_ips_free);
+      process::metrics::remove(vtep_ips_used);
+
+      foreach (const Gauge& gauge, overlays) {
+        process::metrics::remove(gauge);
+      }
+    }
+
+    // Time taken from the first `RegisterAgentMessage` of an Agent
+    // till the `UpdateAgentOverlaysMessage` is sent to it.
+    Timer<Milliseconds> registration;
+
+    // Time taken to recover the `State` from the replicated log.
+    Timer<Milliseconds> recovery;
+
+    // Writes of the `State` to the replicated log.
+    Timer<Milliseconds> log_store;
+    Counter log_stores;
+    Counter log_store_bytes;
+
+    Gauge operations_pending;
+
+    // Updates sent to Agents that have not been acknowledged yet, and
+    // the number of times they have been retransmitted.
+    Gauge updates_outstanding;
+    Counter updates_retransmitted;
+
+    Gauge vtep_ips_free;
+    Gauge vtep_ips_used;
+
+    // Free and used subnets of every overlay.
+    vector<Gauge> overlays;
+  };
+
+  double _operations_pending()
+  {
+    return operations.size();
+  }
+
+  double _updates_outstanding()
+  {
+    return outstandingUpdates.size();
+  }
+
+  double _vtep_ips_free()
+  {
+    return vtep.freeCount();
+  }
+
+  double _vtep_ips_used()
+  {
+    return vtep.totalCount() - vtep.freeCount();
+  }
+
+  double _subnets_free(const string& name)
+  {
+    CHECK(overlays.contains(name));
+
+    return overlays.at(name)->freeCount();
+  }
+
+  double _subnets_used(const string& name)
+  {
+    CHECK(overlays.contains(name));
+
+    const Owned<Overlay>& overlay = overlays.at(name);
+
+    return overlay->totalCount() - overlay->freeCount();
+  }
+
   bool recovering;
   bool storing;
 
   hashmap<string, Owned<Overlay>> overlays;
-  hashmap<net::IP, Agent> agents;
+
+  NetworkConfig networkConfig;
+
+  AgentTable agents;
+
+  // Number of leading Agents in `agents` that have been stored in the
+  // replicated log. Agents are only ever appended to `agents`, hence
+  // they are stored in order.
+  size_t checkpointed;
 
   Owned<mesos::state::protobuf::State> replicatedLog;
 
-  Option<Variable<State>> storedState;
+  Option<Variable<CompactState>> storedState;
+
+  // Network state stored in the legacy encoding, that needs to be
+  // expunged once the migrated network state has been stored.
+  Option<Variable<State>> legacyState;
+
+  // The last update sent to each Agent that has not been acknowledged
+  // yet.
+  struct OutstandingUpdate
+  {
+    UPID pid;
+    uint64_t sequence;
+    Duration backoff;
+  };
+
+  hashmap<net::IP, OutstandingUpdate> outstandingUpdates;
+
+  // The overlays of the secondary subnets allocated to each Agent that
+  // are being stored, and hence are not in `agents` yet.
+  hashmap<net::IP, vector<uint16_t>> stagedSubnets;
+  uint64_t updateSequence;
+
+  // Registrations received while recovering.
+  typedef std::pair<UPID, RegisterAgentMessage> PendingRegistration;
+  hashmap<net::IP, PendingRegistration> pendingRegistrations;
 
-  State networkState;
+  // In standby mode a non-leading master tails the replicated log to
+  // keep `agents` and the allocators warm.
+  bool standby;
+  bool tailing;
+  Owned<Log::Reader> reader;
+  Option<Log::Position> tailed;
+
+  // Scratch message holding the network state being written to the
+  // replicated log. It is reused across writes to avoid allocating a
+  // new copy of the network state for each write.
+  CompactState storingCompactState;
 
   // We need to keep track of `storage` and `log`, since we will need
   // to free them up when the master manager process is deleted.
@@ -1132,12 +1994,18 @@ private:
 
   Log* log;
 
-  // The set of operations that need to be performed on the
-  // `networkState` before writing to the replicated log.
+  // The set of operations that need to be performed on the network
+  // state before writing to the replicated log.
   std::deque<Owned<Operation>> operations;
 
   Vtep vtep;
 
+  // Registrations that have not been answered yet, used to measure
+  // the registration latency.
+  hashmap<net::IP, Owned<Promise<Nothing>>> registrations;
+
+  Metrics metrics;
+
   ManagerProcess(
       const hashmap<string, Owned<Overlay>>& _overlays,
       const net::IPNetwork& vtepSubnet,
@@ -1145,110 +2013,55 @@ private:
       const NetworkConfig& _networkConfig,
       const Owned<mesos::state::protobuf::State> _replicatedLog,
       Storage* _storage,
-      Log* _log)
+      Log* _log,
+      bool _standby)
     : ProcessBase("overlay-master"),
       recovering(false),
       storing(false),
       overlays(_overlays),
+      networkConfig(_networkConfig),
+      agents(
+          _networkConfig,
+          VXLAN_VNI,
+          _networkConfig.encapsulation() == NetworkConfig::GENEVE
+            ? GENEVE_VTEP_NAME
+            : VXLAN_VTEP_NAME),
+      checkpointed(0),
       replicatedLog(_replicatedLog),
       storedState(None()),
+      legacyState(None()),
+      updateSequence(0),
+      standby(_standby),
+      tailing(false),
+      tailed(None()),
       storage(_storage),
       log(_log),
-      vtep(vtepSubnet, vtepMACOUI)
+      vtep(vtepSubnet, vtepMACOUI),
+      metrics(*this)
   {
-    networkState.mutable_network()->CopyFrom(_networkConfig);
-  };
-
-  Try<Nothing> allocateBridges(
-      AgentOverlayInfo* _overlay,
-      const AgentNetworkConfig& networkConfig)
-  {
-    if (!networkConfig.mesos_bridge() &&
-        !networkConfig.docker_bridge()) {
-      return Nothing();
-    }
-    const string name = _overlay->info().name();
-
-    Try<IPNetwork> network = net::IPNetwork::parse(
-        _overlay->subnet(),
-        AF_INET);
-
-    if (network.isError()) {
-      return Error("Unable to parse the subnet of the network '" +
-          name + "' : " + network.error());
-    }
-
-    Try<struct in_addr> subnet = network->address().in();
-    Try<struct in_addr> subnetMask = network->netmask().in();
-
-    if (subnet.isError()) {
-      return Error("Unable to get a 'struct in_addr' representation of "
-          "the network :"  + subnet.error());
+    if (standby) {
+      CHECK_NOTNULL(log);
+      reader.reset(new Log::Reader(log));
     }
+  };
 
-    if (subnetMask.isError()) {
-      return Error("Unable to get a 'struct in_addr' representation of "
-          "the mask :"  + subnetMask.error());
-    }
-
-    uint32_t address = ntohl(subnet->s_addr);
-    uint32_t mask = ntohl(subnetMask->s_addr) |
-      (0x1 << (32 - (network->prefix() + 1)));
-
-    // Create the Mesos bridge.
-    if (networkConfig.mesos_bridge()) {
-      Try<IPNetwork> mesosSubnet = net::IPNetwork::create((IP(address)), (IP(mask)));
-
-      if (mesosSubnet.isError()) {
-        return Error(
-            "Could not create Mesos subnet for network '" +
-            name + "': " + mesosSubnet.error());
-      }
-
-      BridgeInfo mesosBridgeInfo;
-      mesosBridgeInfo.set_ip(stringify(mesosSubnet.get()));
-      mesosBridgeInfo.set_name(MESOS_BRIDGE_PREFIX + name);
-      _overlay->mutable_mesos_bridge()->CopyFrom(mesosBridgeInfo);
-    }
-
-    // Create the docker bridge.
-    if (networkConfig.docker_bridge()) {
-      Try<IPNetwork> dockerSubnet = net::IPNetwork::create(
-          IP(address | (0x1 << (32 - (network->prefix() + 1)))),
-          IP(mask));
-
-      if (dockerSubnet.isError()) {
-        return Error(
-            "Could not create Docker subnet for network '" +
-            name + "': " + dockerSubnet.error());
-      }
-
-      BridgeInfo dockerBridgeInfo;
-      dockerBridgeInfo.set_ip(stringify(dockerSubnet.get()));
-      dockerBridgeInfo.set_name(DOCKER_BRIDGE_PREFIX + name);
-      _overlay->mutable_docker_bridge()->CopyFrom(dockerBridgeInfo);
-    }
-
-    return Nothing();
-  }
-
-  // Updates the `networkState` with the operation provided. If we are
-  // using the replicated log we will `queue` the operation and invoke
-  // `store, else we will apply the operation immediately.
-  // In case the replicated log is being used, the stored operation is
-  // applied on a copy of `networkState` and the mutated `State` is
-  // written into the overlay replicated log. On a successful write
-  // the `networkState` is updated with the `State` that was stored in
-  // the replicated log.
+  // Checkpoints the change of `agents` the operation refers to. If we
+  // are using the replicated log we will `queue` the operation and
+  // invoke `store`, else we will apply the operation immediately.
+  // In case the replicated log is being used, `agents` is encoded
+  // along with all the changes that are queued, and written into the
+  // overlay replicated log.
   Future<bool> update(const Owned<Operation> operation)
   {
     if (replicatedLog.get() == nullptr) {
-      Try<bool> result = (*operation)(&networkState, &agents);
+      Try<bool> result = (*operation)(agents);
       if (result.isError()) {
         return Failure(
             "Unable to perform operation: " + result.error());
       }
 
+      checkpointed = agents.size();
+
       return result.get();
     }
 
@@ -1272,32 +2085,50 @@ private:
 
       CHECK_NOTNULL(replicatedLog.get());
 
-      State _networkState;
-      _networkState.CopyFrom(networkState);
-
       foreach (Owned<Operation> operation, operations) {
-        (*operation)(&_networkState, &agents);
+        (*operation)(agents);
       }
 
+      // `storingCompactState` is only cleared (hence keeps the
+      // messages it allocated) between writes. At most one write is
+      // in flight at any time.
+      agents.compact(&storingCompactState);
+
+      foreach (const Owned<Operation>& operation, operations) {
+        operation->stage(agents, &storingCompactState);
+      }
 
-      Variable<State> stateVariable = storedState.get();
-      stateVariable = stateVariable.mutate(_networkState);
+      Variable<CompactState> stateVariable = storedState.get();
+      stateVariable = stateVariable.mutate(storingCompactState);
 
-      replicatedLog->store(stateVariable)
-        .onAny(defer(self(), &ManagerProcess::_store, lambda::_1, operations));
+      ++metrics.log_stores;
+      metrics.log_store_bytes += storingCompactState.ByteSize();
+
+      metrics.log_store.time(replicatedLog->store(stateVariable))
+        .onAny(defer(self(),
+                     &ManagerProcess::_store,
+                     lambda::_1,
+                     operations,
+                     agents.size()));
 
       operations.clear();
   }
 
   void _store(
-      const Future<Option<Variable<State>>>& variable,
-      std::deque<Owned<Operation>> applied)
+      const Future<Option<Variable<CompactState>>>& variable,
+      std::deque<Owned<Operation>> applied,
+      size_t stored)
   {
     storing = false;
 
     if (!variable.isReady()) {
+      const string failure =
+        variable.isDiscarded() ? "discarded" : variable.failure();
+
       LOG(WARNING) << "Not updating `State` due to failure to write to log."
-                   << (variable.isDiscarded() ? "discarded" : variable.failure());
+                   << failure;
+
+      fail(&applied, "Unable to write to the replicated log: " + failure);
       demote();
       return;
     }
@@ -1305,34 +2136,47 @@ private:
     if (variable.get().isNone()) {
       LOG(WARNING) << "Not updating `State` since this Master might"
                    << "have been demoted.";
+
+      fail(&applied, "This Master might have been demoted");
       demote();
       return;
     }
 
     LOG(INFO) << "Stored the network state successfully";
 
-    State storedNetworkState = variable.get().get().get();
-
     VLOG(1) << "Stored the following network state:";
-    if (storedNetworkState.has_network()) {
-      VLOG(1) << "VTEP: " << storedNetworkState.network().vtep_subnet();
-      VLOG(1) << "VTEP OUI: " << storedNetworkState.network().vtep_mac_oui();
-      VLOG(1) << "Total overlays: " << storedNetworkState.network().overlays_size();
-    }
+    VLOG(1) << "VTEP: " << networkConfig.vtep_subnet();
+    VLOG(1) << "VTEP OUI: " << networkConfig.vtep_mac_oui();
+    VLOG(1) << "Total overlays: " << networkConfig.overlays_size();
 
-    if (storedNetworkState.agents_size() > 0) {
-      VLOG(1) << "Total agents: " << storedNetworkState.agents_size();
+    if (stored > 0) {
+      VLOG(1) << "Total agents: " << stored;
     }
 
-    networkState.CopyFrom(storedNetworkState);
+    // The Agents that were in `agents` when the write started are now
+    // in the replicated log.
+    checkpointed = stored;
 
     storedState = variable.get();
 
+    if (legacyState.isSome()) {
+      LOG(INFO) << "Expunging the network state stored in the legacy encoding";
+
+      replicatedLog->expunge(legacyState.get())
+        .onFailed([](const string& failure) {
+          LOG(WARNING) << "Unable to expunge the legacy network state: "
+                       << failure;
+        });
+
+      legacyState = None();
+    }
+
     // Signal all operations are complete.
     while (!applied.empty()) {
       Owned<Operation> operation = applied.front();
       applied.pop_front();
 
+      operation->commit(&agents);
       operation->set();
 
       LOG(INFO) << "Applied operation '" << *operation << "'"
@@ -1344,20 +2188,56 @@ private:
     }
   }
 
+  // Fails the operations, whose changes have not been stored, instead
+  // of leaving their callers waiting for them.
+  static void fail(std::deque<Owned<Operation>>* _operations,
+                   const string& message)
+  {
+    while (!_operations->empty()) {
+      Owned<Operation> operation = _operations->front();
+      _operations->pop_front();
+
+      operation->fail(message);
+
+      LOG(WARNING) << "Failed operation '" << *operation << "': " << message;
+    }
+  }
+
   void demote()
   {
     // Reset state of the replicated log.
     recovering = false;
     storing = false;
-    operations.clear();
+    fail(&operations, "This Master has been demoted");
     storedState = None();
+    legacyState = None();
+
+    // Registrations in flight will be restarted by the Agents once
+    // this master becomes the leader again.
+    registrations.clear();
+
+    pendingRegistrations.clear();
+    outstandingUpdates.clear();
 
     // We should forget all agents since when this master becomes
     // the leader they will re-register and get added to the
     // in-memory databse.
-    agents.clear();
-    networkState.clear_agents();
+    resetAllocations();
+
+    // In standby mode, keep the allocations warm again until this
+    // master becomes the leader, starting over from the beginning of
+    // the replicated log since they have been reset.
+    tailed = None();
 
+    if (standby && !tailing) {
+      tail();
+    }
+  }
+
+  void resetAllocations()
+  {
+    agents.clear();
+    checkpointed = 0;
 
     // While we should not clear all the overlays (since they are static) we
     // need to de-allocate the address space of the overlays so that
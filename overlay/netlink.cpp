@@ -0,0 +1,1469 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <net/if.h>
+
+#include <arpa/inet.h>
+
+#include <linux/gen_stats.h>
+#include <linux/fib_rules.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/lwtunnel.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stout/abort.hpp>
+#include <stout/error.hpp>
+#include <stout/stringify.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/open.hpp>
+#include <stout/os/strerror.hpp>
+
+#include "netlink.hpp"
+
+
+using std::string;
+using std::vector;
+
+using net::IP;
+using net::IPNetwork;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace netlink {
+
+// Size of the buffer the acknowledgements are received into.
+constexpr size_t RECEIVE_BUFFER_SIZE = 32768;
+
+// Major number of the handles of the queues of the classes, which is
+// combined with the minor number of their class.
+constexpr uint16_t LEAF_MAJOR = 0x8000;
+
+// Length of the FIFO queues of the classes, in packets. Links such as
+// bridges and VXLAN devices have no transmit queue, whose length the
+// kernel would use otherwise.
+constexpr uint32_t QUEUE_LENGTH = 1000;
+
+// Priority of the filters classifying the traffic of the overlays.
+constexpr uint32_t FILTER_PRIORITY = 1;
+
+// Bytes sent in a row at the line rate, at most, are the ones of 10
+// milliseconds at the shaped rate but no less than 10 full frames.
+constexpr uint64_t MIN_BURST = 10 * 1514;
+
+// Duration of the packets queued by a TBF qdisc, at most.
+constexpr uint64_t TBF_LATENCY_NS = 50 * 1000 * 1000;
+
+
+static uint64_t burst(uint64_t rate)
+{
+  return std::max(rate / 100, MIN_BURST);
+}
+
+
+// Time it takes to send `size` bytes at `rate`, in the ticks of the
+// packet scheduler (64 nanoseconds).
+static uint32_t ticks(uint64_t size, uint64_t rate)
+{
+  return (uint32_t) std::min<uint64_t>(
+      size * 1000000000 / std::max<uint64_t>(rate, 1) / 64,
+      UINT32_MAX);
+}
+
+
+static void ratespec(struct tc_ratespec* spec, uint64_t rate)
+{
+  spec->linklayer = TC_LINKLAYER_ETHERNET;
+  spec->rate = (uint32_t) std::min<uint64_t>(rate, UINT32_MAX);
+}
+
+
+void Batch::request(
+    const string& description,
+    uint16_t type,
+    uint16_t flags,
+    const void* header,
+    size_t length)
+{
+  last = buffer.size();
+
+  struct nlmsghdr message;
+  memset(&message, 0, sizeof(message));
+  message.nlmsg_type = type;
+  message.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  message.nlmsg_seq = descriptions.size() + 1;
+
+  descriptions.push_back(description);
+  tolerated.push_back(0);
+
+  append(&message, sizeof(message));
+  append(header, length);
+}
+
+
+void Batch::tolerate(int error)
+{
+  tolerated.back() = error;
+}
+
+
+void Batch::attribute(uint16_t type, const void* data, size_t length)
+{
+  struct rtattr attribute;
+  attribute.rta_type = type;
+  attribute.rta_len = RTA_LENGTH(length);
+
+  append(&attribute, sizeof(attribute));
+  append(data, length);
+}
+
+
+void Batch::attribute(uint16_t type, uint32_t value)
+{
+  attribute(type, &value, sizeof(value));
+}
+
+
+void Batch::attribute(uint16_t type, const string& value)
+{
+  attribute(type, value.c_str(), value.size() + 1);
+}
+
+
+size_t Batch::nest(uint16_t type)
+{
+  const size_t nested = buffer.size();
+
+  attribute(type, nullptr, 0);
+
+  return nested;
+}
+
+
+void Batch::end(size_t nested)
+{
+  struct rtattr* attribute = (struct rtattr*) &buffer[nested];
+  attribute->rta_len = buffer.size() - nested;
+}
+
+
+void Batch::data(const void* data, size_t length)
+{
+  append(data, length);
+}
+
+
+void Batch::append(const void* data, size_t length)
+{
+  const size_t offset = buffer.size();
+
+  // Every header, attribute and payload is padded to 4 bytes.
+  buffer.resize(offset + NLMSG_ALIGN(length), 0);
+
+  if (length > 0) {
+    memcpy(&buffer[offset], data, length);
+  }
+
+  struct nlmsghdr* message = (struct nlmsghdr*) &buffer[last];
+  message->nlmsg_len = buffer.size() - last;
+}
+
+
+Try<int> socket(const Option<string>& netns)
+{
+  Option<int> self = None();
+
+  if (netns.isSome()) {
+    Try<int> _self = os::open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (_self.isError()) {
+      return Error(
+          "Failed to open the network namespace: " + _self.error());
+    }
+
+    self = _self.get();
+
+    Try<int> target = os::open(netns.get(), O_RDONLY | O_CLOEXEC);
+    if (target.isError()) {
+      os::close(self.get());
+      return Error(
+          "Failed to open network namespace '" + netns.get() + "': " +
+          target.error());
+    }
+
+    if (::setns(target.get(), CLONE_NEWNET) < 0) {
+      ErrnoError error(
+          "Failed to enter network namespace '" + netns.get() + "'");
+      os::close(target.get());
+      os::close(self.get());
+      return error;
+    }
+
+    os::close(target.get());
+  }
+
+  // NOTE: The socket stays in the namespace it has been opened in.
+  int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  Option<ErrnoError> error = None();
+  if (fd < 0) {
+    error = ErrnoError("Failed to create netlink socket");
+  }
+
+  if (self.isSome()) {
+    if (::setns(self.get(), CLONE_NEWNET) < 0) {
+      // The calling thread is left in the network namespace of the
+      // container, there is no safe way to carry on.
+      ABORT("Failed to leave network namespace '" + netns.get() + "': " +
+            os::strerror(errno));
+    }
+
+    os::close(self.get());
+  }
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+
+  if (::bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    ErrnoError error("Failed to bind netlink socket");
+    os::close(fd);
+    return error;
+  }
+
+  return fd;
+}
+
+
+Try<Nothing> send(int fd, const Batch& batch)
+{
+  if (batch.size() == 0) {
+    return Nothing();
+  }
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  ssize_t sent = ::sendto(
+      fd,
+      batch.buffer.data(),
+      batch.buffer.size(),
+      0,
+      (struct sockaddr*) &kernel,
+      sizeof(kernel));
+
+  if (sent < 0) {
+    return ErrnoError("Failed to send netlink requests");
+  }
+
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+  size_t acknowledged = 0;
+  Option<Error> error = None();
+
+  while (acknowledged < batch.size()) {
+    ssize_t length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ErrnoError("Failed to receive netlink acknowledgements");
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr*) buffer.data();
+         NLMSG_OK(message, length);
+         message = NLMSG_NEXT(message, length)) {
+      if (message->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+
+      const size_t request = message->nlmsg_seq - 1;
+      if (request >= batch.size()) {
+        continue;
+      }
+
+      acknowledged++;
+
+      const int _error =
+        -((struct nlmsgerr*) NLMSG_DATA(message))->error;
+
+      if (_error != 0 &&
+          _error != batch.tolerated[request] &&
+          error.isNone()) {
+        error = Error(
+            "Failed to " + batch.descriptions[request] + ": " +
+            os::strerror(_error));
+      }
+    }
+  }
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  return Nothing();
+}
+
+
+Result<int> link(int fd, const string& name)
+{
+  struct ifinfomsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifi_family = AF_UNSPEC;
+
+  Batch batch;
+  batch.request("find link '" + name + "'", RTM_GETLINK, 0, &header,
+                sizeof(header));
+  batch.attribute(IFLA_IFNAME, name);
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  if (::sendto(
+          fd,
+          batch.buffer.data(),
+          batch.buffer.size(),
+          0,
+          (struct sockaddr*) &kernel,
+          sizeof(kernel)) < 0) {
+    return ErrnoError("Failed to send netlink request");
+  }
+
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+  Option<int> index = None();
+
+  // The link is followed by the acknowledgement of the request.
+  while (true) {
+    ssize_t length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ErrnoError("Failed to receive netlink reply");
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr*) buffer.data();
+         NLMSG_OK(message, length);
+         message = NLMSG_NEXT(message, length)) {
+      if (message->nlmsg_type == RTM_NEWLINK) {
+        index = ((struct ifinfomsg*) NLMSG_DATA(message))->ifi_index;
+        continue;
+      }
+
+      if (message->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+
+      const int error = -((struct nlmsgerr*) NLMSG_DATA(message))->error;
+
+      if (error == ENODEV) {
+        return None();
+      }
+
+      if (error != 0) {
+        return Error(
+            "Failed to find link '" + name + "': " + os::strerror(error));
+      }
+
+      if (index.isNone()) {
+        return None();
+      }
+
+      return index.get();
+    }
+  }
+}
+
+Result<int> adjacent(int fd, const IP& ip)
+{
+  struct rtmsg header;
+  memset(&header, 0, sizeof(header));
+  header.rtm_family = AF_INET;
+  header.rtm_dst_len = 32;
+
+  Batch batch;
+  batch.request("find route to " + stringify(ip), RTM_GETROUTE, 0, &header,
+                sizeof(header));
+
+  const struct in_addr in = ip.in().get();
+  batch.attribute(RTA_DST, &in, sizeof(in));
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  if (::sendto(
+          fd,
+          batch.buffer.data(),
+          batch.buffer.size(),
+          0,
+          (struct sockaddr*) &kernel,
+          sizeof(kernel)) < 0) {
+    return ErrnoError("Failed to send netlink request");
+  }
+
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+  Option<int> index = None();
+
+  // The route is followed by the acknowledgement of the request.
+  while (true) {
+    ssize_t length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ErrnoError("Failed to receive netlink reply");
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr*) buffer.data();
+         NLMSG_OK(message, length);
+         message = NLMSG_NEXT(message, length)) {
+      if (message->nlmsg_type == RTM_NEWROUTE) {
+        struct rtmsg* route = (struct rtmsg*) NLMSG_DATA(message);
+        int attributes = RTM_PAYLOAD(message);
+
+        if (route->rtm_type != RTN_UNICAST) {
+          continue;
+        }
+
+        bool gateway = false;
+        Option<int> oif = None();
+
+        for (struct rtattr* attribute = RTM_RTA(route);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == RTA_GATEWAY) {
+            gateway = true;
+          } else if (attribute->rta_type == RTA_OIF) {
+            oif = *(int*) RTA_DATA(attribute);
+          }
+        }
+
+        if (!gateway) {
+          index = oif;
+        }
+
+        continue;
+      }
+
+      if (message->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+
+      const int error = -((struct nlmsgerr*) NLMSG_DATA(message))->error;
+
+      if (error == ENETUNREACH || error == EHOSTUNREACH) {
+        return None();
+      }
+
+      if (error != 0) {
+        return Error(
+            "Failed to find route to " + stringify(ip) + ": " +
+            os::strerror(error));
+      }
+
+      if (index.isNone()) {
+        return None();
+      }
+
+      return index.get();
+    }
+  }
+}
+
+
+// Sends a dump request and hands each message of the reply to
+// `handle`, until the kernel is done.
+static Try<Nothing> dump(
+    int fd,
+    const string& description,
+    uint16_t type,
+    const void* header,
+    size_t length,
+    const std::function<void(struct nlmsghdr*)>& handle)
+{
+  vector<char> request(NLMSG_SPACE(length));
+
+  struct nlmsghdr* message = (struct nlmsghdr*) request.data();
+  message->nlmsg_len = NLMSG_LENGTH(length);
+  message->nlmsg_type = type;
+  message->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  message->nlmsg_seq = 1;
+  memcpy(NLMSG_DATA(message), header, length);
+
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+
+  if (::sendto(
+          fd,
+          request.data(),
+          request.size(),
+          0,
+          (struct sockaddr*) &kernel,
+          sizeof(kernel)) < 0) {
+    return ErrnoError("Failed to send netlink request");
+  }
+
+  vector<char> buffer(RECEIVE_BUFFER_SIZE);
+
+  // The reply comes in as many messages as it takes, followed by
+  // `NLMSG_DONE`.
+  while (true) {
+    ssize_t length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ErrnoError("Failed to receive netlink reply");
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr*) buffer.data();
+         NLMSG_OK(message, length);
+         message = NLMSG_NEXT(message, length)) {
+      if (message->nlmsg_type == NLMSG_DONE) {
+        return Nothing();
+      }
+
+      if (message->nlmsg_type == NLMSG_ERROR) {
+        const int error = -((struct nlmsgerr*) NLMSG_DATA(message))->error;
+        if (error != 0) {
+          return Error(
+              "Failed to " + description + ": " + os::strerror(error));
+        }
+
+        return Nothing();
+      }
+
+      handle(message);
+    }
+  }
+}
+
+
+Try<hashmap<string, int>> links(int fd)
+{
+  struct ifinfomsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifi_family = AF_UNSPEC;
+
+  hashmap<string, int> indexes;
+
+  Try<Nothing> dump = netlink::dump(
+      fd,
+      "list links",
+      RTM_GETLINK,
+      &header,
+      sizeof(header),
+      [&indexes](struct nlmsghdr* message) {
+        if (message->nlmsg_type != RTM_NEWLINK) {
+          return;
+        }
+
+        struct ifinfomsg* link = (struct ifinfomsg*) NLMSG_DATA(message);
+        int attributes = IFLA_PAYLOAD(message);
+
+        for (struct rtattr* attribute = IFLA_RTA(link);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == IFLA_IFNAME) {
+            indexes[(const char*) RTA_DATA(attribute)] = link->ifi_index;
+          }
+        }
+      });
+
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  return indexes;
+}
+
+
+Try<vector<IPNetwork>> routes(int fd, uint32_t table)
+{
+  struct rtmsg header;
+  memset(&header, 0, sizeof(header));
+  header.rtm_family = AF_INET;
+
+  vector<IPNetwork> destinations;
+
+  // The kernel dumps the routes of all the tables.
+  Try<Nothing> dump = netlink::dump(
+      fd,
+      "list routes",
+      RTM_GETROUTE,
+      &header,
+      sizeof(header),
+      [&destinations, table](struct nlmsghdr* message) {
+        if (message->nlmsg_type != RTM_NEWROUTE) {
+          return;
+        }
+
+        struct rtmsg* route = (struct rtmsg*) NLMSG_DATA(message);
+        int attributes = RTM_PAYLOAD(message);
+
+        if (route->rtm_family != AF_INET ||
+            route->rtm_type != RTN_UNICAST) {
+          return;
+        }
+
+        uint32_t _table = route->rtm_table;
+        struct in_addr destination;
+        destination.s_addr = INADDR_ANY;
+
+        for (struct rtattr* attribute = RTM_RTA(route);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == RTA_TABLE) {
+            _table = *(uint32_t*) RTA_DATA(attribute);
+          } else if (attribute->rta_type == RTA_DST) {
+            memcpy(&destination, RTA_DATA(attribute), sizeof(destination));
+          }
+        }
+
+        if (_table != table) {
+          return;
+        }
+
+        Try<IPNetwork> network =
+          IPNetwork::create(IP(destination), route->rtm_dst_len);
+
+        if (network.isSome()) {
+          destinations.push_back(network.get());
+        }
+      });
+
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  return destinations;
+}
+
+
+// Returns the permanent neighbours of the link `index` in the family
+// `family`, which have both an IPv4 address and a MAC: the neighbours
+// of the link for `AF_INET`, its forwarding entries for `AF_BRIDGE`.
+static Try<vector<Neighbour>> neighbours(
+    int fd,
+    int index,
+    uint8_t family,
+    const string& description)
+{
+  struct ndmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ndm_family = family;
+
+  vector<Neighbour> neighbours;
+
+  // The kernel dumps the neighbours of all the links.
+  Try<Nothing> dump = netlink::dump(
+      fd,
+      description,
+      RTM_GETNEIGH,
+      &header,
+      sizeof(header),
+      [&neighbours, index, family](struct nlmsghdr* message) {
+        if (message->nlmsg_type != RTM_NEWNEIGH) {
+          return;
+        }
+
+        struct ndmsg* neighbour = (struct ndmsg*) NLMSG_DATA(message);
+        int attributes = RTM_PAYLOAD(message);
+
+        if (neighbour->ndm_family != family ||
+            neighbour->ndm_ifindex != index ||
+            !(neighbour->ndm_state & NUD_PERMANENT)) {
+          return;
+        }
+
+        Option<IP> ip;
+        Option<net::MAC> mac;
+
+        for (struct rtattr* attribute = RTM_RTA(neighbour);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == NDA_DST &&
+              RTA_PAYLOAD(attribute) == sizeof(struct in_addr)) {
+            struct in_addr in;
+            memcpy(&in, RTA_DATA(attribute), sizeof(in));
+            ip = IP(in);
+          } else if (attribute->rta_type == NDA_LLADDR &&
+                     RTA_PAYLOAD(attribute) == 6) {
+            mac = net::MAC((const uint8_t*) RTA_DATA(attribute));
+          }
+        }
+
+        if (ip.isSome() && mac.isSome()) {
+          neighbours.push_back(Neighbour{ip.get(), mac.get()});
+        }
+      });
+
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  return neighbours;
+}
+
+
+Try<vector<Neighbour>> neighbours(int fd, int index)
+{
+  return neighbours(fd, index, AF_INET, "list neighbours");
+}
+
+
+Try<vector<Neighbour>> fdbs(int fd, int index)
+{
+  return neighbours(fd, index, AF_BRIDGE, "list forwarding entries");
+}
+
+
+Try<hashmap<string, LinkStatistics>> linkStatistics(int fd)
+{
+  struct ifinfomsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifi_family = AF_UNSPEC;
+
+  hashmap<string, LinkStatistics> statistics;
+
+  Try<Nothing> dump = netlink::dump(
+      fd,
+      "list the counters of the links",
+      RTM_GETLINK,
+      &header,
+      sizeof(header),
+      [&statistics](struct nlmsghdr* message) {
+        if (message->nlmsg_type != RTM_NEWLINK) {
+          return;
+        }
+
+        struct ifinfomsg* link = (struct ifinfomsg*) NLMSG_DATA(message);
+        int attributes = IFLA_PAYLOAD(message);
+
+        Option<string> name = None();
+        LinkStatistics _statistics;
+
+        for (struct rtattr* attribute = IFLA_RTA(link);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == IFLA_IFNAME) {
+            name = string((const char*) RTA_DATA(attribute));
+          } else if (attribute->rta_type == IFLA_STATS64) {
+            struct rtnl_link_stats64 stats;
+            memset(&stats, 0, sizeof(stats));
+            memcpy(
+                &stats,
+                RTA_DATA(attribute),
+                std::min(sizeof(stats), (size_t) RTA_PAYLOAD(attribute)));
+
+            _statistics.rxBytes = stats.rx_bytes;
+            _statistics.rxPackets = stats.rx_packets;
+            _statistics.txBytes = stats.tx_bytes;
+            _statistics.txPackets = stats.tx_packets;
+          }
+        }
+
+        if (name.isSome()) {
+          statistics[name.get()] = _statistics;
+        }
+      });
+
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  return statistics;
+}
+
+
+Try<hashmap<uint32_t, Statistics>> statistics(
+    int fd,
+    int index,
+    bool classes)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+
+  hashmap<uint32_t, Statistics> statistics;
+
+  Try<Nothing> dump = netlink::dump(
+      fd,
+      "list the " + string(classes ? "classes" : "qdiscs") + " of link " +
+        stringify(index),
+      classes ? RTM_GETTCLASS : RTM_GETQDISC,
+      &header,
+      sizeof(header),
+      [&statistics, index](struct nlmsghdr* message) {
+        if (message->nlmsg_type != RTM_NEWQDISC &&
+            message->nlmsg_type != RTM_NEWTCLASS) {
+          return;
+        }
+
+        // Dumps of the qdiscs hold the ones of every link.
+        struct tcmsg* tc = (struct tcmsg*) NLMSG_DATA(message);
+        if (tc->tcm_ifindex != index) {
+          return;
+        }
+
+        Statistics _statistics;
+        int attributes = message->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+
+        for (struct rtattr* attribute = TCA_RTA(tc);
+             RTA_OK(attribute, attributes);
+             attribute = RTA_NEXT(attribute, attributes)) {
+          if (attribute->rta_type == TCA_KIND) {
+            _statistics.kind = (const char*) RTA_DATA(attribute);
+          }
+
+          if (attribute->rta_type != TCA_STATS2) {
+            continue;
+          }
+
+          int nested = RTA_PAYLOAD(attribute);
+
+          for (struct rtattr* stats = (struct rtattr*) RTA_DATA(attribute);
+               RTA_OK(stats, nested);
+               stats = RTA_NEXT(stats, nested)) {
+            if (stats->rta_type == TCA_STATS_BASIC) {
+              struct gnet_stats_basic basic;
+              memset(&basic, 0, sizeof(basic));
+              memcpy(
+                  &basic,
+                  RTA_DATA(stats),
+                  std::min(sizeof(basic), (size_t) RTA_PAYLOAD(stats)));
+
+              _statistics.bytes = basic.bytes;
+              _statistics.packets = basic.packets;
+            } else if (stats->rta_type == TCA_STATS_QUEUE) {
+              struct gnet_stats_queue queue;
+              memset(&queue, 0, sizeof(queue));
+              memcpy(
+                  &queue,
+                  RTA_DATA(stats),
+                  std::min(sizeof(queue), (size_t) RTA_PAYLOAD(stats)));
+
+              _statistics.drops = queue.drops;
+              _statistics.overlimits = queue.overlimits;
+            }
+          }
+        }
+
+        statistics[tc->tcm_handle] = _statistics;
+      });
+
+  if (dump.isError()) {
+    return Error(dump.error());
+  }
+
+  return statistics;
+}
+
+
+void up(Batch* batch, const string& name, int index)
+{
+  struct ifinfomsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifi_family = AF_UNSPEC;
+  header.ifi_index = index;
+  header.ifi_flags = IFF_UP;
+  header.ifi_change = IFF_UP;
+
+  batch->request(
+      "set link '" + name + "' up",
+      RTM_NEWLINK,
+      0,
+      &header,
+      sizeof(header));
+}
+
+
+void address(
+    Batch* batch,
+    const string& name,
+    int index,
+    const IPNetwork& network)
+{
+  struct ifaddrmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifa_family = AF_INET;
+  header.ifa_prefixlen = network.prefix();
+  header.ifa_scope = RT_SCOPE_UNIVERSE;
+  header.ifa_index = index;
+
+  batch->request(
+      "add address " + stringify(network) + " to '" + name + "'",
+      RTM_NEWADDR,
+      NLM_F_CREATE | NLM_F_EXCL,
+      &header,
+      sizeof(header));
+
+  const struct in_addr in = network.address().in().get();
+  batch->attribute(IFA_LOCAL, &in, sizeof(in));
+  batch->attribute(IFA_ADDRESS, &in, sizeof(in));
+}
+
+
+void htb(Batch* batch, const string& name, int index, uint16_t fallback)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+  header.tcm_handle = ROOT_HANDLE;
+  header.tcm_parent = TC_H_ROOT;
+
+  // An HTB qdisc cannot be changed, the one already there is kept.
+  batch->request(
+      "set the HTB qdisc of '" + name + "'",
+      RTM_NEWQDISC,
+      NLM_F_CREATE | NLM_F_EXCL,
+      &header,
+      sizeof(header));
+  batch->tolerate(EEXIST);
+  batch->attribute(TCA_KIND, string("htb"));
+
+  struct tc_htb_glob glob;
+  memset(&glob, 0, sizeof(glob));
+  glob.version = TC_HTB_PROTOVER;
+  glob.rate2quantum = 10;
+  glob.defcls = fallback;
+
+  const size_t options = batch->nest(TCA_OPTIONS);
+  batch->attribute(TCA_HTB_INIT, &glob, sizeof(glob));
+  batch->attribute(TCA_HTB_DIRECT_QLEN, QUEUE_LENGTH);
+  batch->end(options);
+}
+
+
+void htb(
+    Batch* batch,
+    const string& name,
+    int index,
+    uint16_t minor,
+    uint64_t rate)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+  header.tcm_handle = ROOT_HANDLE | minor;
+  header.tcm_parent = ROOT_HANDLE;
+
+  batch->request(
+      "set the HTB class 1:" + stringify(minor) + " of '" + name + "'",
+      RTM_NEWTCLASS,
+      NLM_F_CREATE,
+      &header,
+      sizeof(header));
+  batch->attribute(TCA_KIND, string("htb"));
+
+  struct tc_htb_opt parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  ratespec(&parameters.rate, rate);
+  ratespec(&parameters.ceil, rate);
+  parameters.buffer = ticks(burst(rate), rate);
+  parameters.cbuffer = parameters.buffer;
+
+  const size_t options = batch->nest(TCA_OPTIONS);
+  batch->attribute(TCA_HTB_PARMS, &parameters, sizeof(parameters));
+
+  if (rate > UINT32_MAX) {
+    batch->attribute(TCA_HTB_RATE64, &rate, sizeof(rate));
+    batch->attribute(TCA_HTB_CEIL64, &rate, sizeof(rate));
+  }
+
+  batch->end(options);
+
+  // The default FIFO queue of a class is as long as the transmit queue
+  // of the link, which might have none. Its handle is `<8000 + minor>:`.
+  header.tcm_handle = (uint32_t) (LEAF_MAJOR | minor) << 16;
+  header.tcm_parent = ROOT_HANDLE | minor;
+
+  batch->request(
+      "set the queue of the HTB class 1:" + stringify(minor) + " of '" +
+        name + "'",
+      RTM_NEWQDISC,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+  batch->attribute(TCA_KIND, string("pfifo"));
+
+  struct tc_fifo_qopt fifo;
+  memset(&fifo, 0, sizeof(fifo));
+  fifo.limit = QUEUE_LENGTH;
+
+  batch->attribute(TCA_OPTIONS, &fifo, sizeof(fifo));
+}
+
+
+void classify(
+    Batch* batch,
+    const string& name,
+    int index,
+    uint16_t node,
+    uint16_t minor,
+    const IPNetwork& network,
+    bool source)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+  header.tcm_parent = ROOT_HANDLE;
+  header.tcm_info = TC_H_MAKE(FILTER_PRIORITY << 16, htons(ETH_P_IP));
+
+  // The filter has a fixed handle in the root hash table `800:` of the
+  // u32 classifier, so that setting it again is a no-op.
+  header.tcm_handle = 0x80000000 | (node & 0xfff);
+
+  batch->request(
+      "classify " + stringify(network) + " as 1:" + stringify(minor) +
+        " on '" + name + "'",
+      RTM_NEWTFILTER,
+      NLM_F_CREATE | NLM_F_EXCL,
+      &header,
+      sizeof(header));
+  batch->tolerate(EEXIST);
+  batch->attribute(TCA_KIND, string("u32"));
+
+  // A selector with a single key.
+  char selector[sizeof(struct tc_u32_sel) + sizeof(struct tc_u32_key)];
+  memset(selector, 0, sizeof(selector));
+
+  struct tc_u32_sel* _selector = (struct tc_u32_sel*) selector;
+  _selector->flags = TC_U32_TERMINAL;
+  _selector->nkeys = 1;
+
+  // Offsets of the source and destination addresses in the IPv4
+  // header.
+  struct tc_u32_key* key = _selector->keys;
+  key->off = source ? 12 : 16;
+  key->mask = network.netmask().in()->s_addr;
+  key->val = network.address().in()->s_addr & key->mask;
+
+  const size_t options = batch->nest(TCA_OPTIONS);
+  batch->attribute(TCA_U32_CLASSID, ROOT_HANDLE | minor);
+  batch->attribute(TCA_U32_SEL, selector, sizeof(selector));
+  batch->end(options);
+}
+
+
+void tbf(Batch* batch, const string& name, int index, uint64_t rate)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+  header.tcm_handle = ROOT_HANDLE;
+  header.tcm_parent = TC_H_ROOT;
+
+  batch->request(
+      "set the TBF qdisc of '" + name + "'",
+      RTM_NEWQDISC,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+  batch->attribute(TCA_KIND, string("tbf"));
+
+  const uint64_t size = burst(rate);
+
+  struct tc_tbf_qopt parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  ratespec(&parameters.rate, rate);
+  parameters.buffer = ticks(size, rate);
+  parameters.limit = (uint32_t) std::min<uint64_t>(
+      rate * TBF_LATENCY_NS / 1000000000 + size,
+      UINT32_MAX);
+
+  const size_t options = batch->nest(TCA_OPTIONS);
+  batch->attribute(TCA_TBF_PARMS, &parameters, sizeof(parameters));
+
+  if (rate > UINT32_MAX) {
+    batch->attribute(TCA_TBF_RATE64, &rate, sizeof(rate));
+  }
+
+  batch->attribute(TCA_TBF_BURST, (uint32_t) size);
+  batch->end(options);
+}
+
+
+void unshape(Batch* batch, const string& name, int index)
+{
+  struct tcmsg header;
+  memset(&header, 0, sizeof(header));
+  header.tcm_family = AF_UNSPEC;
+  header.tcm_ifindex = index;
+  header.tcm_parent = TC_H_ROOT;
+
+  // Links without a root qdisc have the default one, which cannot be
+  // removed.
+  batch->request(
+      "remove the root qdisc of '" + name + "'",
+      RTM_DELQDISC,
+      0,
+      &header,
+      sizeof(header));
+  batch->tolerate(ENOENT);
+}
+
+
+
+void rule(
+    Batch* batch,
+    const IPNetwork& destination,
+    uint32_t table,
+    uint32_t priority)
+{
+  struct fib_rule_hdr header;
+  memset(&header, 0, sizeof(header));
+  header.family = AF_INET;
+  header.dst_len = destination.prefix();
+  header.table = table < 256 ? table : RT_TABLE_UNSPEC;
+  header.action = FR_ACT_TO_TBL;
+
+  batch->request(
+      "add rule to " + stringify(destination) + " for table " +
+      stringify(table),
+      RTM_NEWRULE,
+      NLM_F_CREATE | NLM_F_EXCL,
+      &header,
+      sizeof(header));
+  batch->tolerate(EEXIST);
+
+  const struct in_addr in = destination.address().in().get();
+  batch->attribute(FRA_DST, &in, sizeof(in));
+  batch->attribute(FRA_TABLE, table);
+  batch->attribute(FRA_PRIORITY, priority);
+}
+
+
+void route(
+    Batch* batch,
+    const IPNetwork& destination,
+    const IP& gateway,
+    int index,
+    uint32_t table)
+{
+  struct rtmsg header;
+  memset(&header, 0, sizeof(header));
+  header.rtm_family = AF_INET;
+  header.rtm_dst_len = destination.prefix();
+  header.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+  header.rtm_protocol = RTPROT_BOOT;
+  header.rtm_scope = RT_SCOPE_UNIVERSE;
+  header.rtm_type = RTN_UNICAST;
+
+  batch->request(
+      "replace route to " + stringify(destination) + " via " +
+      stringify(gateway) + " in table " + stringify(table),
+      RTM_NEWROUTE,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+
+  const struct in_addr in = destination.address().in().get();
+  batch->attribute(RTA_DST, &in, sizeof(in));
+
+  const struct in_addr via = gateway.in().get();
+  batch->attribute(RTA_GATEWAY, &via, sizeof(via));
+  batch->attribute(RTA_OIF, (uint32_t) index);
+  batch->attribute(RTA_TABLE, table);
+}
+
+
+void unroute(Batch* batch, const IPNetwork& destination, uint32_t table)
+{
+  struct rtmsg header;
+  memset(&header, 0, sizeof(header));
+  header.rtm_family = AF_INET;
+  header.rtm_dst_len = destination.prefix();
+  header.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+  header.rtm_scope = RT_SCOPE_NOWHERE;
+
+  batch->request(
+      "remove route to " + stringify(destination) + " from table " +
+      stringify(table),
+      RTM_DELROUTE,
+      0,
+      &header,
+      sizeof(header));
+  batch->tolerate(ESRCH);
+
+  const struct in_addr in = destination.address().in().get();
+  batch->attribute(RTA_DST, &in, sizeof(in));
+  batch->attribute(RTA_TABLE, table);
+}
+
+
+Try<int> geneve(int fd, const string& name, const net::MAC& mac, uint32_t mtu)
+{
+  Result<int> index = link(fd, name);
+  if (index.isSome()) {
+    return index.get();
+  }
+
+  if (index.isError()) {
+    return Error(index.error());
+  }
+
+  struct ifinfomsg header;
+  memset(&header, 0, sizeof(header));
+  header.ifi_family = AF_UNSPEC;
+
+  uint8_t address[6];
+  for (size_t i = 0; i < sizeof(address); i++) {
+    address[i] = mac[i];
+  }
+
+  const uint16_t port = htons(GENEVE_PORT);
+
+  Batch batch;
+  batch.request(
+      "create Geneve device '" + name + "'",
+      RTM_NEWLINK,
+      NLM_F_CREATE | NLM_F_EXCL,
+      &header,
+      sizeof(header));
+  batch.tolerate(EEXIST);
+  batch.attribute(IFLA_IFNAME, name);
+  batch.attribute(IFLA_MTU, mtu);
+  batch.attribute(IFLA_ADDRESS, address, sizeof(address));
+
+  const size_t linkinfo = batch.nest(IFLA_LINKINFO);
+  batch.attribute(IFLA_INFO_KIND, string("geneve"));
+
+  const size_t data = batch.nest(IFLA_INFO_DATA);
+  batch.attribute(IFLA_GENEVE_PORT, &port, sizeof(port));
+  batch.attribute(IFLA_GENEVE_COLLECT_METADATA, nullptr, 0);
+  batch.end(data);
+
+  batch.end(linkinfo);
+
+  Try<Nothing> send = netlink::send(fd, batch);
+  if (send.isError()) {
+    return Error(send.error());
+  }
+
+  index = link(fd, name);
+  if (!index.isSome()) {
+    return Error(
+        "Failed to find Geneve device '" + name + "': " +
+        (index.isError() ? index.error() : "not found"));
+  }
+
+  return index.get();
+}
+
+
+void neighbour(Batch* batch, const IP& ip, const net::MAC& mac, int index)
+{
+  struct ndmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ndm_family = AF_INET;
+  header.ndm_ifindex = index;
+  header.ndm_state = NUD_PERMANENT;
+
+  batch->request(
+      "replace neighbour " + stringify(ip) + " at " + stringify(mac),
+      RTM_NEWNEIGH,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+
+  uint8_t address[6];
+  for (size_t i = 0; i < sizeof(address); i++) {
+    address[i] = mac[i];
+  }
+
+  const struct in_addr in = ip.in().get();
+  batch->attribute(NDA_DST, &in, sizeof(in));
+  batch->attribute(NDA_LLADDR, address, sizeof(address));
+}
+
+
+void tunnel(
+    Batch* batch,
+    const IPNetwork& destination,
+    const Option<IP>& gateway,
+    int index,
+    uint32_t table,
+    uint32_t vni,
+    const IP& remote,
+    const Option<uint32_t>& tenant)
+{
+  struct rtmsg header;
+  memset(&header, 0, sizeof(header));
+  header.rtm_family = AF_INET;
+  header.rtm_dst_len = destination.prefix();
+  header.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+  header.rtm_protocol = RTPROT_BOOT;
+  header.rtm_type = RTN_UNICAST;
+
+  // Without a gateway the destination is on the link, e.g. the VTEP of
+  // a peer.
+  if (gateway.isSome()) {
+    header.rtm_scope = RT_SCOPE_UNIVERSE;
+    header.rtm_flags = RTNH_F_ONLINK;
+  } else {
+    header.rtm_scope = RT_SCOPE_LINK;
+  }
+
+  batch->request(
+      "replace route to " + stringify(destination) + " through the tunnel "
+      "to " + stringify(remote) + " in table " + stringify(table),
+      RTM_NEWROUTE,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+
+  const struct in_addr in = destination.address().in().get();
+  batch->attribute(RTA_DST, &in, sizeof(in));
+
+  if (gateway.isSome()) {
+    const struct in_addr via = gateway->in().get();
+    batch->attribute(RTA_GATEWAY, &via, sizeof(via));
+  }
+
+  batch->attribute(RTA_OIF, (uint32_t) index);
+  batch->attribute(RTA_TABLE, table);
+
+  const uint16_t type = LWTUNNEL_ENCAP_IP;
+  batch->attribute(RTA_ENCAP_TYPE, &type, sizeof(type));
+
+  const size_t encap = batch->nest(RTA_ENCAP);
+
+  const uint64_t id = htobe64(vni);
+  batch->attribute(LWTUNNEL_IP_ID, &id, sizeof(id));
+
+  const struct in_addr dst = remote.in().get();
+  batch->attribute(LWTUNNEL_IP_DST, &dst, sizeof(dst));
+
+  // The kernel only takes the options nested with `NLA_F_NESTED`.
+  if (tenant.isSome()) {
+    const size_t options = batch->nest(LWTUNNEL_IP_OPTS | NLA_F_NESTED);
+    const size_t option =
+      batch->nest(LWTUNNEL_IP_OPTS_GENEVE | NLA_F_NESTED);
+
+    const uint16_t _class = htons(GENEVE_TENANT_CLASS);
+    const uint8_t _type = GENEVE_TENANT_TYPE;
+    const uint32_t data = htonl(tenant.get());
+
+    batch->attribute(LWTUNNEL_IP_OPT_GENEVE_CLASS, &_class, sizeof(_class));
+    batch->attribute(LWTUNNEL_IP_OPT_GENEVE_TYPE, &_type, sizeof(_type));
+    batch->attribute(LWTUNNEL_IP_OPT_GENEVE_DATA, &data, sizeof(data));
+
+    batch->end(option);
+    batch->end(options);
+  }
+
+  batch->end(encap);
+}
+
+
+void unneighbour(Batch* batch, const IP& ip, int index)
+{
+  struct ndmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ndm_family = AF_INET;
+  header.ndm_ifindex = index;
+
+  batch->request(
+      "remove neighbour " + stringify(ip),
+      RTM_DELNEIGH,
+      0,
+      &header,
+      sizeof(header));
+  batch->tolerate(ENOENT);
+
+  const struct in_addr in = ip.in().get();
+  batch->attribute(NDA_DST, &in, sizeof(in));
+}
+
+
+void fdb(Batch* batch, const net::MAC& mac, const IP& remote, int index)
+{
+  struct ndmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ndm_family = AF_BRIDGE;
+  header.ndm_ifindex = index;
+  header.ndm_state = NUD_PERMANENT;
+  header.ndm_flags = NTF_SELF;
+
+  batch->request(
+      "replace forwarding entry of " + stringify(mac) + " to " +
+      stringify(remote),
+      RTM_NEWNEIGH,
+      NLM_F_CREATE | NLM_F_REPLACE,
+      &header,
+      sizeof(header));
+
+  uint8_t address[6];
+  for (size_t i = 0; i < sizeof(address); i++) {
+    address[i] = mac[i];
+  }
+
+  const struct in_addr in = remote.in().get();
+  batch->attribute(NDA_LLADDR, address, sizeof(address));
+  batch->attribute(NDA_DST, &in, sizeof(in));
+}
+
+
+void unfdb(Batch* batch, const net::MAC& mac, const IP& remote, int index)
+{
+  struct ndmsg header;
+  memset(&header, 0, sizeof(header));
+  header.ndm_family = AF_BRIDGE;
+  header.ndm_ifindex = index;
+  header.ndm_flags = NTF_SELF;
+
+  batch->request(
+      "remove forwarding entry of " + stringify(mac) + " to " +
+      stringify(remote),
+      RTM_DELNEIGH,
+      0,
+      &header,
+      sizeof(header));
+  batch->tolerate(ENOENT);
+
+  uint8_t address[6];
+  for (size_t i = 0; i < sizeof(address); i++) {
+    address[i] = mac[i];
+  }
+
+  const struct in_addr in = remote.in().get();
+  batch->attribute(NDA_LLADDR, address, sizeof(address));
+  batch->attribute(NDA_DST, &in, sizeof(in));
+}
+
+} // namespace netlink {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,298 @@
+#ifndef __OVERLAY_NETLINK_HPP__
+#define __OVERLAY_NETLINK_HPP__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/mac.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/try.hpp>
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace netlink {
+
+// Handle of the root qdiscs set to shape the egress of links, `1:`.
+// The handles of their classes are `ROOT_HANDLE | minor`.
+constexpr uint32_t ROOT_HANDLE = 0x10000;
+
+// UDP port of the Geneve tunnels, and the Geneve option the tenant of
+// the tunneled traffic is tagged with, in the class reserved for
+// experimental use.
+constexpr uint16_t GENEVE_PORT = 6081;
+constexpr uint16_t GENEVE_TENANT_CLASS = 0xff00;
+constexpr uint8_t GENEVE_TENANT_TYPE = 0x01;
+
+
+// Counters of a qdisc or a traffic class.
+struct Statistics
+{
+  Statistics() : bytes(0), packets(0), drops(0), overlimits(0) {}
+
+  std::string kind;
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t drops;
+  uint64_t overlimits;
+};
+
+
+// Counters of a link.
+struct LinkStatistics
+{
+  LinkStatistics()
+    : rxBytes(0), rxPackets(0), txBytes(0), txPackets(0) {}
+
+  uint64_t rxBytes;
+  uint64_t rxPackets;
+  uint64_t txBytes;
+  uint64_t txPackets;
+};
+
+
+// A permanent neighbour of a link, or a permanent forwarding entry of a
+// VxLAN device, which sends the frames to `mac` to the VTEP at `ip`.
+struct Neighbour
+{
+  net::IP ip;
+  net::MAC mac;
+};
+
+
+// A batch of rtnetlink requests, sent to the kernel with a single
+// `sendmsg` and acknowledged all at once. The kernel handles the
+// requests in order, and a request that fails does not stop the ones
+// after it.
+class Batch
+{
+public:
+  Batch() : last(0) {}
+
+  // Appends a request along with its fixed header (e.g. a `struct
+  // ifinfomsg`). The attributes added next belong to it. The
+  // description is used in the error of a failed request.
+  void request(
+      const std::string& description,
+      uint16_t type,
+      uint16_t flags,
+      const void* header,
+      size_t length);
+
+  // An error (a positive `errno` value) with which the last request
+  // still succeeds, e.g. `EEXIST` for an address that might have been
+  // set already.
+  void tolerate(int error);
+
+  void attribute(uint16_t type, const void* data, size_t length);
+  void attribute(uint16_t type, uint32_t value);
+  void attribute(uint16_t type, const std::string& value);
+
+  // Starts a nested attribute, holding the attributes and the data
+  // added until it is ended.
+  size_t nest(uint16_t type);
+  void end(size_t nested);
+
+  // Appends data to the payload of the last request or nested
+  // attribute, e.g. the `struct ifinfomsg` of a veth peer.
+  void data(const void* data, size_t length);
+
+  size_t size() const { return descriptions.size(); }
+
+private:
+  friend Try<Nothing> send(int fd, const Batch& batch);
+  friend Result<int> link(int fd, const std::string& name);
+  friend Result<int> adjacent(int fd, const net::IP& ip);
+
+  void append(const void* data, size_t length);
+
+  std::vector<char> buffer;
+
+  // Offset of the last request in `buffer`.
+  size_t last;
+
+  std::vector<std::string> descriptions;
+  std::vector<int> tolerated;
+};
+
+
+// Opens an rtnetlink socket, in the network namespace at `netns` if
+// any. The calling thread enters the namespace to open the socket and
+// goes back to its own namespace right after.
+Try<int> socket(const Option<std::string>& netns = None());
+
+// Sends the requests of a batch and waits for all of them to be
+// acknowledged. Returns the error of the first request that failed.
+Try<Nothing> send(int fd, const Batch& batch);
+
+// Returns the index of a link, none if there is no such link.
+Result<int> link(int fd, const std::string& name);
+
+// Returns the indexes of all the links, by name.
+Try<hashmap<std::string, int>> links(int fd);
+
+// Returns the index of the link `ip` is directly reachable on, or
+// `None` if the route to `ip` goes through a gateway, or is not a
+// unicast route (e.g. `ip` is an address of the host).
+Result<int> adjacent(int fd, const net::IP& ip);
+
+// Returns the destinations of the IPv4 unicast routes of the routing
+// table `table`.
+Try<std::vector<net::IPNetwork>> routes(int fd, uint32_t table);
+
+// Returns the permanent IPv4 neighbours of the link `index`.
+Try<std::vector<Neighbour>> neighbours(int fd, int index);
+
+// Returns the permanent forwarding entries of the VxLAN device `index`
+// that have a remote VTEP.
+Try<std::vector<Neighbour>> fdbs(int fd, int index);
+
+// Returns the counters of all the links, by name.
+Try<hashmap<std::string, LinkStatistics>> linkStatistics(int fd);
+
+// Returns the counters of the qdiscs of a link, or of its traffic
+// classes if `classes`, by handle.
+Try<hashmap<uint32_t, Statistics>> statistics(
+    int fd,
+    int index,
+    bool classes);
+
+
+// Builders of the requests that configure a link, shared by the overlay
+// CNI plugin and by the Agent module for its Geneve VTEP.
+
+void up(Batch* batch, const std::string& name, int index);
+
+void address(
+    Batch* batch,
+    const std::string& name,
+    int index,
+    const net::IPNetwork& network);
+
+
+// Builders of the traffic control requests that shape the egress of a
+// link, with rates in bytes per second. The root qdiscs have the
+// handle `1:`, the classes `1:<minor>` with a minor below `8000`.
+
+// Sets an HTB qdisc as the root of a link, sending the traffic that no
+// filter classifies to the class `1:<fallback>`, or unshaped if
+// `fallback` is 0. An HTB qdisc already there is kept, as it is.
+void htb(Batch* batch, const std::string& name, int index, uint16_t fallback);
+
+// Sets the class `1:<minor>` of the HTB qdisc of a link, limited to
+// `rate`, along with the FIFO queue of the class (two requests).
+void htb(
+    Batch* batch,
+    const std::string& name,
+    int index,
+    uint16_t minor,
+    uint64_t rate);
+
+// Sends the IPv4 packets from (or to, unless `source`) `network` to the
+// class `1:<minor>`, with the filter `800::<node>` of the root qdisc.
+void classify(
+    Batch* batch,
+    const std::string& name,
+    int index,
+    uint16_t node,
+    uint16_t minor,
+    const net::IPNetwork& network,
+    bool source);
+
+// Sets a TBF qdisc as the root of a link, limiting it to `rate`.
+void tbf(Batch* batch, const std::string& name, int index, uint64_t rate);
+
+// Removes the root qdisc of a link, if it has one.
+void unshape(Batch* batch, const std::string& name, int index);
+
+
+// Builders of the policy routing requests that route the overlays
+// directly to the Agents on the same L2 segment. The routing tables
+// above 255 are supported.
+
+// Looks the packets to `destination` up in the routing table `table`,
+// with the rule priority `priority`. A rule already there is kept.
+void rule(
+    Batch* batch,
+    const net::IPNetwork& destination,
+    uint32_t table,
+    uint32_t priority);
+
+// Routes `destination` via `gateway` on the link `index`, in the
+// routing table `table`, replacing the route already there.
+void route(
+    Batch* batch,
+    const net::IPNetwork& destination,
+    const net::IP& gateway,
+    int index,
+    uint32_t table);
+
+// Removes the route to `destination` from the routing table `table`,
+// if it is there.
+void unroute(
+    Batch* batch,
+    const net::IPNetwork& destination,
+    uint32_t table);
+
+
+// Geneve tunnels. The VTEP is a Geneve device in external mode, the
+// tunnel of each destination is carried by its route.
+
+// Returns the index of a Geneve device in external mode, which is
+// created with the MAC `mac` if it is not there.
+Try<int> geneve(
+    int fd,
+    const std::string& name,
+    const net::MAC& mac,
+    uint32_t mtu);
+
+// Sets the MAC of `ip` on the link `index`, replacing the neighbour
+// already there.
+void neighbour(Batch* batch, const net::IP& ip, const net::MAC& mac, int index);
+
+// Routes `destination` on the link `index` through the tunnel `vni` to
+// `remote`, in the routing table `table`, replacing the route already
+// there. The route goes via `gateway` if any, which is taken to be on
+// the link. The tunneled packets are tagged with `tenant` if any.
+void tunnel(
+    Batch* batch,
+    const net::IPNetwork& destination,
+    const Option<net::IP>& gateway,
+    int index,
+    uint32_t table,
+    uint32_t vni,
+    const net::IP& remote,
+    const Option<uint32_t>& tenant);
+
+
+// Builders of the requests that suppress the ARP requests of the
+// VxLAN VTEP, with the neighbours set ahead of time.
+
+// Removes the neighbour `ip` of the link `index`, if it is there.
+void unneighbour(Batch* batch, const net::IP& ip, int index);
+
+// Forwards the frames to `mac` through the VxLAN device `index` to the
+// VTEP at `remote`, replacing the forwarding entry already there.
+void fdb(Batch* batch, const net::MAC& mac, const net::IP& remote, int index);
+
+// Removes the forwarding entry of `mac` to `remote` from the VxLAN
+// device `index`, if it is there.
+void unfdb(
+    Batch* batch,
+    const net::MAC& mac,
+    const net::IP& remote,
+    int index);
+
+} // namespace netlink {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_NETLINK_HPP__
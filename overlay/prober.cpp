@@ -0,0 +1,380 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+
+#include <process/clock.hpp>
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/id.hpp>
+#include <process/io.hpp>
+
+#include <process/metrics/metrics.hpp>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashset.hpp>
+#include <stout/lambda.hpp>
+#include <stout/stringify.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/strerror.hpp>
+
+#include "prober.hpp"
+
+
+namespace io = process::io;
+
+using std::string;
+using std::vector;
+
+using process::Clock;
+using process::defer;
+using process::delay;
+using process::Failure;
+using process::Future;
+using process::Owned;
+using process::Time;
+
+using process::metrics::Gauge;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// Size of the payload of the echo requests, as the one of `ping -s 8`.
+constexpr size_t PROBE_PAYLOAD = 8;
+
+// Size of the buffer the replies are received in. The longer messages
+// are truncated, which leaves their headers intact.
+constexpr size_t PROBE_BUFFER = 512;
+
+
+// Internet checksum of `length` bytes, see RFC 1071.
+static uint16_t checksum(const void* data, size_t length)
+{
+  const uint8_t* bytes = (const uint8_t*) data;
+
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < length; i += 2) {
+    sum += (bytes[i] << 8) | bytes[i + 1];
+  }
+
+  if (length % 2 == 1) {
+    sum += bytes[length - 1] << 8;
+  }
+
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return htons(~sum & 0xffff);
+}
+
+
+ProberProcess::ProberProcess(
+    int _fd,
+    const Duration& _interval,
+    const Duration& _timeout,
+    size_t _window)
+  : ProcessBase(process::ID::generate("overlay-prober")),
+    fd(_fd),
+    interval(_interval),
+    timeout(_timeout),
+    window(_window),
+    identifier(::getpid() & 0xffff),
+    sequence(0) {}
+
+
+Try<Owned<ProberProcess>> ProberProcess::create(
+    const Duration& interval,
+    const Duration& timeout,
+    size_t window)
+{
+  if (timeout >= interval) {
+    return Error("The timeout of the probes must be below their interval");
+  }
+
+  if (window == 0) {
+    return Error("The window of the probes cannot be empty");
+  }
+
+  // NOTE: A raw socket receives a copy of all the ICMP messages for the
+  // host, the replies to other probers are told apart by identifier.
+  int fd = ::socket(
+      AF_INET,
+      SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+      IPPROTO_ICMP);
+
+  if (fd < 0) {
+    return ErrnoError("Failed to create ICMP socket");
+  }
+
+  return Owned<ProberProcess>(
+      new ProberProcess(fd, interval, timeout, window));
+}
+
+
+ProberProcess::~ProberProcess()
+{
+  os::close(fd);
+}
+
+
+void ProberProcess::initialize()
+{
+  receive();
+
+  delay(interval, self(), &ProberProcess::probe);
+}
+
+
+void ProberProcess::finalize()
+{
+  polling.discard();
+
+  foreachvalue (const Target& target, targets) {
+    foreach (const Gauge& gauge, target.gauges) {
+      process::metrics::remove(gauge);
+    }
+  }
+}
+
+
+void ProberProcess::update(const vector<net::IP>& peers)
+{
+  hashset<string> keys;
+
+  foreach (const net::IP& ip, peers) {
+    const string key = stringify(ip);
+    keys.insert(key);
+
+    if (targets.contains(key)) {
+      continue;
+    }
+
+    Target target;
+    target.ip = ip.in().get().s_addr;
+
+    const string prefix = "overlay/agent/probes/" + key + "/";
+
+    target.gauges.push_back(Gauge(
+        prefix + "latency_ms",
+        defer(self(), &ProberProcess::_latency, key)));
+
+    target.gauges.push_back(Gauge(
+        prefix + "loss_percent",
+        defer(self(), &ProberProcess::_loss, key)));
+
+    foreach (const Gauge& gauge, target.gauges) {
+      process::metrics::add(gauge);
+    }
+
+    targets.put(key, target);
+  }
+
+  foreach (const string& key, targets.keys()) {
+    if (keys.contains(key)) {
+      continue;
+    }
+
+    foreach (const Gauge& gauge, targets.at(key).gauges) {
+      process::metrics::remove(gauge);
+    }
+
+    targets.erase(key);
+  }
+}
+
+
+void ProberProcess::probe()
+{
+  foreachvalue (const Probe& probe, pending) {
+    record(probe.target, None());
+  }
+
+  pending.clear();
+
+  foreachpair (const string& key, const Target& target, targets) {
+    uint8_t packet[sizeof(struct icmphdr) + PROBE_PAYLOAD];
+    memset(packet, 0, sizeof(packet));
+
+    struct icmphdr* header = (struct icmphdr*) packet;
+    header->type = ICMP_ECHO;
+    header->un.echo.id = htons(identifier);
+    header->un.echo.sequence = htons(++sequence);
+    header->checksum = checksum(packet, sizeof(packet));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = target.ip;
+
+    Probe probe;
+    probe.target = key;
+    probe.sent = Clock::now();
+
+    // A probe that cannot be sent, e.g. because the VTEP is not there
+    // yet, is lost.
+    ssize_t sent = ::sendto(
+        fd,
+        packet,
+        sizeof(packet),
+        0,
+        (struct sockaddr*) &address,
+        sizeof(address));
+
+    if (sent < 0) {
+      VLOG(1) << "Failed to probe " << key << ": " << os::strerror(errno);
+    }
+
+    pending.put(sequence, probe);
+  }
+
+  delay(interval, self(), &ProberProcess::probe);
+}
+
+
+void ProberProcess::receive()
+{
+  polling = io::poll(fd, io::READ);
+  polling.onAny(defer(self(), &ProberProcess::_receive, lambda::_1));
+}
+
+
+void ProberProcess::_receive(const Future<short>& ready)
+{
+  if (!ready.isReady()) {
+    if (ready.isFailed()) {
+      LOG(ERROR) << "Failed to wait for ICMP replies: " << ready.failure();
+    }
+
+    return;
+  }
+
+  const Time now = Clock::now();
+
+  while (true) {
+    uint8_t packet[PROBE_BUFFER];
+
+    ssize_t length = ::recv(fd, packet, sizeof(packet), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(ERROR) << "Failed to receive ICMP replies";
+      }
+
+      break;
+    }
+
+    // The messages received on a raw socket start with their IP header.
+    const struct iphdr* ip = (const struct iphdr*) packet;
+    if ((size_t) length < sizeof(struct iphdr) ||
+        (size_t) length < ip->ihl * 4 + sizeof(struct icmphdr)) {
+      continue;
+    }
+
+    const struct icmphdr* header =
+      (const struct icmphdr*) (packet + ip->ihl * 4);
+
+    if (header->type != ICMP_ECHOREPLY ||
+        ntohs(header->un.echo.id) != identifier) {
+      continue;
+    }
+
+    const uint16_t _sequence = ntohs(header->un.echo.sequence);
+    if (!pending.contains(_sequence)) {
+      continue;
+    }
+
+    const Probe probe = pending.at(_sequence);
+    pending.erase(_sequence);
+
+    // A reply that comes after the timeout is as good as lost.
+    const Duration rtt = now - probe.sent;
+    record(probe.target, rtt <= timeout ? Option<Duration>(rtt) : None());
+  }
+
+  receive();
+}
+
+
+void ProberProcess::record(
+    const string& target,
+    const Option<Duration>& outcome)
+{
+  // The target may have been removed since it was probed.
+  if (!targets.contains(target)) {
+    return;
+  }
+
+  std::deque<Option<Duration>>& outcomes = targets.at(target).outcomes;
+
+  outcomes.push_back(outcome);
+  if (outcomes.size() > window) {
+    outcomes.pop_front();
+  }
+}
+
+
+// The latency of a target that has not answered any of its latest
+// probes is unknown, and left out of the snapshot of the metrics.
+Future<double> ProberProcess::_latency(const string& target)
+{
+  if (!targets.contains(target)) {
+    return Failure("Unknown target");
+  }
+
+  Duration total = Duration::zero();
+  size_t replies = 0;
+
+  foreach (const Option<Duration>& outcome, targets.at(target).outcomes) {
+    if (outcome.isSome()) {
+      total += outcome.get();
+      replies++;
+    }
+  }
+
+  if (replies == 0) {
+    return Failure("No replies");
+  }
+
+  return total.ms() / replies;
+}
+
+
+double ProberProcess::_loss(const string& target)
+{
+  if (!targets.contains(target) || targets.at(target).outcomes.empty()) {
+    return 0;
+  }
+
+  const std::deque<Option<Duration>>& outcomes =
+    targets.at(target).outcomes;
+
+  size_t lost = 0;
+  foreach (const Option<Duration>& outcome, outcomes) {
+    if (outcome.isNone()) {
+      lost++;
+    }
+  }
+
+  return 100.0 * lost / outcomes.size();
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,112 @@
+#ifndef __OVERLAY_PROBER_HPP__
+#define __OVERLAY_PROBER_HPP__
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
+#include <process/time.hpp>
+
+#include <process/metrics/gauge.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// Prober of the VTEPs of other Agents. Every `interval` it sends an
+// ICMP echo request to each of its targets, which goes through the
+// VTEP of the Agent and is answered by the kernel of the peer, and
+// keeps the outcome of the latest `window` probes of each target. The
+// latency and the loss of each target are exported as the gauges
+// `overlay/agent/probes/<ip>/...`.
+class ProberProcess : public process::Process<ProberProcess>
+{
+public:
+  static Try<process::Owned<ProberProcess>> create(
+      const Duration& interval,
+      const Duration& timeout,
+      size_t window);
+
+  virtual ~ProberProcess();
+
+  // Sets the VTEP IPs probed. The outcomes of the targets that were
+  // already probed are kept.
+  void update(const std::vector<net::IP>& peers);
+
+protected:
+  virtual void initialize();
+  virtual void finalize();
+
+private:
+  struct Target
+  {
+    // VTEP IP of the peer in network byte order.
+    uint32_t ip;
+
+    // Round-trip time of the latest probes, `None` for the lost ones,
+    // the oldest first.
+    std::deque<Option<Duration>> outcomes;
+
+    std::vector<process::metrics::Gauge> gauges;
+  };
+
+  // A probe that has not been answered yet.
+  struct Probe
+  {
+    std::string target;
+    process::Time sent;
+  };
+
+  ProberProcess(
+      int fd,
+      const Duration& interval,
+      const Duration& timeout,
+      size_t window);
+
+  // Sends a round of probes, after recording the probes of the
+  // previous round that are still pending as lost.
+  void probe();
+
+  void receive();
+  void _receive(const process::Future<short>& ready);
+
+  void record(const std::string& target, const Option<Duration>& outcome);
+
+  process::Future<double> _latency(const std::string& target);
+  double _loss(const std::string& target);
+
+  const int fd;
+  const Duration interval;
+  const Duration timeout;
+  const size_t window;
+
+  // Identifier of the echo requests of the prober.
+  const uint16_t identifier;
+  uint16_t sequence;
+
+  process::Future<short> polling;
+
+  // Targets by VTEP IP, and pending probes by sequence.
+  hashmap<std::string, Target> targets;
+  hashmap<uint16_t, Probe> pending;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_PROBER_HPP__
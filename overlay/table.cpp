@@ -0,0 +1,478 @@
+#include <string>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/stringify.hpp>
+
+#include "compact.hpp"
+#include "table.hpp"
+
+using std::string;
+using std::vector;
+
+using net::IP;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+AgentTable::AgentTable(
+    const NetworkConfig& network,
+    uint32_t vni,
+    const string& vtepName)
+{
+  header.mutable_network()->CopyFrom(network);
+  header.set_vni(vni);
+  header.set_vtep_name(vtepName);
+
+  for (int i = 0; i < network.overlays_size(); i++) {
+    overlays[network.overlays(i).name()] = i;
+  }
+}
+
+
+Option<uint16_t> AgentTable::getOverlay(const string& name) const
+{
+  if (!overlays.contains(name)) {
+    return None();
+  }
+
+  return overlays.at(name);
+}
+
+
+const OverlayInfo& AgentTable::getOverlayInfo(uint16_t overlay) const
+{
+  return header.network().overlays(overlay);
+}
+
+
+Option<string> AgentTable::getTopology(const AgentRecord& agent) const
+{
+  if (agent.topology < 0) {
+    return None();
+  }
+
+  return header.topologies(agent.topology);
+}
+
+
+AgentRecord* AgentTable::add(
+    const IP& ip,
+    const IP& vtepIP,
+    const Option<string>& topology)
+{
+  AgentRecord agent;
+  agent.ip = ntohl(ip.in().get().s_addr);
+  agent.vtepIP = ntohl(vtepIP.in().get().s_addr);
+  agent.topology = -1;
+  agent.hostGw = false;
+
+  if (topology.isSome()) {
+    if (!topologies.contains(topology.get())) {
+      topologies[topology.get()] = header.topologies_size();
+      header.add_topologies(topology.get());
+    }
+
+    agent.topology = topologies.at(topology.get());
+  }
+
+  // Agents restored from a network state stored before they had any
+  // overlays have no VTEP IP.
+  if (agent.vtepIP != 0) {
+    Range range;
+    range.last = agent.vtepIP;
+    range.agent = agents.size();
+    range.overlay = -1;
+
+    ranges.emplace(agent.vtepIP, range);
+  }
+
+  positions[agent.ip] = agents.size();
+  agents.push_back(agent);
+
+  return &agents.back();
+}
+
+
+void AgentTable::addOverlay(AgentRecord* agent, const AgentOverlay& overlay)
+{
+  if (overlay.prefix > 0) {
+    Range range;
+    range.last = overlay.subnet | (0xffffffff >> overlay.prefix);
+    range.agent = positions.at(agent->ip);
+    range.overlay = agent->overlays.size();
+
+    ranges.emplace(overlay.subnet, range);
+  }
+
+  agent->overlays.push_back(overlay);
+}
+
+
+AgentRecord* AgentTable::find(const IP& ip)
+{
+  Option<size_t> _position = position(ip);
+  if (_position.isNone()) {
+    return nullptr;
+  }
+
+  return &agents[_position.get()];
+}
+
+
+const AgentRecord* AgentTable::find(const IP& ip) const
+{
+  Option<size_t> _position = position(ip);
+  if (_position.isNone()) {
+    return nullptr;
+  }
+
+  return &agents[_position.get()];
+}
+
+
+Option<size_t> AgentTable::position(const IP& ip) const
+{
+  const uint32_t address = ntohl(ip.in().get().s_addr);
+
+  if (!positions.contains(address)) {
+    return None();
+  }
+
+  return positions.at(address);
+}
+
+
+Option<Allocation> AgentTable::lookup(const IP& ip) const
+{
+  const uint32_t address = ntohl(ip.in().get().s_addr);
+
+  // The range holding `address`, if any, is the last one starting at
+  // or before it.
+  std::map<uint32_t, Range>::const_iterator range =
+    ranges.upper_bound(address);
+
+  if (range == ranges.begin()) {
+    return None();
+  }
+
+  --range;
+
+  if (address > range->second.last) {
+    return None();
+  }
+
+  Allocation allocation;
+  allocation.agent = range->second.agent;
+
+  if (range->second.overlay >= 0) {
+    allocation.overlay = (size_t) range->second.overlay;
+  }
+
+  return allocation;
+}
+
+
+void AgentTable::clear()
+{
+  agents.clear();
+  positions.clear();
+  ranges.clear();
+  topologies.clear();
+  header.clear_topologies();
+}
+
+
+size_t AgentTable::bytes() const
+{
+  size_t bytes = agents.capacity() * sizeof(AgentRecord);
+
+  foreach (const AgentRecord& agent, agents) {
+    bytes += agent.overlays.capacity() * sizeof(AgentOverlay);
+  }
+
+  // Every entry of `positions` is a node holding the key, the value
+  // and the link to the next node, plus a bucket.
+  bytes += positions.size() *
+    (sizeof(uint32_t) + sizeof(size_t) + 2 * sizeof(void*));
+
+  // Every entry of `ranges` is a tree node holding the key, the value,
+  // three links and the color.
+  bytes += ranges.size() *
+    (sizeof(uint32_t) + sizeof(Range) + 4 * sizeof(void*));
+
+  return bytes;
+}
+
+
+void AgentTable::compact(CompactState* state) const
+{
+  state->Clear();
+  state->CopyFrom(header);
+
+  foreach (const AgentRecord& agent, agents) {
+    CompactState::Agent* _agent = state->add_agents();
+    _agent->set_ip(agent.ip);
+    _agent->set_vtep_ip(agent.vtepIP);
+
+    if (agent.topology >= 0) {
+      _agent->set_topology(agent.topology);
+    }
+
+    if (agent.hostGw) {
+      _agent->set_host_gw(true);
+    }
+
+    foreach (const AgentOverlay& overlay, agent.overlays) {
+      compact(overlay, _agent->add_overlays());
+    }
+  }
+}
+
+
+void AgentTable::compact(
+    const AgentOverlay& overlay,
+    CompactState::Overlay* _overlay) const
+{
+  _overlay->set_index(overlay.overlay);
+
+  if (overlay.prefix == 0) {
+    return;
+  }
+
+  _overlay->set_subnet(overlay.subnet);
+
+  if (overlay.prefix != getOverlayInfo(overlay.overlay).prefix()) {
+    _overlay->set_prefix(overlay.prefix);
+  }
+
+  if (overlay.mesosBridge) {
+    _overlay->set_mesos_bridge(true);
+  }
+
+  if (overlay.dockerBridge) {
+    _overlay->set_docker_bridge(true);
+  }
+
+  if (overlay.secondary) {
+    _overlay->set_secondary(true);
+  }
+}
+
+
+Try<Nothing> AgentTable::restore(const CompactState& state)
+{
+  clear();
+
+  return extend(state);
+}
+
+
+Try<Nothing> AgentTable::extend(const CompactState& state)
+{
+  if (!state.has_network()) {
+    if (state.agents_size() > 0) {
+      return Error("Cannot restore Agents without a network configuration");
+    }
+
+    return Nothing();
+  }
+
+  const NetworkConfig& network = state.network();
+
+  // Map the overlays and the topology labels of `state` onto the ones
+  // of the table, the network configuration might have changed since
+  // `state` was stored.
+  vector<Option<uint16_t>> _overlays;
+  for (int i = 0; i < network.overlays_size(); i++) {
+    const string& name = network.overlays(i).name();
+
+    // Overlays that have been removed from the configuration are only
+    // an error if an Agent still has them.
+    _overlays.push_back(getOverlay(name));
+  }
+
+  if (agents.size() > (size_t) state.agents_size()) {
+    return Error(
+        "The table holds " + stringify(agents.size()) + " Agents but the"
+        " network state only " + stringify(state.agents_size()));
+  }
+
+  agents.reserve(state.agents_size());
+
+  for (int i = 0; i < state.agents_size(); i++) {
+    const CompactState::Agent& _agent = state.agents(i);
+
+    AgentRecord* agent = nullptr;
+
+    if ((size_t) i < agents.size()) {
+      // The Agent is in the table already, only its overlays that are
+      // not in the table yet are added.
+      agent = &agents[i];
+
+      if (agent->ip != _agent.ip() ||
+          agent->vtepIP != _agent.vtep_ip() ||
+          agent->overlays.size() > (size_t) _agent.overlays_size()) {
+        return Error(
+            "Agent " + stringify(IP(_agent.ip())) + " does not match the"
+            " Agent " + stringify(IP(agent->ip)) + " of the table");
+      }
+
+      for (size_t j = 0; j < agent->overlays.size(); j++) {
+        if (agent->overlays[j].subnet != _agent.overlays(j).subnet()) {
+          return Error(
+              "The overlays of Agent " + stringify(IP(_agent.ip())) +
+              " do not match the ones of the table");
+        }
+      }
+    } else {
+      if (positions.contains(_agent.ip())) {
+        return Error("Duplicate Agent " + stringify(IP(_agent.ip())));
+      }
+
+      Option<string> topology = None();
+      if (_agent.has_topology()) {
+        if (_agent.topology() >= (uint32_t) state.topologies_size()) {
+          return Error(
+              "Agent " + stringify(IP(_agent.ip())) +
+              " refers to unknown topology " + stringify(_agent.topology()));
+        }
+
+        topology = state.topologies(_agent.topology());
+      }
+
+      agent = add(IP(_agent.ip()), IP(_agent.vtep_ip()), topology);
+    }
+
+    agent->hostGw = _agent.host_gw();
+
+    agent->overlays.reserve(_agent.overlays_size());
+
+    for (int j = agent->overlays.size(); j < _agent.overlays_size(); j++) {
+      const CompactState::Overlay& _overlay = _agent.overlays(j);
+
+      if (_overlay.index() >= _overlays.size()) {
+        return Error(
+            "Agent " + stringify(IP(_agent.ip())) +
+            " refers to unknown overlay " + stringify(_overlay.index()));
+      }
+
+      const OverlayInfo& info = network.overlays(_overlay.index());
+
+      if (_overlays[_overlay.index()].isNone()) {
+        return Error(
+            "Unknown overlay '" + info.name() + "' on Agent " +
+            stringify(IP(_agent.ip())));
+      }
+
+      AgentOverlay overlay(_overlays[_overlay.index()].get());
+
+      if (_overlay.has_subnet()) {
+        overlay.subnet = _overlay.subnet();
+        overlay.prefix =
+          _overlay.has_prefix() ? _overlay.prefix() : info.prefix();
+        overlay.mesosBridge = _overlay.mesos_bridge();
+        overlay.dockerBridge = _overlay.docker_bridge();
+        overlay.secondary = _overlay.secondary();
+      }
+
+      addOverlay(agent, overlay);
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> AgentTable::getAgentInfo(
+    const AgentRecord& agent,
+    AgentInfo* info) const
+{
+  CompactState::Agent _agent;
+  _agent.set_ip(agent.ip);
+  _agent.set_vtep_ip(agent.vtepIP);
+
+  if (agent.topology >= 0) {
+    _agent.set_topology(agent.topology);
+  }
+
+  if (agent.hostGw) {
+    _agent.set_host_gw(true);
+  }
+
+  foreach (const AgentOverlay& overlay, agent.overlays) {
+    CompactState::Overlay* _overlay = _agent.add_overlays();
+    _overlay->set_index(overlay.overlay);
+
+    if (overlay.prefix > 0) {
+      _overlay->set_subnet(overlay.subnet);
+      _overlay->set_prefix(overlay.prefix);
+      _overlay->set_mesos_bridge(overlay.mesosBridge);
+      _overlay->set_docker_bridge(overlay.dockerBridge);
+      _overlay->set_secondary(overlay.secondary);
+    }
+  }
+
+  Try<Nothing> expanded = expand(header, _agent, info);
+  if (expanded.isError()) {
+    return expanded;
+  }
+
+  for (size_t i = 0; i < agent.overlays.size(); i++) {
+    if (agent.overlays[i].status >= 0) {
+      info->mutable_overlays(i)->mutable_state()->set_status(
+          (AgentOverlayInfo::State::Status) agent.overlays[i].status);
+    }
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> AgentTable::setStatus(
+    AgentRecord* agent,
+    const AgentOverlayInfo& overlay)
+{
+  const string& name = overlay.info().name();
+
+  if (!overlays.contains(name)) {
+    return Error("Unknown network " + name);
+  }
+
+  const uint16_t index = overlays.at(name);
+
+  Option<net::IPNetwork> subnet = None();
+  if (overlay.secondary()) {
+    Try<net::IPNetwork> _subnet =
+      net::IPNetwork::parse(overlay.subnet(), AF_INET);
+
+    if (_subnet.isError()) {
+      return Error(
+          "Unable to parse subnet " + overlay.subnet() + " of network " +
+          name + ": " + _subnet.error());
+    }
+
+    subnet = _subnet.get();
+  }
+
+  foreach (AgentOverlay& _overlay, agent->overlays) {
+    if (_overlay.overlay != index ||
+        _overlay.secondary != overlay.secondary() ||
+        (subnet.isSome() && _overlay.getSubnet() != subnet)) {
+      continue;
+    }
+
+    _overlay.status = overlay.state().status();
+
+    return Nothing();
+  }
+
+  return Error(
+      "Unknown subnet " + overlay.subnet() + " of network " + name);
+}
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
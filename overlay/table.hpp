@@ -0,0 +1,222 @@
+#ifndef __OVERLAY_TABLE_HPP__
+#define __OVERLAY_TABLE_HPP__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stout/hashmap.hpp>
+#include <stout/ip.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+// ONLY USEFUL AFTER RUNNING PROTOC.
+#include <overlay/overlay.pb.h>
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// An overlay instance on an Agent. It holds the same information as a
+// `CompactState::Overlay`, the bridges and the backend are derived
+// from it when the `AgentOverlayInfo` is built.
+struct AgentOverlay
+{
+  explicit AgentOverlay(uint16_t _overlay)
+    : overlay(_overlay),
+      prefix(0),
+      mesosBridge(false),
+      dockerBridge(false),
+      secondary(false),
+      status(-1),
+      subnet(0) {}
+
+  void setSubnet(const net::IPNetwork& network)
+  {
+    subnet = ntohl(network.address().in().get().s_addr);
+    prefix = network.prefix();
+  }
+
+  // Returns the subnet allocated to the Agent, if any.
+  Option<net::IPNetwork> getSubnet() const
+  {
+    if (prefix == 0) {
+      return None();
+    }
+
+    return net::IPNetwork::create(net::IP(subnet), prefix).get();
+  }
+
+  // Index of the overlay in the `NetworkConfig` of the table.
+  uint16_t overlay;
+
+  // Prefix of `subnet`, zero if the Agent has no subnet.
+  uint8_t prefix;
+
+  bool mesosBridge;
+  bool dockerBridge;
+  bool secondary;
+
+  // The `AgentOverlayInfo::State::Status` last reported by the Agent,
+  // -1 until the Agent has reported it.
+  int8_t status;
+
+  // Subnet in host byte order.
+  uint32_t subnet;
+};
+
+
+// An Agent in the `AgentTable`.
+struct AgentRecord
+{
+  // IP of the Agent and of its VTEP, in host byte order.
+  uint32_t ip;
+  uint32_t vtepIP;
+
+  // Index of the topology label of the Agent, -1 without a label.
+  int32_t topology;
+
+  // Whether the Agent routes the overlays with `host_gw` directly.
+  bool hostGw;
+
+  // The overlays of the Agent, primary and secondary subnets, in the
+  // order they were allocated.
+  std::vector<AgentOverlay> overlays;
+};
+
+
+// The allocation an address belongs to, see `AgentTable::lookup`.
+struct Allocation
+{
+  // Position of the Agent in the table.
+  size_t agent;
+
+  // Position of the overlay in `AgentRecord::overlays`, `None` if the
+  // address is the VTEP IP of the Agent.
+  Option<size_t> overlay;
+};
+
+
+// In-memory table of the Agents known to the Master. The Agents are
+// kept as contiguous records of binary addresses and overlay indexes,
+// the same way the `CompactState` stores them, and the `AgentInfo`
+// protobufs are only built when an Agent needs to be sent out or
+// serialized.
+//
+// Agents are only ever added to the table, hence a record keeps its
+// position until the table is cleared. The table also indexes the
+// subnets and the VTEP IPs of the Agents by address, to find the Agent
+// an address has been allocated to.
+class AgentTable
+{
+public:
+  AgentTable(
+      const NetworkConfig& network,
+      uint32_t vni,
+      const std::string& vtepName);
+
+  // Returns the index of an overlay of the `NetworkConfig`.
+  Option<uint16_t> getOverlay(const std::string& name) const;
+
+  const OverlayInfo& getOverlayInfo(uint16_t overlay) const;
+
+  Option<std::string> getTopology(const AgentRecord& agent) const;
+
+  // Adds an Agent without overlays. The returned record is only valid
+  // until the next Agent is added.
+  AgentRecord* add(
+      const net::IP& ip,
+      const net::IP& vtepIP,
+      const Option<std::string>& topology);
+
+  // Adds an overlay to an Agent of the table.
+  void addOverlay(AgentRecord* agent, const AgentOverlay& overlay);
+
+  AgentRecord* find(const net::IP& ip);
+  const AgentRecord* find(const net::IP& ip) const;
+
+  // Returns the position of an Agent in the table.
+  Option<size_t> position(const net::IP& ip) const;
+
+  // Returns the allocation holding `ip`, in O(log n) of the number of
+  // allocations.
+  Option<Allocation> lookup(const net::IP& ip) const;
+
+  const std::vector<AgentRecord>& records() const { return agents; }
+
+  size_t size() const { return agents.size(); }
+
+  void clear();
+
+  // Returns the approximate number of bytes held by the table.
+  size_t bytes() const;
+
+  // Encodes the table into `state`, reusing the messages `state`
+  // already holds.
+  void compact(CompactState* state) const;
+
+  // Encodes an overlay of an Agent, e.g., one that is not in the
+  // table yet.
+  void compact(
+      const AgentOverlay& overlay,
+      CompactState::Overlay* _overlay) const;
+
+  // Replaces the Agents in the table with the Agents of `state`. The
+  // overlays and the topology labels of `state` are mapped onto the
+  // ones of the table.
+  Try<Nothing> restore(const CompactState& state);
+
+  // Adds the Agents of `state`, and the overlays of the Agents, that
+  // are not in the table yet. The table must hold a prefix of the
+  // Agents of `state` (e.g., an earlier network state of the same
+  // replicated log), each with a prefix of its overlays.
+  Try<Nothing> extend(const CompactState& state);
+
+  // Builds the `AgentInfo` of an Agent, along with the status of its
+  // overlays.
+  Try<Nothing> getAgentInfo(const AgentRecord& agent, AgentInfo* info) const;
+
+  // Records the status of an overlay reported by an Agent. Secondary
+  // subnets are matched by subnet.
+  Try<Nothing> setStatus(AgentRecord* agent, const AgentOverlayInfo& overlay);
+
+private:
+  // The network configuration, the VxLAN backend and the topology
+  // labels of the Agents, without any Agents.
+  CompactState header;
+
+  hashmap<std::string, uint16_t> overlays;
+  hashmap<std::string, int32_t> topologies;
+
+  std::vector<AgentRecord> agents;
+
+  // Position of each Agent in `agents`, by IP in host byte order.
+  hashmap<uint32_t, size_t> positions;
+
+  // An allocated range of addresses, see `Allocation`.
+  struct Range
+  {
+    // Last address of the range in host byte order.
+    uint32_t last;
+
+    uint32_t agent;
+
+    // Position of the overlay in `AgentRecord::overlays`, -1 for the
+    // VTEP IP.
+    int32_t overlay;
+  };
+
+  // Allocated ranges by their first address in host byte order. The
+  // allocators never hand out overlapping ranges.
+  std::map<uint32_t, Range> ranges;
+};
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_TABLE_HPP__
@@ -0,0 +1,321 @@
+#ifndef __OVERLAY_TOPOLOGY_HPP__
+#define __OVERLAY_TOPOLOGY_HPP__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include "buddy.hpp"
+
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// Allocator that keeps the blocks handed out for the same topology
+// label (e.g. a rack or a zone) within aligned super-blocks of
+// 2^`superOrder` units, so that they can be summarized by a single
+// route. The super-blocks are carved out of a `BuddyAllocator` over
+// the whole index space, which also serves the allocations without a
+// label. A super-block is released once all its blocks are free.
+//
+// Without a `superOrder` the labels are ignored, and the allocator
+// behaves like a `BuddyAllocator`.
+class TopologyAllocator
+{
+public:
+  // Allocator over `blocks` blocks of 2^`maxOrder` units each, like a
+  // `BuddyAllocator`. The blocks are grouped into super-blocks, hence
+  // `blocks` needs to be a power of two, and `superOrder` needs to be
+  // between `maxOrder` and the order of the whole index space.
+  TopologyAllocator(
+      uint32_t blocks,
+      uint8_t _maxOrder,
+      const Option<uint8_t>& _superOrder)
+    : maxOrder(_maxOrder),
+      superOrder(_superOrder),
+      freeBlocks(
+          _superOrder.isSome()
+            ? blocks >> (_superOrder.get() - _maxOrder)
+            : blocks,
+          _superOrder.isSome() ? _superOrder.get() : _maxOrder) {}
+
+  Try<uint32_t> allocate(uint8_t order, const Option<std::string>& topology)
+  {
+    Try<Nothing> valid = validate(order);
+    if (valid.isError()) {
+      return Error(valid.error());
+    }
+
+    if (superOrder.isNone() || topology.isNone()) {
+      return freeBlocks.allocate(order);
+    }
+
+    // Only the super-blocks of the topology with free units are tried,
+    // the lowest first. A copy is walked as an allocation might fill a
+    // super-block, which then leaves `available`.
+    if (available.contains(topology.get())) {
+      const std::vector<uint32_t> indexes = available.at(topology.get());
+
+      foreach (uint32_t index, indexes) {
+        Try<uint32_t> offset =
+          superBlocks.at(index).freeBlocks.allocate(order);
+
+        if (offset.isSome()) {
+          update(index);
+
+          return (index << superOrder.get()) + offset.get();
+        }
+      }
+    }
+
+    // All the super-blocks of the topology are full, start a new one.
+    Try<uint32_t> offset = freeBlocks.allocate(superOrder.get());
+    if (offset.isError()) {
+      return Error(
+          "No free super-block available for topology '" + topology.get() +
+          "': " + offset.error());
+    }
+
+    const uint32_t index = offset.get() >> superOrder.get();
+
+    SuperBlock& superBlock = add(index, topology.get());
+
+    Try<uint32_t> _offset = superBlock.freeBlocks.allocate(order);
+    if (_offset.isError()) {
+      return Error(_offset.error());
+    }
+
+    update(index);
+
+    return offset.get() + _offset.get();
+  }
+
+  Try<Nothing> free(uint32_t offset, uint8_t order)
+  {
+    Try<Nothing> valid = validate(order);
+    if (valid.isError()) {
+      return Error(valid.error());
+    }
+
+    if (superOrder.isSome()) {
+      const uint32_t index = offset >> superOrder.get();
+
+      if (superBlocks.count(index) > 0) {
+        SuperBlock& superBlock = superBlocks.at(index);
+
+        Try<Nothing> freed = superBlock.freeBlocks.free(
+            offset - (index << superOrder.get()),
+            order);
+
+        if (freed.isError()) {
+          return freed;
+        }
+
+        if (superBlock.freeBlocks.availableUnits() ==
+            ((uint64_t) 1 << superOrder.get())) {
+          remove(index);
+
+          return freeBlocks.free(
+              index << superOrder.get(),
+              superOrder.get());
+        }
+
+        update(index);
+
+        return Nothing();
+      }
+    }
+
+    return freeBlocks.free(offset, order);
+  }
+
+  // Marks a specific block as allocated, e.g. when recovering. A
+  // block with a topology label reserves the super-block it belongs
+  // to for that label, unless the super-block holds blocks without a
+  // label (e.g. because `superOrder` has changed).
+  Try<Nothing> reserve(
+      uint32_t offset,
+      uint8_t order,
+      const Option<std::string>& topology)
+  {
+    Try<Nothing> valid = validate(order);
+    if (valid.isError()) {
+      return Error(valid.error());
+    }
+
+    if (superOrder.isSome()) {
+      const uint32_t index = offset >> superOrder.get();
+
+      if (superBlocks.count(index) == 0 &&
+          topology.isSome() &&
+          freeBlocks.reserve(
+              index << superOrder.get(),
+              superOrder.get()).isSome()) {
+        add(index, topology.get());
+      }
+
+      if (superBlocks.count(index) > 0) {
+        Try<Nothing> reserved = superBlocks.at(index).freeBlocks.reserve(
+            offset - (index << superOrder.get()),
+            order);
+
+        update(index);
+
+        return reserved;
+      }
+    }
+
+    return freeBlocks.reserve(offset, order);
+  }
+
+  void reset()
+  {
+    superBlocks.clear();
+    available.clear();
+    freeBlocks.reset();
+  }
+
+  // Returns the number of units that are not allocated, including
+  // the free units of the super-blocks.
+  uint64_t availableUnits() const
+  {
+    uint64_t available = freeBlocks.availableUnits();
+
+    foreachvalue (const SuperBlock& superBlock, superBlocks) {
+      available += superBlock.freeBlocks.availableUnits();
+    }
+
+    return available;
+  }
+
+  // Returns the topology label of each super-block, by the offset of
+  // its first unit.
+  std::map<uint32_t, std::string> topologies() const
+  {
+    std::map<uint32_t, std::string> _topologies;
+
+    foreachpair (uint32_t index, const SuperBlock& superBlock, superBlocks) {
+      _topologies[index << superOrder.get()] = superBlock.topology;
+    }
+
+    return _topologies;
+  }
+
+private:
+  struct SuperBlock
+  {
+    SuperBlock(
+        const std::string& _topology,
+        uint32_t blocks,
+        uint8_t maxOrder)
+      : topology(_topology),
+        freeBlocks(blocks, maxOrder) {}
+
+    std::string topology;
+
+    BuddyAllocator freeBlocks;
+  };
+
+  Try<Nothing> validate(uint8_t order) const
+  {
+    if (order > maxOrder) {
+      return Error(
+          "Order " + stringify((uint32_t) order) + " exceeds the maximum "
+          "order " + stringify((uint32_t) maxOrder));
+    }
+
+    return Nothing();
+  }
+
+  SuperBlock& add(uint32_t index, const std::string& topology)
+  {
+    superBlocks.emplace(
+        index,
+        SuperBlock(
+            topology,
+            (uint32_t) 1 << (superOrder.get() - maxOrder),
+            maxOrder));
+
+    update(index);
+
+    return superBlocks.at(index);
+  }
+
+  void remove(uint32_t index)
+  {
+    const std::string topology = superBlocks.at(index).topology;
+
+    superBlocks.erase(index);
+
+    if (!available.contains(topology)) {
+      return;
+    }
+
+    std::vector<uint32_t>& indexes = available.at(topology);
+    indexes.erase(
+        std::remove(indexes.begin(), indexes.end(), index),
+        indexes.end());
+
+    if (indexes.empty()) {
+      available.erase(topology);
+    }
+  }
+
+  // Lists the super-block `index` in `available` if, and only if, it
+  // has free units. The indexes are kept sorted.
+  void update(uint32_t index)
+  {
+    const SuperBlock& superBlock = superBlocks.at(index);
+
+    std::vector<uint32_t>& indexes = available[superBlock.topology];
+
+    std::vector<uint32_t>::iterator position =
+      std::lower_bound(indexes.begin(), indexes.end(), index);
+
+    const bool listed = position != indexes.end() && *position == index;
+
+    if (superBlock.freeBlocks.availableUnits() > 0) {
+      if (!listed) {
+        indexes.insert(position, index);
+      }
+    } else if (listed) {
+      indexes.erase(position);
+    }
+
+    if (indexes.empty()) {
+      available.erase(superBlock.topology);
+    }
+  }
+
+  uint8_t maxOrder;
+  Option<uint8_t> superOrder;
+
+  // Free blocks outside of the super-blocks. With a `superOrder` the
+  // blocks of this allocator are super-blocks.
+  BuddyAllocator freeBlocks;
+
+  // Super-blocks reserved for a topology, by index.
+  std::map<uint32_t, SuperBlock> superBlocks;
+
+  // Indexes of the super-blocks of each topology that have free
+  // units, so that an allocation does not walk all the super-blocks.
+  hashmap<std::string, std::vector<uint32_t>> available;
+};
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_TOPOLOGY_HPP__
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include <gmock/gmock.h>
 
@@ -6,10 +8,14 @@
 #include <mesos/mesos.hpp>
 #include <mesos/resources.hpp>
 
+#include <mesos/module/container_logger.hpp>
 #include <mesos/module/module.hpp>
 
+#include <mesos/slave/container_logger.hpp>
+
 #include <mesos/scheduler/scheduler.hpp>
 
+#include <process/collect.hpp>
 #include <process/future.hpp>
 #include <process/gmock.hpp>
 #include <process/gtest.hpp>
@@ -18,10 +24,12 @@
 
 #include <stout/gtest.hpp>
 #include <stout/json.hpp>
+#include <stout/lambda.hpp>
 #include <stout/option.hpp>
 #include <stout/os.hpp>
 #include <stout/path.hpp>
 #include <stout/protobuf.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
@@ -39,6 +47,9 @@
 
 using namespace process;
 
+using std::cout;
+using std::endl;
+
 using namespace mesos::internal::tests;
 
 using mesos::internal::master::Master;
@@ -52,6 +63,8 @@ using mesos::master::detector::MasterDetector;
 
 using mesos::modules::ModuleManager;
 
+using mesos::slave::ContainerLogger;
+
 using mesos::modules::common::runCommand;
 
 namespace systemd {
@@ -153,6 +166,83 @@ protected:
     MesosTest::TearDown();
   }
 
+  // Creates the journald ContainerLogger with the companion binaries of
+  // this build and the parameter `key`, prepares a container of the
+  // executor `identifier` and writes `data` to its stdout. The pipes
+  // are then closed, which lets the companion processes exit.
+  void log(
+      const std::string& key,
+      const std::string& value,
+      const std::string& identifier,
+      const std::string& data)
+  {
+    Parameters parameters;
+
+    Parameter* parameter = parameters.add_parameter();
+    parameter->set_key("companion_dir");
+    parameter->set_value(path::join(MODULES_BUILD_DIR, ".libs"));
+
+    parameter = parameters.add_parameter();
+    parameter->set_key(key);
+    parameter->set_value(value);
+
+    Try<ContainerLogger*> create =
+      ModuleManager::create<ContainerLogger>(JOURNALD_LOGGER_NAME, parameters);
+    ASSERT_SOME(create);
+
+    Owned<ContainerLogger> logger(create.get());
+
+    ExecutorInfo executorInfo;
+    executorInfo.mutable_framework_id()->set_value("framework");
+    executorInfo.mutable_executor_id()->set_value(identifier);
+
+    Future<ContainerLogger::SubprocessInfo> prepared = logger->prepare(
+        executorInfo,
+        "/tmp/slaves/agent/frameworks/framework/executors/" + identifier +
+          "/runs/container");
+
+    AWAIT_READY(prepared);
+    ASSERT_SOME(prepared->out.fd());
+    ASSERT_SOME(prepared->err.fd());
+
+    ASSERT_SOME(os::write(prepared->out.fd().get(), data));
+
+    os::close(prepared->out.fd().get());
+    os::close(prepared->err.fd().get());
+  }
+
+  // Queries journald with the `filter` arguments of `journalctl` until
+  // its output satisfies `predicate`, as journald might not have written
+  // the entries to the journal yet. Returns the last output.
+  Try<std::string> waitForJournal(
+      const std::vector<std::string>& filter,
+      const lambda::function<bool(const std::string&)>& predicate)
+  {
+    std::vector<std::string> argv = {"journalctl"};
+    argv.insert(argv.end(), filter.begin(), filter.end());
+
+    Future<std::string> query;
+    Duration waited = Duration::zero();
+    do {
+      query = runCommand("journalctl", argv);
+
+      if (!query.await(Seconds(15)) || !query.isReady()) {
+        return Error(
+            "Failed to query journald: " +
+            (query.isFailed() ? query.failure() : "discarded or timed out"));
+      }
+
+      if (predicate(query.get())) {
+        break;
+      }
+
+      os::sleep(Milliseconds(100));
+      waited += Milliseconds(100);
+    } while (waited < Seconds(15));
+
+    return query.get();
+  }
+
 private:
   Modules modules;
 };
@@ -363,6 +453,162 @@ TEST_F(JournaldLoggerTest, ROOT_DOCKER_LogToJournald)
   ASSERT_TRUE(strings::contains(executorQuery.get(), specialString));
 }
 
+
+// Prepares a container with direct streams and writes to its stdout.
+// Then queries journald for the line, which is attributed to the
+// agent (here, the test) that opened the stream.
+TEST_F(JournaldLoggerTest, ROOT_DirectStream)
+{
+  const std::string identifier = "direct-stream-" + stringify(::getpid());
+  const std::string specialString = "some-super-unique-string";
+
+  ASSERT_NO_FATAL_FAILURE(
+      log("direct_stream", "true", identifier, specialString + "\n"));
+
+  Try<std::string> journal = waitForJournal(
+      {"SYSLOG_IDENTIFIER=" + identifier, "_PID=" + stringify(::getpid())},
+      [&](const std::string& output) {
+        return strings::contains(output, specialString);
+      });
+
+  ASSERT_SOME(journal);
+  ASSERT_TRUE(strings::contains(journal.get(), specialString));
+}
+
+
+// Writes the same line a number of times to a container whose
+// companion collapses the duplicates. Then queries journald for the
+// first line and the count of its duplicates.
+TEST_F(JournaldLoggerTest, ROOT_DuplicateLines)
+{
+  const size_t LINES = 10;
+
+  const std::string identifier = "duplicate-lines-" + stringify(::getpid());
+  const std::string specialString = "some-super-unique-string";
+
+  std::string lines;
+  for (size_t i = 0; i < LINES; i++) {
+    lines += specialString + "\n";
+  }
+
+  // Closing the pipes lets the companion processes write the count of
+  // the duplicates, well before the window expires.
+  ASSERT_NO_FATAL_FAILURE(
+      log("duplicate_window", "1mins", identifier, lines));
+
+  const std::string summary =
+    "Last message repeated " + stringify(LINES - 1) + " times";
+
+  Try<std::string> journal = waitForJournal(
+      {"--output=cat", "EXECUTOR_ID=" + identifier},
+      [&](const std::string& output) {
+        return strings::contains(output, summary);
+      });
+
+  ASSERT_SOME(journal);
+
+  vector<string> messages = strings::tokenize(journal.get(), "\n");
+
+  EXPECT_EQ(1, std::count(messages.begin(), messages.end(), specialString));
+  EXPECT_EQ(1, std::count(messages.begin(), messages.end(), summary));
+}
+
+
+// Prepares a container with the minimal companion, which is passed
+// all the flags of the companion (`--help=false` included), and writes
+// to its stdout. Then queries journald for the line and its labels.
+TEST_F(JournaldLoggerTest, ROOT_MinimalCompanion)
+{
+  const std::string identifier = "minimal-companion-" + stringify(::getpid());
+  const std::string specialString = "some-super-unique-string";
+
+  ASSERT_NO_FATAL_FAILURE(
+      log("minimal_companion", "true", identifier, specialString + "\n"));
+
+  Try<std::string> journal = waitForJournal(
+      {"EXECUTOR_ID=" + identifier, "STREAM=STDOUT"},
+      [&](const std::string& output) {
+        return strings::contains(output, specialString);
+      });
+
+  ASSERT_SOME(journal);
+  ASSERT_TRUE(strings::contains(journal.get(), specialString));
+}
+
+
+// Measures the throughput of the preparation of the companion processes
+// for a burst of container launches, with one actor preparing them all,
+// and with a pool of them.
+TEST_F(JournaldLoggerTest, ROOT_BENCHMARK_ConcurrentPrepare)
+{
+  const size_t LAUNCHES = 200;
+
+  foreach (size_t preparers, vector<size_t>({1, 4, 8})) {
+    Parameters parameters;
+
+    Parameter* parameter = parameters.add_parameter();
+    parameter->set_key("companion_dir");
+    parameter->set_value(path::join(MODULES_BUILD_DIR, ".libs"));
+
+    parameter = parameters.add_parameter();
+    parameter->set_key("libprocess_num_worker_threads");
+    parameter->set_value("2");
+
+    parameter = parameters.add_parameter();
+    parameter->set_key("preparers");
+    parameter->set_value(stringify(preparers));
+
+    Try<ContainerLogger*> create =
+      ModuleManager::create<ContainerLogger>(JOURNALD_LOGGER_NAME, parameters);
+    ASSERT_SOME(create);
+
+    Owned<ContainerLogger> logger(create.get());
+
+    ExecutorInfo executorInfo;
+    executorInfo.mutable_framework_id()->set_value("framework");
+
+    vector<Future<ContainerLogger::SubprocessInfo>> prepared;
+
+    Stopwatch watch;
+    watch.start();
+
+    for (size_t i = 0; i < LAUNCHES; i++) {
+      const string id = "executor-" + stringify(i);
+
+      executorInfo.mutable_executor_id()->set_value(id);
+
+      prepared.push_back(logger->prepare(
+          executorInfo,
+          path::join(
+              "/tmp/slaves/agent/frameworks/framework/executors",
+              id,
+              "runs",
+              "container-" + stringify(i))));
+    }
+
+    Future<vector<ContainerLogger::SubprocessInfo>> all = collect(prepared);
+    AWAIT_READY_FOR(all, Minutes(1));
+
+    watch.stop();
+
+    cout << "Preparing " << LAUNCHES << " containers with " << preparers
+         << " preparers took " << watch.elapsed() << " ("
+         << LAUNCHES / watch.elapsed().secs() << " containers per second)"
+         << endl;
+
+    // Closing the pipes lets the companion processes exit.
+    foreach (const ContainerLogger::SubprocessInfo& info, all.get()) {
+      if (info.out.fd().isSome()) {
+        os::close(info.out.fd().get());
+      }
+
+      if (info.err.fd().isSome()) {
+        os::close(info.err.fd().get());
+      }
+    }
+  }
+}
+
 } // namespace tests {
 } // namespace journald {
 } // namespace mesos {
@@ -33,6 +33,19 @@
  * damages.
  */
 
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <new>
 #include <string>
 #include <ostream>
 
@@ -49,6 +62,8 @@
 
 #include <mesos/slave/isolator.hpp>
 
+#include <process/clock.hpp>
+#include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/gmock.hpp>
 #include <process/gtest.hpp>
@@ -57,11 +72,13 @@
 #include <process/owned.hpp>
 
 #include <stout/gtest.hpp>
+#include <stout/hashmap.hpp>
 #include <stout/json.hpp>
 #include <stout/option.hpp>
 #include <stout/os.hpp>
 #include <stout/path.hpp>
 #include <stout/protobuf.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/try.hpp>
 
 #include <stout/os/read.hpp>
@@ -74,10 +91,18 @@
 
 #include "module/manager.hpp"
 
+#include "overlay/buddy.hpp"
+#include "overlay/cni.hpp"
+#include "overlay/compact.hpp"
 #include "overlay/constants.hpp"
+#include "overlay/ipam.hpp"
 #include "overlay/messages.pb.h"
+#include "overlay/netlink.hpp"
 #include "overlay/overlay.hpp"
 #include "overlay/overlay.pb.h"
+#include "overlay/prober.hpp"
+#include "overlay/table.hpp"
+#include "overlay/topology.hpp"
 
 
 #include "slave/flags.hpp"
@@ -90,7 +115,10 @@ using namespace mesos::internal::tests;
 
 using std::cout;
 using std::endl;
+using std::string;
+using std::vector;
 
+using process::Clock;
 using process::Future;
 using process::Owned;
 using process::PID;
@@ -113,16 +141,69 @@ using mesos::modules::common::runScriptCommand;
 using mesos::modules::Anonymous;
 using mesos::modules::ModuleManager;
 using mesos::modules::overlay::AgentInfo;
+using mesos::modules::overlay::AgentOverlayInfo;
+using mesos::modules::overlay::AgentRecord;
+using mesos::modules::overlay::AgentTable;
+using mesos::modules::overlay::Allocation;
+using mesos::modules::overlay::BuddyAllocator;
+using mesos::modules::overlay::CompactState;
+using mesos::modules::overlay::DOCKER_BRIDGE_PREFIX;
+using mesos::modules::overlay::GeneveInfo;
+using mesos::modules::overlay::MESOS_BRIDGE_PREFIX;
+using mesos::modules::overlay::NetworkConfig;
+using mesos::modules::overlay::TrafficInfo;
+using mesos::modules::overlay::VxLANInfo;
 using mesos::modules::overlay::AGENT_MANAGER_PROCESS_ID;
 using mesos::modules::overlay::MASTER_MANAGER_PROCESS_ID;
 using mesos::modules::overlay::RESERVED_NETWORKS;
+using mesos::modules::overlay::TopologyAllocator;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::IpamRequest;
+using mesos::modules::overlay::internal::IpamResponse;
 using mesos::modules::overlay::internal::MasterConfig;
+using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RequestSubnetMessage;
+using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
+using mesos::modules::overlay::LookupInfo;
 using mesos::modules::overlay::OverlayInfo;
 using mesos::modules::overlay::State;
+using mesos::modules::overlay::agent::IPAM_PLUGIN;
 using mesos::modules::overlay::agent::IPSET_OVERLAY;
+using mesos::modules::overlay::agent::IpamProcess;
+using mesos::modules::overlay::agent::ipam;
+using mesos::modules::overlay::agent::ProberProcess;
+using mesos::modules::overlay::compact;
+using mesos::modules::overlay::expand;
+
+namespace cni = mesos::modules::overlay::cni;
+namespace netlink = mesos::modules::overlay::netlink;
+
+
+// Number of allocations made through the global `operator new`. Used
+// by the benchmarks to count the allocations of the code they measure.
+static std::atomic<uint64_t> allocations(0);
+
+
+void* operator new(size_t size)
+{
+  ++allocations;
+
+  void* pointer = malloc(size);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return pointer;
+}
+
+
+void operator delete(void* pointer) noexcept
+{
+  free(pointer);
+}
+
 
 namespace mesos {
 namespace overlay {
@@ -348,6 +429,93 @@ protected:
     return startOverlayAgent();
   }
 
+  // Returns the network state of a cluster of `agents` Agents, with
+  // the allocations the Master makes.
+  State createNetworkState(uint32_t agents)
+  {
+    State state;
+
+    NetworkConfig* network = state.mutable_network();
+    network->set_vtep_subnet("44.128.0.0/16");
+    network->set_vtep_mac_oui("70:B3:D5:00:00:00");
+
+    for (int i = 0; i < 2; i++) {
+      OverlayInfo* overlay = network->add_overlays();
+      overlay->set_name("overlay-" + stringify(i));
+      overlay->set_subnet(stringify(9 + i) + ".0.0.0/8");
+      overlay->set_prefix(24);
+    }
+
+    // Mimic the allocations of the Master: one /24 per overlay, split
+    // into the Mesos and the Docker bridge, and one VTEP per Agent.
+    for (uint32_t i = 0; i < agents; i++) {
+      AgentInfo* agent = state.add_agents();
+      agent->set_ip(stringify(net::IP(0xac100000 + i)));
+      agent->set_topology("rack-" + stringify(i / 40));
+
+      const uint32_t vtepIP = 0x2c800001 + i;
+
+      uint8_t vtepMAC[6] = {
+        0x70, 0xb3, 0xd5,
+        (uint8_t) (vtepIP >> 16), (uint8_t) (vtepIP >> 8), (uint8_t) vtepIP};
+
+      for (int j = 0; j < network->overlays_size(); j++) {
+        const OverlayInfo& info = network->overlays(j);
+        const uint32_t subnet = ((9 + j) << 24) | (i << 8);
+
+        AgentOverlayInfo* overlay = agent->add_overlays();
+        overlay->mutable_info()->CopyFrom(info);
+        overlay->set_subnet(stringify(
+            net::IPNetwork::create(net::IP(subnet), 24).get()));
+
+        overlay->mutable_mesos_bridge()->set_name(
+            MESOS_BRIDGE_PREFIX + info.name());
+        overlay->mutable_mesos_bridge()->set_ip(stringify(
+            net::IPNetwork::create(net::IP(subnet), 25).get()));
+
+        overlay->mutable_docker_bridge()->set_name(
+            DOCKER_BRIDGE_PREFIX + info.name());
+        overlay->mutable_docker_bridge()->set_ip(stringify(
+            net::IPNetwork::create(net::IP(subnet | 0x80), 25).get()));
+
+        VxLANInfo* vxlan = overlay->mutable_backend()->mutable_vxlan();
+        vxlan->set_vni(1024);
+        vxlan->set_vtep_name("vtep1024");
+        vxlan->set_vtep_ip(stringify(
+            net::IPNetwork::create(net::IP(vtepIP), 16).get()));
+        vxlan->set_vtep_mac(stringify(net::MAC(vtepMAC)));
+      }
+    }
+
+    return state;
+  }
+
+  // Adds a secondary subnet of the first overlay to the first Agent of
+  // `state`, used as a whole by the Mesos bridge.
+  AgentOverlayInfo* addSecondary(State* state, const string& subnet)
+  {
+    AgentOverlayInfo* secondary = state->mutable_agents(0)->add_overlays();
+    secondary->CopyFrom(state->agents(0).overlays(0));
+    secondary->set_subnet(subnet);
+    secondary->mutable_mesos_bridge()->set_ip(subnet);
+    secondary->clear_docker_bridge();
+    secondary->set_secondary(true);
+
+    return secondary;
+  }
+
+  // Returns the `AgentTable` of the Master holding the Agents of
+  // `state`, restored from its `CompactState` encoding.
+  AgentTable createAgentTable(const State& state, CompactState* compactState)
+  {
+    CHECK_SOME(compact(state, compactState));
+
+    AgentTable table(state.network(), 1024, "vtep1024");
+    CHECK_SOME(table.restore(*compactState));
+
+    return table;
+  }
+
   Try<State> parseMasterState(const string& state)
   {
     Try<JSON::Object> json = JSON::parse<JSON::Object>(state);
@@ -572,6 +740,66 @@ TEST_F(OverlayTest, ROOT_checkMesosNetwork)
 }
 
 
+// Tests that the `Agent overlay module` installs the rules bypassing
+// conntrack for the traffic between the overlay subnets.
+TEST_F(OverlayTest, ROOT_checkConntrackBypass)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.set_conntrack_bypass(true);
+
+  // The bypass relies on the `ipset` of the Mesos and Docker bridges.
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_ERROR(agentModule);
+
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  const vector<string> match = {
+    "-m", "addrtype", "!", "--dst-type", "LOCAL",
+    "-m", "set", "!", "--match-set", stringify(IPSET_OVERLAY), "src",
+    "-m", "set", "!", "--match-set", stringify(IPSET_OVERLAY), "dst"};
+
+  vector<string> raw = {"iptables", "-t", "raw", "-C", "PREROUTING"};
+  raw.insert(raw.end(), match.begin(), match.end());
+  raw.insert(raw.end(), {"-j", "CT", "--notrack"});
+
+  vector<string> forward = {"iptables", "-C", "FORWARD"};
+  forward.insert(forward.end(), match.begin(), match.end());
+  forward.insert(
+      forward.end(),
+      {"-m", "conntrack", "--ctstate", "UNTRACKED", "-j", "ACCEPT"});
+
+  AWAIT_READY(runCommand("iptables", raw));
+  AWAIT_READY(runCommand("iptables", forward));
+
+  // The rules refer to the `ipset`, which is destroyed on tear down.
+  agentModule->reset();
+
+  raw[3] = "-D";
+  forward[1] = "-D";
+
+  AWAIT_READY(runCommand("iptables", raw));
+  AWAIT_READY(runCommand("iptables", forward));
+}
+
+
 // Tests the ability of the `Agent overlay module` to create Docker
 // network.
 TEST_F(OverlayTest, ROOT_checkDockerNetwork)
@@ -879,6 +1107,1668 @@ TEST_F(OverlayTest, ROOT_checkAgentRecovery)
 }
 
 
+// Tests that the `Master overlay module` exports metrics for the
+// allocation of overlay subnets and VTEP IPs.
+TEST_F(OverlayTest, checkMasterMetrics)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  const string overlayMetrics =
+    "overlay/master/overlays/" + stringify(OVERLAY_NAME) + "/";
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1u, metrics.values.count("overlay/master/operations_pending"));
+  EXPECT_EQ(0, metrics.values["overlay/master/vtep/ips_used"]);
+  EXPECT_EQ(65534, metrics.values["overlay/master/vtep/ips_free"]);
+  EXPECT_EQ(0, metrics.values[overlayMetrics + "subnets_used"]);
+  EXPECT_EQ(256, metrics.values[overlayMetrics + "subnets_free"]);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  metrics = Metrics();
+
+  EXPECT_EQ(1, metrics.values["overlay/master/vtep/ips_used"]);
+  EXPECT_EQ(65533, metrics.values["overlay/master/vtep/ips_free"]);
+  EXPECT_EQ(1, metrics.values[overlayMetrics + "subnets_used"]);
+  EXPECT_EQ(255, metrics.values[overlayMetrics + "subnets_free"]);
+
+  // The registration of the Agent should have been timed.
+  EXPECT_EQ(1u, metrics.values.count("overlay/master/registration_ms"));
+}
+
+
+// Tests that the `Master overlay module` retransmits the overlay
+// configuration of an Agent until the Agent acknowledges it.
+TEST_F(OverlayTest, checkUpdateRetransmission)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  // Only let the first registration of the Agent through, so that
+  // the Agent can only be configured by a retransmission.
+  DROP_PROTOBUFS(RegisterAgentMessage(), _, _);
+
+  Future<RegisterAgentMessage> registerAgentMessage =
+    FUTURE_PROTOBUF(RegisterAgentMessage(), _, _);
+
+  Future<UpdateAgentOverlaysMessage> retransmitted =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), _, _);
+
+  Future<UpdateAgentOverlaysMessage> dropped =
+    DROP_PROTOBUF(UpdateAgentOverlaysMessage(), _, _);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(registerAgentMessage);
+  AWAIT_READY(dropped);
+  AWAIT_READY(retransmitted);
+
+  EXPECT_EQ(dropped->sequence(), retransmitted->sequence());
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(0, metrics.values["overlay/master/updates/outstanding"]);
+  EXPECT_EQ(1, metrics.values["overlay/master/updates/retransmitted"]);
+}
+
+
+// Tests that the buddy allocator used for the Agent subnets splits
+// and merges blocks of different sizes.
+TEST_F(OverlayTest, checkBuddyAllocator)
+{
+  // 4 blocks of 8 units.
+  BuddyAllocator allocator(4, 3);
+  EXPECT_EQ(32u, allocator.availableUnits());
+
+  EXPECT_SOME_EQ(0u, allocator.allocate(0));
+  EXPECT_SOME_EQ(4u, allocator.allocate(2));
+  EXPECT_SOME_EQ(2u, allocator.allocate(1));
+  EXPECT_SOME_EQ(8u, allocator.allocate(3));
+  EXPECT_EQ(17u, allocator.availableUnits());
+
+  EXPECT_SOME(allocator.free(0, 0));
+  EXPECT_ERROR(allocator.free(0, 0));
+  EXPECT_SOME(allocator.free(2, 1));
+  EXPECT_SOME(allocator.free(4, 2));
+  EXPECT_SOME(allocator.free(8, 3));
+  EXPECT_EQ(32u, allocator.availableUnits());
+
+  // The freed blocks should have been merged back.
+  EXPECT_SOME_EQ(0u, allocator.allocate(3));
+
+  // A block cannot be freed while parts of it are free, e.g., with an
+  // order larger than the one it was allocated with.
+  EXPECT_SOME_EQ(8u, allocator.allocate(1));
+  EXPECT_ERROR(allocator.free(8, 2));
+  EXPECT_SOME(allocator.free(8, 1));
+
+  // Reserve blocks, as done on recovery.
+  allocator.reset();
+
+  EXPECT_SOME(allocator.reserve(12, 2));
+  EXPECT_ERROR(allocator.reserve(13, 0));
+  EXPECT_ERROR(allocator.reserve(5, 1));
+  EXPECT_SOME(allocator.reserve(3, 0));
+
+  EXPECT_SOME_EQ(2u, allocator.allocate(0));
+  EXPECT_SOME_EQ(4u, allocator.allocate(2));
+  EXPECT_SOME_EQ(16u, allocator.allocate(3));
+
+  EXPECT_ERROR(allocator.allocate(4));
+}
+
+
+// Tests that the topology allocator keeps the blocks of each
+// topology label within the same super-blocks.
+TEST_F(OverlayTest, checkTopologyAllocator)
+{
+  // 16 blocks of 1 unit, in super-blocks of 4 units.
+  TopologyAllocator allocator(16, 0, 2);
+  EXPECT_EQ(16u, allocator.availableUnits());
+
+  EXPECT_SOME_EQ(0u, allocator.allocate(0, None()));
+  EXPECT_SOME_EQ(4u, allocator.allocate(0, string("rack-1")));
+  EXPECT_SOME_EQ(8u, allocator.allocate(0, string("rack-2")));
+  EXPECT_SOME_EQ(5u, allocator.allocate(0, string("rack-1")));
+  EXPECT_SOME_EQ(1u, allocator.allocate(0, None()));
+  EXPECT_SOME_EQ(6u, allocator.allocate(0, string("rack-1")));
+  EXPECT_SOME_EQ(7u, allocator.allocate(0, string("rack-1")));
+
+  // The super-block of "rack-1" is full.
+  EXPECT_SOME_EQ(12u, allocator.allocate(0, string("rack-1")));
+  EXPECT_EQ(8u, allocator.availableUnits());
+  EXPECT_EQ(3u, allocator.topologies().size());
+
+  // A block freed in the full super-block is allocated before the
+  // free blocks of the next super-block of "rack-1".
+  EXPECT_SOME(allocator.free(5, 0));
+  EXPECT_SOME_EQ(5u, allocator.allocate(0, string("rack-1")));
+  EXPECT_SOME_EQ(13u, allocator.allocate(0, string("rack-1")));
+  EXPECT_EQ(7u, allocator.availableUnits());
+
+  // Freeing the last block of a super-block releases it.
+  EXPECT_SOME(allocator.free(8, 0));
+  EXPECT_ERROR(allocator.free(8, 0));
+  EXPECT_EQ(2u, allocator.topologies().size());
+  EXPECT_SOME_EQ(8u, allocator.allocate(0, string("rack-3")));
+
+  // Reserve blocks, as done on recovery.
+  allocator.reset();
+
+  EXPECT_SOME(allocator.reserve(13, 0, string("rack-1")));
+  EXPECT_SOME(allocator.reserve(1, 0, None()));
+
+  // The super-block holds a block without a label.
+  EXPECT_SOME(allocator.reserve(2, 0, string("rack-2")));
+  EXPECT_EQ(1u, allocator.topologies().size());
+
+  EXPECT_SOME_EQ(12u, allocator.allocate(0, string("rack-1")));
+  EXPECT_SOME_EQ(4u, allocator.allocate(0, string("rack-2")));
+  EXPECT_ERROR(allocator.reserve(13, 0, string("rack-1")));
+}
+
+
+// Tests that the subnets of Agents reporting a topology label are
+// allocated from a block reserved for the label.
+TEST_F(OverlayTest, checkAgentTopology)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(24);
+  overlay.set_topology_prefix(20);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_topology("rack-1");
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+
+  EXPECT_EQ("rack-1", state->agents(0).topology());
+  EXPECT_EQ("192.168.0.0/24", state->agents(0).overlays(0).subnet());
+
+  // Only the subnet of the Agent is in use, the rest of the block
+  // reserved for the label is still free.
+  JSON::Object metrics = Metrics();
+
+  const string overlayMetrics =
+    "overlay/master/overlays/" + stringify(OVERLAY_NAME) + "/";
+
+  EXPECT_EQ(1, metrics.values[overlayMetrics + "subnets_used"]);
+  EXPECT_EQ(255, metrics.values[overlayMetrics + "subnets_free"]);
+}
+
+
+// Tests that the Master routes the overlays with `host_gw` directly
+// through the Agents that enable it, and that the direct routing of an
+// Agent survives the compaction of the network state.
+TEST_F(OverlayTest, checkHostGwBackend)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(24);
+  overlay.set_host_gw(true);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_host_gw(true);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+
+  const AgentOverlayInfo& agentOverlay = state->agents(0).overlays(0);
+
+  // The VxLAN backend is still there for the peers on other segments.
+  EXPECT_TRUE(agentOverlay.backend().has_vxlan());
+  ASSERT_TRUE(agentOverlay.backend().has_host_gw());
+  EXPECT_EQ(state->agents(0).ip(), agentOverlay.backend().host_gw().ip());
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state.get(), &compactState));
+  EXPECT_TRUE(compactState.agents(0).host_gw());
+
+  State expanded;
+  ASSERT_SOME(expand(compactState, &expanded));
+  EXPECT_EQ(state->SerializeAsString(), expanded.SerializeAsString());
+}
+
+
+// Tests that the Master hands out the Geneve backend, along with the
+// tenant of the overlay, with the Geneve encapsulation, and that it
+// survives the compaction of the network state.
+TEST_F(OverlayTest, checkGeneveBackend)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(24);
+  overlay.set_tenant(42);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->set_encapsulation(
+      NetworkConfig::GENEVE);
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+
+  const AgentOverlayInfo& agentOverlay = state->agents(0).overlays(0);
+
+  EXPECT_FALSE(agentOverlay.backend().has_vxlan());
+  ASSERT_TRUE(agentOverlay.backend().has_geneve());
+  EXPECT_EQ(42u, agentOverlay.info().tenant());
+
+  const GeneveInfo& geneve = agentOverlay.backend().geneve();
+  EXPECT_EQ(1024u, geneve.vni());
+  EXPECT_EQ("gnv1024", geneve.vtep_name());
+  EXPECT_FALSE(geneve.vtep_ip().empty());
+  EXPECT_FALSE(geneve.vtep_mac().empty());
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state.get(), &compactState));
+  EXPECT_EQ("gnv1024", compactState.vtep_name());
+
+  State expanded;
+  ASSERT_SOME(expand(compactState, &expanded));
+  EXPECT_EQ(state->SerializeAsString(), expanded.SerializeAsString());
+}
+
+
+// Tests that the Master refuses an overlay with a tenant without the
+// Geneve encapsulation.
+TEST_F(OverlayTest, checkTenantNeedsGeneve)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(24);
+  overlay.set_tenant(42);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_ERROR(masterModule);
+}
+
+
+// Tests that the Master finds the Agent an overlay IP, or a VTEP IP,
+// has been allocated to.
+TEST_F(OverlayTest, checkMasterLookup)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  auto lookup = [=](const string& ip) -> Try<LookupInfo> {
+    Future<Response> response =
+      process::http::get(overlayMaster, "lookup", "ip=" + ip);
+
+    response.await();
+
+    if (!response.isReady() || response->status != OK().status) {
+      return Error("Lookup of " + ip + " failed");
+    }
+
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(response->body);
+    if (json.isError()) {
+      return Error("JSON parse failed: " + json.error());
+    }
+
+    return ::protobuf::parse<LookupInfo>(json.get());
+  };
+
+  Try<LookupInfo> info = lookup("192.168.0.10");
+  ASSERT_SOME(info);
+  EXPECT_EQ(stringify(overlayMaster.address.ip), info->agent());
+  EXPECT_EQ(OVERLAY_NAME, info->overlay());
+  EXPECT_EQ("192.168.0.0/24", info->subnet());
+
+  info = lookup("44.128.0.1");
+  ASSERT_SOME(info);
+  EXPECT_EQ(stringify(overlayMaster.address.ip), info->agent());
+  EXPECT_FALSE(info->has_overlay());
+  EXPECT_EQ("44.128.0.1/16", info->subnet());
+
+  EXPECT_ERROR(lookup("192.168.1.10"));
+
+  Future<Response> response =
+    process::http::get(overlayMaster, "lookup", "ip=192.168.1.10");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(
+      process::http::NotFound().status,
+      response);
+
+  response = process::http::get(overlayMaster, "lookup");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(
+      process::http::BadRequest().status,
+      response);
+}
+
+
+// Tests that an Agent asking for a capacity gets a subnet of the
+// matching size.
+TEST_F(OverlayTest, checkAgentCapacity)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(24);
+  overlay.set_min_prefix(21);
+  overlay.set_max_prefix(26);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_capacity(1000);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+
+  // 1000 addresses on the Mesos bridge, which gets half of the subnet
+  // less its network, broadcast and gateway addresses, need a /21.
+  EXPECT_EQ("192.168.0.0/21", state->agents(0).overlays(0).subnet());
+
+  // The metrics count subnets of the default prefix.
+  JSON::Object metrics = Metrics();
+
+  const string overlayMetrics =
+    "overlay/master/overlays/" + stringify(OVERLAY_NAME) + "/";
+
+  EXPECT_EQ(8, metrics.values[overlayMetrics + "subnets_used"]);
+  EXPECT_EQ(248, metrics.values[overlayMetrics + "subnets_free"]);
+}
+
+
+// Tests that an Agent that requests a secondary subnet of an overlay
+// gets it from the Master, and hands it to `host-local` as an
+// additional range of its Mesos network.
+TEST_F(OverlayTest, ROOT_checkSecondarySubnet)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.set_max_subnets(2);
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Ask for a secondary subnet on behalf of the Agent, instead of
+  // leasing most of the addresses of its Mesos network.
+  UPID overlayAgent = UPID(overlayMaster);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  RequestSubnetMessage request;
+  request.set_name(OVERLAY_NAME);
+  request.set_subnets(1);
+
+  process::post(overlayAgent, overlayMaster, request);
+
+  AWAIT_READY(agentRegisteredMessage);
+  ASSERT_EQ(2, agentRegisteredMessage->overlays_size());
+
+  // The request has been fulfilled already.
+  process::post(overlayAgent, overlayMaster, request);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(2, state->agents(0).overlays_size());
+
+  const AgentOverlayInfo& secondary = state->agents(0).overlays(1);
+  EXPECT_TRUE(secondary.secondary());
+  EXPECT_EQ("192.168.1.0/24", secondary.subnet());
+  EXPECT_EQ("192.168.1.0/24", secondary.mesos_bridge().ip());
+  EXPECT_FALSE(secondary.has_docker_bridge());
+
+  Try<string> cniConfig = os::read(
+      path::join("cni", stringify(OVERLAY_NAME) + ".cni"));
+  ASSERT_SOME(cniConfig);
+
+  Try<JSON::Object> json = JSON::parse<JSON::Object>(cniConfig.get());
+  ASSERT_SOME(json);
+
+  Result<JSON::Array> ranges = json->find<JSON::Array>("ipam.ranges");
+  ASSERT_SOME(ranges);
+  ASSERT_EQ(1u, ranges->values.size());
+
+  const JSON::Array& rangeSet = ranges->values[0].as<JSON::Array>();
+  ASSERT_EQ(2u, rangeSet.values.size());
+
+  EXPECT_EQ(
+      "192.168.0.0/25",
+      rangeSet.values[0].as<JSON::Object>().values.at("subnet")
+        .as<JSON::String>().value);
+
+  EXPECT_EQ(
+      "192.168.1.0/24",
+      rangeSet.values[1].as<JSON::Object>().values.at("subnet")
+        .as<JSON::String>().value);
+}
+
+
+// Tests that an overlay Master in standby mode recovers the
+// allocations by tailing the replicated log, before any Agent
+// registers with it.
+TEST_F(OverlayTest, checkMasterStandby)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir("overlay_replicated_log");
+  masterOverlayConfig.set_standby(true);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Kill the Agent and the master. The re-started master can only
+  // learn about the Agent from the replicated log.
+  agentModule->reset();
+  masterModule->reset();
+
+  masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  Try<State> state = Error("The replicated log has not been tailed");
+  Duration waited = Duration::zero();
+
+  do {
+    Future<Response> masterResponse = process::http::get(
+        overlayMaster,
+        "state");
+
+    AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+    state = parseMasterState(masterResponse->body);
+    ASSERT_SOME(state);
+
+    if (state->agents_size() > 0) {
+      break;
+    }
+
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+  } while (waited < Seconds(15));
+
+  ASSERT_EQ(1, state->agents_size());
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1, metrics.values["overlay/master/vtep/ips_used"]);
+  EXPECT_EQ(
+      1,
+      metrics.values[
+        "overlay/master/overlays/" + stringify(OVERLAY_NAME) +
+        "/subnets_used"]);
+}
+
+
+// Tests that the network state, including a secondary subnet, survives
+// a round trip through the `CompactState` encoding used by the Master
+// to checkpoint it in the replicated log.
+TEST_F(OverlayTest, checkCompactState)
+{
+  State state = createNetworkState(100);
+  addSecondary(&state, "9.200.0.0/24");
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state, &compactState));
+
+  State expanded;
+  ASSERT_SOME(expand(compactState, &expanded));
+
+  EXPECT_EQ(state.SerializeAsString(), expanded.SerializeAsString());
+}
+
+
+// Tests that the `CompactState` encoding of the network state of a
+// large cluster is a fraction of the size of the `State`.
+TEST_F(OverlayTest, checkCompactStateSize)
+{
+  const uint32_t AGENTS = 10000;
+
+  State state = createNetworkState(AGENTS);
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state, &compactState));
+
+  cout << "Network state of " << AGENTS << " Agents: "
+       << state.ByteSize() << " bytes as `State`, "
+       << compactState.ByteSize() << " bytes as `CompactState`" << endl;
+
+  EXPECT_LT(compactState.ByteSize() * 5, state.ByteSize());
+}
+
+
+// Tests that a VTEP MAC that cannot be derived from the VTEP IP cannot
+// be encoded in a `CompactState`.
+TEST_F(OverlayTest, checkCompactStateVtepMAC)
+{
+  State state = createNetworkState(2);
+
+  state.mutable_agents(0)->mutable_overlays(0)->mutable_backend()
+    ->mutable_vxlan()->set_vtep_mac("70:b3:d5:00:00:00");
+
+  CompactState compactState;
+  EXPECT_ERROR(compact(state, &compactState));
+}
+
+
+// Tests that the overlays of an Agent are matched by name only, and
+// that their info is taken from the network configuration once the
+// network state is expanded, e.g., when it was stored before a change
+// of the configuration of an overlay.
+TEST_F(OverlayTest, checkCompactStateOverlayDrift)
+{
+  State state = createNetworkState(2);
+
+  state.mutable_agents(0)->mutable_overlays(0)->mutable_info()
+    ->set_host_gw(true);
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state, &compactState));
+
+  State expanded;
+  ASSERT_SOME(expand(compactState, &expanded));
+
+  EXPECT_EQ(
+      state.network().overlays(0).SerializeAsString(),
+      expanded.agents(0).overlays(0).info().SerializeAsString());
+}
+
+
+// Tests that the `AgentTable` holding the Agents in the Master
+// reproduces the network state it is restored from.
+TEST_F(OverlayTest, checkAgentTable)
+{
+  State state = createNetworkState(100);
+  addSecondary(&state, "9.200.0.0/24");
+
+  CompactState compactState;
+  AgentTable table = createAgentTable(state, &compactState);
+  ASSERT_EQ((size_t) state.agents_size(), table.size());
+
+  CompactState encoded;
+  table.compact(&encoded);
+
+  EXPECT_EQ(compactState.SerializeAsString(), encoded.SerializeAsString());
+
+  for (int i = 0; i < state.agents_size(); i++) {
+    AgentInfo agentInfo;
+    ASSERT_SOME(table.getAgentInfo(table.records()[i], &agentInfo));
+    ASSERT_EQ(
+        state.agents(i).SerializeAsString(),
+        agentInfo.SerializeAsString());
+  }
+}
+
+
+// Tests that the `AgentTable` of a large cluster takes a fraction of
+// the memory the `State` takes.
+TEST_F(OverlayTest, checkAgentTableSize)
+{
+  const uint32_t AGENTS = 10000;
+
+  State state = createNetworkState(AGENTS);
+
+  CompactState compactState;
+  AgentTable table = createAgentTable(state, &compactState);
+
+  cout << "Network state of " << AGENTS << " Agents: "
+       << state.SpaceUsed() << " bytes as `State`, "
+       << table.bytes() << " bytes as `AgentTable`" << endl;
+
+  EXPECT_LT(table.bytes() * 4, (size_t) state.SpaceUsed());
+}
+
+
+// Tests that the `AgentTable` finds the Agent, and the overlay, an
+// address has been allocated to, in the subnets and the VTEP IPs.
+TEST_F(OverlayTest, checkAgentTableLookup)
+{
+  State state = createNetworkState(2);
+  addSecondary(&state, "9.200.0.0/24");
+
+  CompactState compactState;
+  AgentTable table = createAgentTable(state, &compactState);
+
+  Option<Allocation> allocation = table.lookup(net::IP(0x0a000105));
+  ASSERT_SOME(allocation);
+  EXPECT_EQ(1u, allocation->agent);
+  EXPECT_SOME_EQ(1u, allocation->overlay);
+
+  allocation = table.lookup(net::IP(0x09c80080));
+  ASSERT_SOME(allocation);
+  EXPECT_EQ(0u, allocation->agent);
+  EXPECT_SOME_EQ(2u, allocation->overlay);
+
+  allocation = table.lookup(net::IP(0x2c800002));
+  ASSERT_SOME(allocation);
+  EXPECT_EQ(1u, allocation->agent);
+  EXPECT_NONE(allocation->overlay);
+
+  EXPECT_NONE(table.lookup(net::IP(0x0a800000)));
+}
+
+
+// Tests that the status set on a secondary subnet in the `AgentTable`
+// only applies to it.
+TEST_F(OverlayTest, checkAgentTableStatus)
+{
+  State state = createNetworkState(2);
+  AgentOverlayInfo* secondary = addSecondary(&state, "9.200.0.0/24");
+
+  CompactState compactState;
+  AgentTable table = createAgentTable(state, &compactState);
+
+  AgentRecord* agent = table.find(net::IP(0xac100000));
+  ASSERT_NE(nullptr, agent);
+
+  secondary->mutable_state()->set_status(
+      AgentOverlayInfo::State::STATUS_OK);
+
+  ASSERT_SOME(table.setStatus(agent, *secondary));
+
+  AgentInfo agentInfo;
+  ASSERT_SOME(table.getAgentInfo(*agent, &agentInfo));
+  ASSERT_EQ(3, agentInfo.overlays_size());
+  EXPECT_FALSE(agentInfo.overlays(0).has_state());
+  EXPECT_EQ(
+      AgentOverlayInfo::State::STATUS_OK,
+      agentInfo.overlays(2).state().status());
+}
+
+
+// Tests that the `AgentTable` maps the overlays of a stored network
+// state by name onto a reordered configuration, and refuses Agents on
+// an overlay that is no longer configured.
+TEST_F(OverlayTest, checkAgentTableReordered)
+{
+  State state = createNetworkState(2);
+
+  CompactState compactState;
+  ASSERT_SOME(compact(state, &compactState));
+
+  NetworkConfig network;
+  network.CopyFrom(state.network());
+  network.mutable_overlays()->SwapElements(0, 1);
+
+  AgentTable reordered(network, 1024, "vtep1024");
+  ASSERT_SOME(reordered.restore(compactState));
+
+  AgentInfo agentInfo;
+  ASSERT_SOME(reordered.getAgentInfo(reordered.records()[1], &agentInfo));
+  EXPECT_EQ(
+      state.agents(1).SerializeAsString(),
+      agentInfo.SerializeAsString());
+
+  network.mutable_overlays()->RemoveLast();
+
+  AgentTable removed(network, 1024, "vtep1024");
+  EXPECT_ERROR(removed.restore(compactState));
+}
+
+
+// Tests that the `AgentTable` holding an earlier network state is
+// extended with the Agents and the overlays of a later one, the way a
+// Master in standby mode is promoted, and refuses a network state that
+// does not extend the one it holds.
+TEST_F(OverlayTest, checkAgentTableExtend)
+{
+  CompactState compactState;
+  AgentTable table = createAgentTable(createNetworkState(2), &compactState);
+
+  State state = createNetworkState(3);
+  addSecondary(&state, "9.200.0.0/24");
+
+  ASSERT_SOME(compact(state, &compactState));
+  ASSERT_SOME(table.extend(compactState));
+  ASSERT_EQ(3u, table.size());
+
+  CompactState encoded;
+  table.compact(&encoded);
+
+  EXPECT_EQ(compactState.SerializeAsString(), encoded.SerializeAsString());
+
+  ASSERT_SOME(compact(createNetworkState(2), &compactState));
+  EXPECT_ERROR(table.extend(compactState));
+
+  state.mutable_agents()->SwapElements(0, 1);
+
+  AgentTable swapped = createAgentTable(createNetworkState(2), &encoded);
+
+  ASSERT_SOME(compact(state, &compactState));
+  EXPECT_ERROR(swapped.extend(compactState));
+}
+
+
+// Tests that the IPAM service of the Agent leases the addresses of the
+// subnets of a Mesos network, recovers its leases from the journal,
+// and releases the leases of the containers whose network namespace
+// is gone.
+TEST_F(OverlayTest, checkIpam)
+{
+  const string directory = path::join(os::getcwd(), "ipam");
+  const string network = OVERLAY_NAME;
+
+  // Each subnet has a single address that can be leased.
+  const vector<net::IPNetwork> subnets = {
+    net::IPNetwork::parse("192.168.0.0/30", AF_INET).get(),
+    net::IPNetwork::parse("192.168.1.0/30", AF_INET).get()};
+
+  // The network namespace of the first container is there throughout
+  // the test, the one of the second container is gone.
+  const string netns = path::join(os::getcwd(), "netns");
+  ASSERT_SOME(os::touch(netns));
+
+  auto request = [&network](
+      IpamRequest::Command command,
+      const string& containerId,
+      const string& _netns) {
+    IpamRequest request;
+    request.set_command(command);
+    request.set_network(network);
+    request.set_container_id(containerId);
+    request.set_ifname("eth0");
+    request.set_netns(_netns);
+    return request;
+  };
+
+  Try<Owned<IpamProcess>> service = IpamProcess::create(directory);
+  ASSERT_SOME(service);
+
+  spawn(service->get());
+
+  const string socket = service.get()->socket();
+
+  // Requests for a network that has not been configured fail.
+  Try<IpamResponse> response =
+    ipam(socket, request(IpamRequest::ADD, "container1", netns));
+
+  ASSERT_SOME(response);
+  EXPECT_TRUE(response->has_error());
+
+  AWAIT_READY(dispatch(
+      service->get(),
+      &IpamProcess::configure,
+      network,
+      subnets));
+
+  response = ipam(socket, request(IpamRequest::ADD, "container1", netns));
+  ASSERT_SOME(response);
+  ASSERT_FALSE(response->has_error()) << response->error();
+  EXPECT_EQ("192.168.0.2/30", response->ip());
+  EXPECT_EQ("192.168.0.1", response->gateway());
+
+  // Leases are handed out again to the container holding them.
+  response = ipam(socket, request(IpamRequest::ADD, "container1", netns));
+  ASSERT_SOME(response);
+  EXPECT_EQ("192.168.0.2/30", response->ip());
+
+  response = ipam(socket, request(IpamRequest::ADD, "container2", "gone"));
+  ASSERT_SOME(response);
+  ASSERT_FALSE(response->has_error()) << response->error();
+  EXPECT_EQ("192.168.1.2/30", response->ip());
+  EXPECT_EQ("192.168.1.1", response->gateway());
+
+  response = ipam(socket, request(IpamRequest::ADD, "container3", netns));
+  ASSERT_SOME(response);
+  EXPECT_TRUE(response->has_error());
+
+  AWAIT_EXPECT_EQ(
+      2u,
+      dispatch(service->get(), &IpamProcess::leases, network));
+
+  terminate(service->get());
+  wait(service->get());
+
+  // The leases are recovered by the next instance of the service.
+  service = IpamProcess::create(directory);
+  ASSERT_SOME(service);
+
+  spawn(service->get());
+
+  AWAIT_READY(dispatch(
+      service->get(),
+      &IpamProcess::configure,
+      network,
+      subnets));
+
+  AWAIT_EXPECT_EQ(
+      2u,
+      dispatch(service->get(), &IpamProcess::leases, network));
+
+  response = ipam(socket, request(IpamRequest::ADD, "container1", netns));
+  ASSERT_SOME(response);
+  EXPECT_EQ("192.168.0.2/30", response->ip());
+
+  AWAIT_EXPECT_EQ(1u, dispatch(service->get(), &IpamProcess::gc));
+
+  response = ipam(socket, request(IpamRequest::ADD, "container3", netns));
+  ASSERT_SOME(response);
+  ASSERT_FALSE(response->has_error()) << response->error();
+  EXPECT_EQ("192.168.1.2/30", response->ip());
+
+  // Releasing a lease twice is not an error.
+  response = ipam(socket, request(IpamRequest::DEL, "container1", netns));
+  ASSERT_SOME(response);
+  EXPECT_FALSE(response->has_error());
+
+  response = ipam(socket, request(IpamRequest::DEL, "container1", netns));
+  ASSERT_SOME(response);
+  EXPECT_FALSE(response->has_error());
+
+  AWAIT_EXPECT_EQ(
+      1u,
+      dispatch(service->get(), &IpamProcess::leases, network));
+
+  terminate(service->get());
+  wait(service->get());
+}
+
+
+// Measures the allocations and the latency of a write of the network
+// state of a large cluster by the Master: the encoding of its `AgentTable` into a
+// `CompactState` and the serialization of it, the way `store()` does
+// before handing it to the replicated log. Each write is measured with
+// a fresh `CompactState` and with one reused across writes.
+TEST_F(OverlayTest, BENCHMARK_StateWrite)
+{
+  const uint32_t AGENTS = 10000;
+  const uint32_t WRITES = 10;
+
+  State state = createNetworkState(AGENTS);
+
+  CompactState compactState;
+  AgentTable table = createAgentTable(state, &compactState);
+
+  CompactState scratch;
+
+  for (int reuse = 0; reuse < 2; reuse++) {
+    const uint64_t allocated = allocations;
+
+    Stopwatch watch;
+    watch.start();
+
+    size_t bytes = 0;
+
+    for (uint32_t i = 0; i < WRITES; i++) {
+      // Every write adds an Agent, like the `AddAgent` operation.
+      table.add(
+          net::IP(0xac200000 + reuse * WRITES + i),
+          net::IP(0x2c808000 + reuse * WRITES + i),
+          None());
+
+      string data;
+
+      if (!reuse) {
+        CompactState _compactState;
+        table.compact(&_compactState);
+        ASSERT_TRUE(_compactState.SerializeToString(&data));
+      } else {
+        table.compact(&scratch);
+        ASSERT_TRUE(scratch.SerializeToString(&data));
+      }
+
+      bytes = data.size();
+    }
+
+    watch.stop();
+
+    cout << "Writing the network state of " << table.size() << " Agents ("
+         << bytes << " bytes) " << (reuse ? "with" : "without")
+         << " a reused `CompactState` took " << watch.elapsed() / WRITES
+         << " and " << (allocations - allocated) / WRITES
+         << " allocations per write" << endl;
+  }
+
+  EXPECT_EQ(AGENTS + 2 * WRITES, table.size());
+}
+
+
+// Sends `count` UDP packets from `source` to `destination` out of the
+// network namespace `netns`, each one of a new flow, and returns how
+// long it took. The packets go through the nat table of the namespace
+// as they would on an agent, since every one of them is a new
+// connection.
+static Try<Duration> sendFlows(
+    const string& netns,
+    const net::IP& source,
+    const net::IP& destination,
+    size_t count)
+{
+  Try<int> self = os::open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (self.isError()) {
+    return Error(self.error());
+  }
+
+  Try<int> target = os::open(
+      path::join("/var/run/netns", netns),
+      O_RDONLY | O_CLOEXEC);
+
+  if (target.isError()) {
+    os::close(self.get());
+    return Error(target.error());
+  }
+
+  // The socket stays in the namespace it is opened in.
+  int fd = -1;
+  if (::setns(target.get(), CLONE_NEWNET) == 0) {
+    fd = ::socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    CHECK_EQ(0, ::setns(self.get(), CLONE_NEWNET));
+  }
+
+  os::close(target.get());
+  os::close(self.get());
+
+  if (fd < 0) {
+    return ErrnoError("Failed to open a raw socket in '" + netns + "'");
+  }
+
+  struct {
+    struct iphdr ip;
+    struct udphdr udp;
+    char payload[18];
+  } __attribute__((packed)) packet;
+
+  memset(&packet, 0, sizeof(packet));
+  packet.ip.version = 4;
+  packet.ip.ihl = 5;
+  packet.ip.ttl = 64;
+  packet.ip.protocol = IPPROTO_UDP;
+  packet.ip.tot_len = htons(sizeof(packet));
+  packet.ip.saddr = source.in()->s_addr;
+  packet.ip.daddr = destination.in()->s_addr;
+  packet.udp.len = htons(sizeof(packet) - sizeof(packet.ip));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr = destination.in().get();
+
+  Stopwatch watch;
+  watch.start();
+
+  for (size_t i = 0; i < count; i++) {
+    packet.udp.source = htons(1024 + i % 60000);
+    packet.udp.dest = htons(1024 + i / 60000);
+
+    if (::sendto(
+            fd,
+            &packet,
+            sizeof(packet),
+            0,
+            (struct sockaddr*) &address,
+            sizeof(address)) < 0) {
+      ErrnoError error("Failed to send packet");
+      os::close(fd);
+      return error;
+    }
+  }
+
+  watch.stop();
+  os::close(fd);
+
+  return watch.elapsed();
+}
+
+
+// Measures the packet rate of new flows leaving an overlay through the
+// nat table, masqueraded by a rule per overlay and by the single rule
+// looking the source up in the ipset, for a growing number of
+// overlays. The packets come from the last overlay, whose rule is the
+// last one the kernel evaluates. Each run has a network namespace of
+// its own, so that it starts with an empty conntrack table.
+TEST_F(OverlayTest, ROOT_BENCHMARK_MasqueradePacketRate)
+{
+  const size_t PACKETS = 50000;
+  const string IPSET = "overlay-benchmark";
+  const string DESTINATION = "172.31.0.2";
+
+  foreach (size_t overlays, vector<size_t>{1, 16, 256}) {
+    foreach (bool ipset, vector<bool>{false, true}) {
+      const string netns = "overlay-benchmark";
+      const string exec = "ip netns exec " + netns + " ";
+
+      // Traffic to the destination goes out of a veth pair, after the
+      // nat table, and is dropped by its other end.
+      string script =
+        "ip netns add " + netns + " && " +
+        exec + "ip link add bench0 type veth peer name bench1 && " +
+        exec + "ip addr add 172.31.0.1/24 dev bench0 && " +
+        exec + "ip link set bench0 up && " +
+        exec + "ip link set bench1 up && " +
+        exec + "ip neigh add " + DESTINATION +
+          " lladdr 02:00:00:00:00:02 dev bench0 && " +
+        exec + "ipset create " + IPSET + " hash:net && " +
+        exec + "ipset add " + IPSET + " 0.0.0.0/1 && " +
+        exec + "ipset add " + IPSET + " 128.0.0.0/1";
+
+      for (size_t i = 0; i < overlays; i++) {
+        const string subnet = "10." + stringify(i) + ".0.0/16";
+
+        script += " && " + exec + "ipset add " + IPSET + " " + subnet +
+                  " nomatch";
+
+        if (!ipset) {
+          script += " && " + exec + "iptables -t nat -A POSTROUTING -s " +
+                    subnet + " -m set --match-set " + IPSET +
+                    " dst -j MASQUERADE";
+        }
+      }
+
+      if (ipset) {
+        script += " && " + exec + "iptables -t nat -A POSTROUTING "
+                  "-m set ! --match-set " + IPSET + " src "
+                  "-m set --match-set " + IPSET + " dst -j MASQUERADE";
+      }
+
+      AWAIT_READY(runScriptCommand(script));
+
+      Try<Duration> elapsed = sendFlows(
+          netns,
+          net::IP::parse("10." + stringify(overlays - 1) + ".0.2", AF_INET)
+            .get(),
+          net::IP::parse(DESTINATION, AF_INET).get(),
+          PACKETS);
+
+      AWAIT_READY(runScriptCommand(
+          exec + "iptables -t nat -F POSTROUTING && " +
+          exec + "ipset destroy " + IPSET + " && " +
+          "ip netns del " + netns));
+
+      ASSERT_SOME(elapsed);
+
+      cout << "Masquerading " << PACKETS << " new flows of the last of "
+           << overlays << " overlays with "
+           << (ipset ? "a single ipset rule" : "a rule per overlay")
+           << " took " << elapsed.get() << " ("
+           << (uint64_t) (PACKETS / elapsed->secs()) << " packets/s)"
+           << endl;
+    }
+  }
+}
+
+
+// Measures the latency of attaching containers to the Mesos bridge of
+// an overlay and of removing them from it, with the overlay CNI plugin
+// and, if it is installed, with the CNI `bridge` plugin. Both lease the
+// addresses from the IPAM service of the agent.
+TEST_F(OverlayTest, ROOT_BENCHMARK_ContainerAttach)
+{
+  const size_t CONTAINERS = 50;
+  const string network = "benchmark";
+  const string bridge = "m-benchmark";
+  const string CNI_BIN_DIR = "/opt/cni/bin";
+
+  Try<Owned<IpamProcess>> service =
+    IpamProcess::create(path::join(os::getcwd(), "ipam"));
+
+  ASSERT_SOME(service);
+
+  spawn(service->get());
+
+  AWAIT_READY(dispatch(
+      service->get(),
+      &IpamProcess::configure,
+      network,
+      vector<net::IPNetwork>{
+        net::IPNetwork::parse("192.168.0.0/24", AF_INET).get()}));
+
+  const string socket = service.get()->socket();
+
+  vector<string> plugins = {path::join(MODULES_BUILD_DIR, "mesos-overlay-cni")};
+  if (os::exists(path::join(CNI_BIN_DIR, "bridge"))) {
+    plugins.push_back(path::join(CNI_BIN_DIR, "bridge"));
+  }
+
+  auto netns = [](size_t i) {
+    return "overlay-benchmark-" + stringify(i);
+  };
+
+  for (size_t i = 0; i < CONTAINERS; i++) {
+    AWAIT_READY(runScriptCommand("ip netns add " + netns(i)));
+  }
+
+  foreach (const string& plugin, plugins) {
+    const string type = Path(plugin).basename();
+    const string config = path::join(os::getcwd(), type + ".json");
+
+    ASSERT_SOME(os::write(config, jsonify([&](JSON::ObjectWriter* writer) {
+      writer->field("name", network);
+      writer->field("type", type);
+      writer->field("bridge", bridge);
+      writer->field("isGateway", true);
+      writer->field("ipMasq", false);
+      writer->field("mtu", 1420);
+
+      writer->field("ipam", [&](JSON::ObjectWriter* writer) {
+        writer->field("type", IPAM_PLUGIN);
+        writer->field("socket", socket);
+
+        writer->field("routes", [](JSON::ArrayWriter* writer) {
+          writer->element([](JSON::ObjectWriter* writer) {
+            writer->field("dst", "0.0.0.0/0");
+          });
+        });
+      });
+    })));
+
+    foreach (const string& command, vector<string>{"ADD", "DEL"}) {
+      Stopwatch watch;
+      watch.start();
+
+      for (size_t i = 0; i < CONTAINERS; i++) {
+        AWAIT_READY(runScriptCommand(
+            "CNI_COMMAND=" + command +
+            " CNI_CONTAINERID=container" + stringify(i) +
+            " CNI_NETNS=/var/run/netns/" + netns(i) +
+            " CNI_IFNAME=eth0" +
+            " CNI_PATH=" + string(MODULES_BUILD_DIR) + ":" + CNI_BIN_DIR +
+            " " + plugin + " < " + config));
+      }
+
+      watch.stop();
+
+      cout << (command == "ADD" ? "Attaching " : "Removing ") << CONTAINERS
+           << " containers with `" << type << "` took " << watch.elapsed()
+           << " (" << watch.elapsed() / CONTAINERS << " per container)"
+           << endl;
+    }
+
+    AWAIT_EXPECT_EQ(
+        0u,
+        dispatch(service->get(), &IpamProcess::leases, network));
+  }
+
+  for (size_t i = 0; i < CONTAINERS; i++) {
+    AWAIT_READY(runScriptCommand("ip netns del " + netns(i)));
+  }
+
+  AWAIT_READY(runScriptCommand("ip link del " + bridge));
+
+  terminate(service->get());
+  wait(service->get());
+}
+
+
+// Tests that the IPAM service samples the traffic of the containers
+// whose ingress is limited, on the host end of their veth pairs.
+TEST_F(OverlayTest, ROOT_checkContainerTraffic)
+{
+  const string network = OVERLAY_NAME;
+
+  Try<Owned<IpamProcess>> service =
+    IpamProcess::create(path::join(os::getcwd(), "ipam"));
+
+  ASSERT_SOME(service);
+
+  spawn(service->get());
+
+  AWAIT_READY(dispatch(
+      service->get(),
+      &IpamProcess::configure,
+      network,
+      vector<net::IPNetwork>{
+        net::IPNetwork::parse("192.168.0.0/24", AF_INET).get()}));
+
+  // Only the first container has a limit.
+  const vector<string> containerIds = {"container1", "container2"};
+
+  vector<string> veths;
+  foreach (const string& containerId, containerIds) {
+    IpamRequest request;
+    request.set_command(IpamRequest::ADD);
+    request.set_network(network);
+    request.set_container_id(containerId);
+    request.set_ifname("eth0");
+
+    Try<IpamResponse> response = ipam(service.get()->socket(), request);
+    ASSERT_SOME(response);
+    ASSERT_FALSE(response->has_error()) << response->error();
+
+    const string veth = cni::vethName(containerId, "eth0");
+    veths.push_back(veth);
+
+    AWAIT_READY(runScriptCommand(
+        "ip link add " + veth + " type veth peer name " + veth + "p"));
+  }
+
+  AWAIT_READY(runScriptCommand(
+      "tc qdisc add dev " + veths[0] + " root handle 1: "
+      "tbf rate 10mbit burst 15140 latency 50ms"));
+
+  Future<Try<vector<TrafficInfo>>> traffic =
+    dispatch(service->get(), &IpamProcess::traffic, network);
+
+  AWAIT_READY(traffic);
+  ASSERT_SOME(traffic.get());
+  ASSERT_EQ(1u, traffic->get().size());
+
+  const TrafficInfo& info = traffic->get().front();
+  EXPECT_EQ(TrafficInfo::INGRESS, info.direction());
+  EXPECT_EQ(veths[0], info.device());
+  EXPECT_EQ("container1", info.container_id());
+
+  terminate(service->get());
+  wait(service->get());
+
+  foreach (const string& veth, veths) {
+    AWAIT_READY(runScriptCommand("ip link del " + veth));
+  }
+}
+
+
+// Tests that the Agent samples the counters of the bridges of an
+// overlay, and publishes them on its `overlay` endpoint and as
+// metrics.
+TEST_F(OverlayTest, ROOT_checkOverlayCounters)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Clock::pause();
+
+  Try<Owned<Anonymous>> agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // The bridge is created by the CNI plugin for the first container
+  // of the overlay on a real Agent.
+  const string bridge = MESOS_BRIDGE_PREFIX + stringify(OVERLAY_NAME);
+
+  AWAIT_READY(runScriptCommand("ip link add " + bridge + " type bridge"));
+
+  // The Agent samples the counters every 10 seconds.
+  Clock::advance(Seconds(10));
+  Clock::settle();
+
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_TRUE(info->overlays(0).has_counters());
+
+  const string overlayMetrics =
+    "overlay/agent/overlays/" + stringify(OVERLAY_NAME) + "/";
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1u, metrics.values.count(overlayMetrics + "egress_bytes"));
+  EXPECT_EQ(
+      1u,
+      metrics.values.count(overlayMetrics + "ingress_bits_per_second"));
+
+  Clock::resume();
+
+  AWAIT_READY(runScriptCommand("ip link del " + bridge));
+}
+
+
+// Tests that the prober measures the latency of the targets that
+// answer its probes, and the loss of the ones that do not.
+TEST_F(OverlayTest, ROOT_checkProber)
+{
+  Try<Owned<ProberProcess>> prober =
+    ProberProcess::create(Milliseconds(100), Milliseconds(50), 4);
+
+  ASSERT_SOME(prober);
+
+  spawn(prober->get());
+
+  const string prefix = "overlay/agent/probes/";
+  const string loopback = prefix + "127.0.0.1/";
+
+  vector<net::IP> peers = {net::IP::parse("127.0.0.1", AF_INET).get()};
+
+  dispatch(prober->get(), &ProberProcess::update, peers);
+
+  JSON::Object metrics;
+  Duration waited = Duration::zero();
+  do {
+    metrics = Metrics();
+    if (metrics.values.count(loopback + "latency_ms") > 0) {
+      break;
+    }
+
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+  } while (waited < Seconds(15));
+
+  ASSERT_EQ(1u, metrics.values.count(loopback + "latency_ms"));
+  EXPECT_EQ(0, metrics.values[loopback + "loss_percent"]);
+
+  // TEST-NET-1 addresses are never answered.
+  const string unreachable = prefix + "192.0.2.1/";
+
+  peers = {net::IP::parse("192.0.2.1", AF_INET).get()};
+
+  dispatch(prober->get(), &ProberProcess::update, peers);
+
+  waited = Duration::zero();
+  do {
+    metrics = Metrics();
+    if (metrics.values.count(unreachable + "loss_percent") > 0 &&
+        metrics.values[unreachable + "loss_percent"] == 100) {
+      break;
+    }
+
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+  } while (waited < Seconds(15));
+
+  EXPECT_EQ(100, metrics.values[unreachable + "loss_percent"]);
+  EXPECT_EQ(0u, metrics.values.count(unreachable + "latency_ms"));
+  EXPECT_EQ(0u, metrics.values.count(loopback + "loss_percent"));
+
+  terminate(prober->get());
+  wait(prober->get());
+}
+
+
+// Tests that the neighbours and the forwarding entries of a VxLAN VTEP,
+// as set with neighbour suppression, are listed and removed.
+TEST_F(OverlayTest, ROOT_checkVtepNeighbours)
+{
+  const string netns = "overlay-neighbours";
+  const string exec = "ip netns exec " + netns + " ";
+
+  AWAIT_READY(runScriptCommand(
+      "ip netns add " + netns + " && " +
+      exec + "ip link add vtep1024 type vxlan id 1024 dstport 4789 && " +
+      exec + "ip link set vtep1024 up"));
+
+  Try<int> fd = netlink::socket(path::join("/var/run/netns", netns));
+  ASSERT_SOME(fd);
+
+  Result<int> index = netlink::link(fd.get(), "vtep1024");
+  ASSERT_SOME(index);
+
+  const net::IP vtepIP = net::IP::parse("44.128.0.2", AF_INET).get();
+  const net::IP remote = net::IP::parse("192.168.0.2", AF_INET).get();
+
+  const uint8_t bytes[6] = {0x70, 0xb3, 0xd5, 0x00, 0x00, 0x02};
+  const net::MAC vtepMAC(bytes);
+
+  netlink::Batch batch;
+  netlink::neighbour(&batch, vtepIP, vtepMAC, index.get());
+  netlink::fdb(&batch, vtepMAC, remote, index.get());
+
+  ASSERT_SOME(netlink::send(fd.get(), batch));
+
+  Try<vector<netlink::Neighbour>> neighbours =
+    netlink::neighbours(fd.get(), index.get());
+
+  ASSERT_SOME(neighbours);
+  ASSERT_EQ(1u, neighbours->size());
+  EXPECT_EQ(vtepIP, neighbours->front().ip);
+  EXPECT_EQ(vtepMAC, neighbours->front().mac);
+
+  Try<vector<netlink::Neighbour>> fdbs = netlink::fdbs(fd.get(), index.get());
+
+  ASSERT_SOME(fdbs);
+  ASSERT_EQ(1u, fdbs->size());
+  EXPECT_EQ(remote, fdbs->front().ip);
+  EXPECT_EQ(vtepMAC, fdbs->front().mac);
+
+  // Removing the entries twice succeeds, as they might be gone already.
+  batch = netlink::Batch();
+  netlink::unneighbour(&batch, vtepIP, index.get());
+  netlink::unfdb(&batch, vtepMAC, remote, index.get());
+  netlink::unneighbour(&batch, vtepIP, index.get());
+  netlink::unfdb(&batch, vtepMAC, remote, index.get());
+
+  ASSERT_SOME(netlink::send(fd.get(), batch));
+
+  neighbours = netlink::neighbours(fd.get(), index.get());
+  ASSERT_SOME(neighbours);
+  EXPECT_TRUE(neighbours->empty());
+
+  fdbs = netlink::fdbs(fd.get(), index.get());
+  ASSERT_SOME(fdbs);
+  EXPECT_TRUE(fdbs->empty());
+
+  os::close(fd.get());
+
+  AWAIT_READY(runScriptCommand("ip netns del " + netns));
+}
+
+
 // Tests if reserved network names are correctly rejected by the
 // master overlay module.
 TEST_F(OverlayTest, checkReservedNetworks)